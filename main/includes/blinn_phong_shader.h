@@ -4,6 +4,7 @@
 #include "shader_program.h"
 #include "ers/matrix.h"
 #include "image.h"
+#include "light_grid.h"
 
 class BlinnPhongShader : public IShaderProgram
 {
@@ -15,14 +16,16 @@ ERS_SHADER_DEFINE_VARYINGS
     ers::vec3 normal;
     ers::vec2 texcoord;
     ers::vec4 lightspace_fragpos;
+    ers::vec3 random_color; // flat, every fragment of a triangle gets its first vertex's.
 })
+ERS_SHADER_DEFINE_FLAT_VARYINGS(random_color)
+ERS_SHADER_DEFINE_CLONE(BlinnPhongShader)
 
 private:    
-    ers::vec3 m_randomColor;
-    ers::vec3 m_d01;
-    ers::vec3 m_d02;
-    ers::vec3 m_du;
-    ers::vec3 m_dv;
+    ers::mat4 m_lightspaceModel;
+    ers::vec3 m_faceNormal;
+    ers::vec3 m_tangent; // in the triangle's plane, see SetupTriangle.
+    ers::vec3 m_bitangent;
     
 public:
     ers::vec3 uniform_light_pos;
@@ -35,12 +38,17 @@ public:
     Image* sampler2d_specular_map;
     Image* sampler2d_shadow_map;
 
+    // Point lights added on top of the light above, each fragment only shading the ones of its tile (see LightGrid). 
+    // The grid has to be built for the renderer's viewport. nullptr for none.
+    const LightGrid* uniform_light_grid;
+
     ers::mat4 uniform_mvp_mat;
     ers::mat4 uniform_model;
     ers::mat3 uniform_model_it;
     ers::mat4 uniform_lightspace_mat;
 
     f32 uniform_zFar;
+    f32 uniform_alpha;
 
     bool uniform_do_random_color;
     bool uniform_do_specific_color;
@@ -95,9 +103,11 @@ public:
         }
         else
         {
-            const ers::mat3 Ainv = ers::inverse(ers::transpose(ers::mat3(m_d01, m_d02, n)));
-            const ers::vec3 T = ers::normalize(Ainv * m_du);
-            const ers::vec3 B = ers::normalize(Ainv * m_dv);
+            // The tangent and bitangent solving the texture coordinate equations of the triangle while being orthogonal 
+            // to n are the ones in the triangle's plane, moved along its normal.
+            const f32 n_dot_face = ers::dot(n, m_faceNormal);
+            const ers::vec3 T = ers::normalize(m_tangent - (ers::dot(n, m_tangent) / n_dot_face) * m_faceNormal);
+            const ers::vec3 B = ers::normalize(m_bitangent - (ers::dot(n, m_bitangent) / n_dot_face) * m_faceNormal);
             const ers::mat3 tbn(T, B, n);
             sampler2d_normal_map->Get(m_varsInterpolated.texcoord.x(), m_varsInterpolated.texcoord.y(), normal);
             normal = 2.0f * normal - ers::vec3(1.0f);
@@ -127,7 +137,7 @@ public:
         ers::vec3 diffuse_sample;
         if (uniform_do_random_color) 
         {
-            diffuse_sample = m_randomColor;
+            diffuse_sample = m_varsInterpolated.random_color;
         }
         else if (uniform_do_specific_color || sampler2d_diffuse_map == nullptr)
         {
@@ -140,11 +150,35 @@ public:
         return diffuse_sample;
     }
 
+    // Hashed from the vertex's attributes in model space instead of ers::random_frac(), since vertices are shaded 
+    // on several threads at once, and so that the color stays the same from frame to frame.
+    static ers::vec3 get_random_color(const VertexAttributes1& vert)
+    {
+        const f32 attributes[6] = { vert.aPos.x(), vert.aPos.y(), vert.aPos.z(), vert.aNormal.x(), vert.aNormal.y(), vert.aNormal.z() };
+        u32 seed = 0;
+        for (s32 i = 0; i < 6; ++i)
+        {
+            u32 bits;
+            memcpy(&bits, &attributes[i], sizeof(u32));
+            seed = ers::pcg_hash(seed ^ bits);
+        }
+        ers::vec3 color;
+        seed = ers::pcg_hash(seed); color.x() = (f32)(seed & 0xff) / 255.0f;
+        seed = ers::pcg_hash(seed); color.y() = (f32)(seed & 0xff) / 255.0f;
+        seed = ers::pcg_hash(seed); color.z() = (f32)(seed & 0xff) / 255.0f;
+        return color;
+    }
+
     ers::vec3 get_light_direction()
     {
         return (uniform_do_point_light) ? ers::normalize(uniform_light_pos - m_varsInterpolated.fragpos) : (-uniform_light_dir);
     }
 
+    void BeginDraw() override
+    {
+        m_lightspaceModel = uniform_lightspace_mat * uniform_model;
+    }
+
     void VertexShader(
         const void* in0, const void* in1, const void* in2,
         ers::vec4& p0, ers::vec4& p1, ers::vec4& p2        
@@ -153,27 +187,94 @@ public:
         p0 = VertexShaderPerVertex(in0, 0);
 		p1 = VertexShaderPerVertex(in1, 1);
 		p2 = VertexShaderPerVertex(in2, 2);
+    }
 
-        m_randomColor = ers::vec3((f32)ers::random_frac(), (f32)ers::random_frac(), (f32)ers::random_frac());
+    void SetupTriangle(const f32* vars0, const f32* vars1, const f32* vars2) override
+    {
+        const Varyings& v0 = *reinterpret_cast<const Varyings*>(vars0);
+        const Varyings& v1 = *reinterpret_cast<const Varyings*>(vars1);
+        const Varyings& v2 = *reinterpret_cast<const Varyings*>(vars2);
 
-        m_d01 = m_vars[1].fragpos - m_vars[0].fragpos;
-        m_d02 = m_vars[2].fragpos - m_vars[0].fragpos;
-        m_du = ers::vec3(m_vars[1].texcoord.x() - m_vars[0].texcoord.x(), m_vars[2].texcoord.x() - m_vars[0].texcoord.x(), 0.0f);
-        m_dv = ers::vec3(m_vars[1].texcoord.y() - m_vars[0].texcoord.y(), m_vars[2].texcoord.y() - m_vars[0].texcoord.y(), 0.0f);
+        if (sampler2d_normal_map == nullptr) return;
+
+        // Tangent and bitangent in the triangle's plane: t . d01 = du.x, t . d02 = du.y and t . face_normal = 0.
+        const ers::vec3 d01 = v1.fragpos - v0.fragpos;
+        const ers::vec3 d02 = v2.fragpos - v0.fragpos;
+        const ers::vec3 du(v1.texcoord.x() - v0.texcoord.x(), v2.texcoord.x() - v0.texcoord.x(), 0.0f);
+        const ers::vec3 dv(v1.texcoord.y() - v0.texcoord.y(), v2.texcoord.y() - v0.texcoord.y(), 0.0f);
+        m_faceNormal = ers::normalize(ers::cross(d01, d02));
+        const ers::mat3 Ainv = ers::inverse(ers::transpose(ers::mat3(d01, d02, m_faceNormal)));
+        m_tangent = Ainv * du;
+        m_bitangent = Ainv * dv;
     }
 
-    ers::vec4 VertexShaderPerVertex(const void* in, s32 which_vert)
+    ers::vec4 VertexShaderPerVertex(const void* in, s32 which_vert) override
     {       
         const VertexAttributes1* vert = (const VertexAttributes1*)in;
         m_vars[which_vert].fragpos = ers::vec3(uniform_model * ers::vec4(vert->aPos, 1.0f));		
 		m_vars[which_vert].normal = uniform_model_it * vert->aNormal;		
         m_vars[which_vert].texcoord = vert->aTexcoord;
-        m_vars[which_vert].lightspace_fragpos = uniform_lightspace_mat * uniform_model * ers::vec4(vert->aPos, 1.0f);	
+        m_vars[which_vert].lightspace_fragpos = m_lightspaceModel * ers::vec4(vert->aPos, 1.0f);	
+        m_vars[which_vert].random_color = (uniform_do_random_color) ? get_random_color(*vert) : ers::vec3(0.0f);
 
 		const ers::vec4 position = uniform_mvp_mat * ers::vec4(vert->aPos, 1.0f);       
         return position;
     }
 
+    bool HasPacketVertexShader() const override { return true; }
+
+    void VertexShaderPacket(const VertexPacket& packet, PacketVec4& out) override
+    {
+        const PacketVec4 pos(packet.LoadVec3(offsetof(VertexAttributes1, aPos)), PacketF32(1.0f));
+        const PacketVec4 fragpos = packet_transform(uniform_model, pos);
+        PacketVec3(fragpos.x, fragpos.y, fragpos.z).Store(packet.vars + ERS_SHADER_VARYING_INDEX(fragpos));
+        packet_transform(uniform_model_it, packet.LoadVec3(offsetof(VertexAttributes1, aNormal))).Store(packet.vars + ERS_SHADER_VARYING_INDEX(normal));
+        packet.vars[ERS_SHADER_VARYING_INDEX(texcoord) + 0] = packet.LoadF32(offsetof(VertexAttributes1, aTexcoord));
+        packet.vars[ERS_SHADER_VARYING_INDEX(texcoord) + 1] = packet.LoadF32(offsetof(VertexAttributes1, aTexcoord) + sizeof(f32));
+        packet_transform(m_lightspaceModel, pos).Store(packet.vars + ERS_SHADER_VARYING_INDEX(lightspace_fragpos));
+
+        // The hash has no vector equivalent, it's computed lane by lane.
+        f32 colors[3][ERS_PACKET_LANES];
+        for (s32 i = 0; i < ERS_PACKET_LANES; ++i)
+        {
+            const ers::vec3 color = (uniform_do_random_color) ? get_random_color(*(const VertexAttributes1*)packet.in[i]) : ers::vec3(0.0f);
+            colors[0][i] = color.x();
+            colors[1][i] = color.y();
+            colors[2][i] = color.z();
+        }
+        PacketVec3(PacketF32::Load(colors[0]), PacketF32::Load(colors[1]), PacketF32::Load(colors[2])).Store(packet.vars + ERS_SHADER_VARYING_INDEX(random_color));
+
+        out = packet_transform(uniform_mvp_mat, pos);
+    }
+
+    ers::vec3 get_point_lights_color(const ers::vec3& normal, const ers::vec3& view_dir, f32 shininess, const ers::vec3& diffuse_color, f32 specular_intensity)
+    {
+        ers::vec3 color(0.0f, 0.0f, 0.0f);
+        s32 count = 0;
+        const s32* indices = uniform_light_grid->GetTileLights(m_fragCoord.x(), m_fragCoord.y(), count);
+        const PointLight* lights = uniform_light_grid->GetLights();
+        for (s32 i = 0; i < count; ++i)
+        {
+            const PointLight& light = lights[indices[i]];
+            const ers::vec3 to_light = light.position - m_varsInterpolated.fragpos;
+            const f32 dist_sq = ers::dot(to_light, to_light);
+            const f32 radius_sq = light.radius * light.radius;
+            if (dist_sq >= radius_sq) continue;
+
+            // Inverse square falloff, windowed to reach 0 at the light's radius.
+            const f32 ratio_sq = dist_sq / radius_sq;
+            const f32 window = 1.0f - ratio_sq * ratio_sq;
+            const f32 attenuation = window * window / (1.0f + dist_sq);
+
+            const ers::vec3 light_dir = to_light / sqrtf(ers::max(dist_sq, 1.0e-8f));
+            const f32 diff_val = ers::max(0.0f, ers::dot(normal, light_dir));
+            const ers::vec3 half_dir = ers::normalize(light_dir + view_dir);
+            const f32 spec_val = pow(ers::max(0.0f, ers::dot(normal, half_dir)), shininess);
+            color += attenuation * light.color * (diffuse_color * diff_val + ers::vec3(specular_intensity * spec_val));
+        }
+        return color;
+    }
+
     bool FragmentShader(ers::vec4& out) override
     {                
         ers::vec3 normal = get_normal();
@@ -200,7 +301,10 @@ public:
         else 
             final_color = diffuse_color * (amb_val + (1.0f - shadow_val) * diff_val) + ers::vec3((1.0f - shadow_val) * light_specular_intensity * spec_val);
 
-        out = ers::vec4(final_color, 1.0f);     
+        if (uniform_light_grid != nullptr)
+            final_color += get_point_lights_color(normal, view_dir, shininess, diffuse_color, light_specular_intensity);
+
+        out = ers::vec4(final_color, uniform_alpha);     
         return false;
     }  
 };
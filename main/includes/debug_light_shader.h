@@ -9,6 +9,7 @@ class DebugLightShader : public IShaderProgram
 {
 
 ERS_SHADER_DEFINE_VARYINGS(m_vars, m_varsInterpolated, { ers::vec3 fragpos; })
+ERS_SHADER_DEFINE_CLONE(DebugLightShader)
 
 public:
     ers::mat4 uniform_mvp_mat;
@@ -28,7 +29,7 @@ public:
 		p2 = VertexShaderPerVertex(in2, 2);
     }
 
-    ers::vec4 VertexShaderPerVertex(const void* in, s32 which_vert)
+    ers::vec4 VertexShaderPerVertex(const void* in, s32 which_vert) override
     {       
         const VertexAttributes1* vert = (const VertexAttributes1*)in;
         m_vars[which_vert].fragpos = ers::vec3(uniform_model * ers::vec4(vert->aPos, 1.0f));		
@@ -52,6 +53,27 @@ public:
         out = ers::vec4(t * uniform_color + s * (1.0f - t) * (ers::vec3(1.0f) - uniform_color), 1.0f);     
         return false;
     }  
+
+    bool HasPacketShader() const override { return true; }
+
+    u32 FragmentShaderPacket(const FragmentPacket& packet, PacketVec4& out) override
+    {
+        const PacketVec3 fragpos = PacketVec3::Load(packet.vars + ERS_SHADER_VARYING_INDEX(fragpos));
+        const PacketF32 dist = packet_length(fragpos - PacketVec3(uniform_light_pos));
+        PacketF32 t = 1.0f - packet_smoothstep(uniform_scale * 0.6f, uniform_scale * 0.90f, dist);
+
+        PacketF32 s(0.0f);
+        if (uniform_wireframe)
+        {
+            const PacketF32 edge(0.1f);
+            const u32 on_edge = (packet.bar.x < edge) | (packet.bar.y < edge) | (packet.bar.z < edge);
+            t = packet_select(on_edge, PacketF32(0.0f), t);
+            s = packet_select(on_edge, PacketF32(1.0f), s);
+        }
+        const PacketVec3 color(uniform_color);
+        out = PacketVec4(t * color + s * (1.0f - t) * (PacketVec3(1.0f) - color), PacketF32(1.0f));
+        return 0;
+    }
 };
 
 #endif // DEBUG_LIGHT_SHADER_H
\ No newline at end of file
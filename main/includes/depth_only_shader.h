@@ -0,0 +1,34 @@
+#ifndef DEPTH_ONLY_SHADER_H
+#define DEPTH_ONLY_SHADER_H
+
+#include "shader_program.h"
+#include "ers/matrix.h"
+
+// Writes nothing but depth, e.g. for a pass over the large occluders of a scene before testing
+// the rest of it against the z-buffer (see Renderer::IsAabbVisible).
+class DepthOnlyShader : public IShaderProgram
+{
+
+ERS_SHADER_DEFINE_CLONE(DepthOnlyShader)
+ERS_SHADER_DEFINE_DEPTH_ONLY
+
+public:
+    ers::mat4 uniform_mvp_mat;
+
+    ers::vec4 VertexShaderPerVertex(const void* in, s32 which_vert) override
+    {
+        ERS_UNUSED(which_vert);
+        const VertexAttributes1* vert = (const VertexAttributes1*)in;
+        return uniform_mvp_mat * ers::vec4(vert->aPos, 1.0f);
+    }
+
+    bool HasPacketVertexShader() const override { return true; }
+
+    void VertexShaderPacket(const VertexPacket& packet, PacketVec4& out) override
+    {
+        const PacketVec3 pos = packet.LoadVec3(offsetof(VertexAttributes1, aPos));
+        out = packet_transform(uniform_mvp_mat, PacketVec4(pos, PacketF32(1.0f)));
+    }
+};
+
+#endif // DEPTH_ONLY_SHADER_H
\ No newline at end of file
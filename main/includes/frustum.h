@@ -0,0 +1,23 @@
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+#include "ers/common.h"
+#include "ers/vec.h"
+#include "ers/matrix.h"
+
+// The six planes of a view frustum, extracted from a (model-)view-projection matrix. The planes are in the space the matrix 
+// transforms from, e.g. model space for projection * view * model, so that bounds can be tested without transforming them.
+// A point p is on the inner side of a plane if dot(plane, vec4(p, 1)) >= 0.
+struct Frustum
+{
+    ers::vec4 planes[6]; // left, right, bottom, top, near and far, with normalized (x, y, z).
+
+    Frustum() = default;
+    explicit Frustum(const ers::mat4& m);
+
+    // Both are conservative: false means completely outside, true may also be returned for bounds just outside of a corner.
+    bool IntersectsSphere(const ers::vec3& center, f32 radius) const;
+    bool IntersectsAabb(const ers::vec3& aabb_min, const ers::vec3& aabb_max) const;
+};
+
+#endif // FRUSTUM_H
\ No newline at end of file
@@ -113,6 +113,7 @@ public:
     s32 GetHeight();
     s32 GetSize();
     s32 GetChannels();
+    Range GetRange();
 
     void Write(const char* filename, bool flip = true);
 
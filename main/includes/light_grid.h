@@ -0,0 +1,52 @@
+#ifndef LIGHT_GRID_H
+#define LIGHT_GRID_H
+
+#include "ers/typedefs.h"
+#include "ers/vec.h"
+#include "ers/matrix.h"
+#include "ers/allocators.h"
+#include "ers/vector.h"
+
+#define ERS_LIGHT_TILE_SIZE 16 // pixels per side of a tile of the light grid.
+
+struct PointLight
+{
+    ers::vec3 position; // world space.
+    ers::vec3 color;
+    f32 radius; // the light has no effect at this distance and beyond.
+};
+
+// Tiled light culling: the screen is split into tiles of ERS_LIGHT_TILE_SIZE^2 pixels, and every tile gets the list
+// of the point lights whose spheres intersect its frustum, so that a fragment only loops over the lights of its tile.
+// Pixel (x, y) is the renderer's, i.e. y grows upwards in normalized device coordinates.
+class LightGrid
+{
+public:
+    explicit LightGrid(ers::IAllocator* alloc = &ers::default_alloc);
+
+    // Copies the lights and culls them against the tiles of a width x height viewport seen through view_proj.
+    // @param zbuffer: window depths of the viewport (e.g. Renderer::GetZBuffer after a depth prepass), which bound
+    // the tiles' frustums in depth to what was drawn in them, tiles with nothing drawn getting no lights at all.
+    // The fragments shaded with the grid then have to be within those depths, e.g. by testing them against the very
+    // same z-buffer. nullptr for the whole depth range.
+    void Build(const PointLight* lights, s32 count, const ers::mat4& view_proj, s32 width, s32 height, const f32* zbuffer = nullptr);
+
+    // The lights of the tile of pixel (x, y): count indices into GetLights(), in increasing order.
+    const s32* GetTileLights(s32 x, s32 y, s32& count) const;
+    const PointLight* GetLights() const;
+    s32 GetLightCount() const;
+
+private:
+    void getTileDepthBounds(const f32* zbuffer, s32 tile_x, s32 tile_y, f32& z_min, f32& z_max) const;
+
+    ers::Vector<PointLight> m_lights;
+    ers::Vector<s32> m_tileOffsets; // per tile, where its lights start in m_tileLights, plus the end of the last one.
+    ers::Vector<s32> m_tileLights;
+    ers::Vector<s32> m_lightRects; // per light, the inclusive range of tiles its sphere projects into (x_min, y_min, x_max, y_max).
+    s32 m_width;
+    s32 m_height;
+    s32 m_tilesX;
+    s32 m_tilesY;
+};
+
+#endif // LIGHT_GRID_H
\ No newline at end of file
@@ -8,7 +8,9 @@
 #include "ers/macros.h"
 #include "ers/hash_map.h"
 #include "software_renderer.h"
+#include "frustum.h"
 
+// Laid out like VertexAttributes1, so that meshes can be passed to the shaders as they are.
 struct Vertex {
 	ers::vec3 position;
 	ers::vec3 normal;
@@ -22,6 +24,20 @@ struct Vertex {
 	}
 };
 
+#define MESH_MESHLET_MAX_VERTICES 64
+#define MESH_MESHLET_MAX_TRIANGLES 124
+
+// A cluster of neighboring triangles, culled as a whole by Mesh::Draw.
+struct Meshlet
+{
+	s32 first_index; // into the mesh's indices, every meshlet being a range of them.
+	s32 count_indices;
+	ers::vec3 center; // bounding sphere.
+	f32 radius;
+	ers::vec3 cone_axis; // the average facing direction of the triangles.
+	f32 cone_cutoff; // sine of the angle between cone_axis and the normal farthest from it, > 1 if they span a half space or more.
+};
+
 class Mesh
 {
 public:
@@ -44,15 +60,70 @@ public:
 	bool GetHasNormals() const;
 	bool GetHasTexcoords() const;
 
+	// Computes the axis aligned bounding box and the bounding sphere of the vertex positions. 
+	// The make_* functions and load_object_file call it once they're done, anything else pushing vertices has to as well.
+	void UpdateBounds();
+	const ers::vec3& GetAabbMin() const;
+	const ers::vec3& GetAabbMax() const;
+	const ers::vec3& GetBoundingSphereCenter() const;
+	f32 GetBoundingSphereRadius() const;
+
+	// False if the mesh is completely outside of the frustum of mvp (e.g. projection * view * model), 
+	// so that drawing it can be skipped altogether.
+	bool IsInFrustum(const ers::mat4& mvp) const;
+
+	// Splits the triangles into meshlets of at most max_vertices distinct vertices and max_triangles triangles, 
+	// reordering the indices so that every meshlet is a range of them. Needs the bounds, 
+	// so the make_* functions and load_object_file call it after UpdateBounds.
+	void BuildMeshlets(s32 max_vertices = MESH_MESHLET_MAX_VERTICES, s32 max_triangles = MESH_MESHLET_MAX_TRIANGLES);
+	size_t GetMeshletCount() const;
+	const Meshlet& GetMeshlet(size_t i) const;
+
 	void Draw(Renderer* renderer) const;
 
+	// Same as above, with the pipeline specialized for the shader's type (see Renderer::RenderTriangle).
+	template<typename ShaderT>
+	void Draw(Renderer* renderer, ShaderT& shader) const;
+
+	// Same as the above, but culls the mesh and then its meshlets against the frustum of mvp (the one the shader 
+	// transforms the vertices with) and, with CULL_FACE enabled, the meshlets all of whose triangles face away from it.
+	void Draw(Renderer* renderer, const ers::mat4& mvp) const;
+	template<typename ShaderT>
+	void Draw(Renderer* renderer, ShaderT& shader, const ers::mat4& mvp) const;
+
 private:
 	ers::Vector<Vertex> m_vertices;
 	ers::Vector<s32> m_indices;
 
 	u8 m_status; // xxxx xxba: a ->	has normals, b -> has texture coordinates.
+
+	ers::vec3 m_aabbMin;
+	ers::vec3 m_aabbMax;
+	ers::vec3 m_sphereCenter;
+	f32 m_sphereRadius;
+
+	ers::Vector<Meshlet> m_meshlets;
+	mutable ers::Vector<s32> m_visibleIndices; // the indices of the meshlets that passed culling in the last Draw.
+
+	const s32* cullMeshlets(Renderer* renderer, const ers::mat4& mvp, s32& count_indices) const;
 };
 
+template<typename ShaderT>
+void Mesh::Draw(Renderer* renderer, ShaderT& shader) const
+{
+	if (m_indices.GetSize() == 0) return;
+	renderer->DrawIndexed(shader, &m_vertices[0], sizeof(Vertex), &m_indices[0], (s32)m_indices.GetSize());
+}
+
+template<typename ShaderT>
+void Mesh::Draw(Renderer* renderer, ShaderT& shader, const ers::mat4& mvp) const
+{
+	s32 count_indices = 0;
+	const s32* indices = cullMeshlets(renderer, mvp, count_indices);
+	if (count_indices == 0) return;
+	renderer->DrawIndexed(shader, &m_vertices[0], sizeof(Vertex), indices, count_indices);
+}
+
 ers::vec3 calculate_tangent(const Vertex& vert0, const Vertex& vert1, const Vertex& vert2);
 void calculate_tbn_vectors(
 	const Vertex& vert0, const Vertex& vert1, const Vertex& vert2,
@@ -0,0 +1,268 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include "ers/typedefs.h"
+#include "ers/vec.h"
+#include "ers/matrix.h"
+#include "simd.h"
+#include <cmath>
+
+// Packets of fragments shaded together (see IShaderProgram::FragmentShaderPacket): screen aligned quads
+// of ERS_PACKET_WIDTH x ERS_PACKET_HEIGHT pixels, lane i being the pixel (i % ERS_PACKET_WIDTH, i / ERS_PACKET_WIDTH) of the quad.
+// 4x2 with AVX2, 2x2 otherwise. Either way, each 2x2 half of the quad can be used for screen-space derivatives.
+#if defined(ERS_SIMD_AVX2)
+    #define ERS_PACKET_LANES 8
+    #define ERS_PACKET_WIDTH 4
+#else
+    #define ERS_PACKET_LANES 4
+    #define ERS_PACKET_WIDTH 2
+#endif
+#define ERS_PACKET_HEIGHT 2
+#define ERS_PACKET_FULL_MASK ((1u << ERS_PACKET_LANES) - 1u)
+
+// ERS_PACKET_LANES floats, one per pixel of a packet.
+struct PacketF32
+{
+#if defined(ERS_SIMD_AVX2)
+    __m256 v;
+
+    PacketF32() = default;
+    explicit PacketF32(f32 s) : v(_mm256_set1_ps(s)) { }
+    explicit PacketF32(__m256 m) : v(m) { }
+
+    static PacketF32 Load(const f32* p) { return PacketF32(_mm256_loadu_ps(p)); }
+    void Store(f32* p) const { _mm256_storeu_ps(p, v); }
+
+    PacketF32 operator+(const PacketF32& o) const { return PacketF32(_mm256_add_ps(v, o.v)); }
+    PacketF32 operator-(const PacketF32& o) const { return PacketF32(_mm256_sub_ps(v, o.v)); }
+    PacketF32 operator*(const PacketF32& o) const { return PacketF32(_mm256_mul_ps(v, o.v)); }
+    PacketF32 operator/(const PacketF32& o) const { return PacketF32(_mm256_div_ps(v, o.v)); }
+    PacketF32 operator-() const { return PacketF32(_mm256_sub_ps(_mm256_setzero_ps(), v)); }
+
+    // Comparisons return a lane mask, bit i set for lane i.
+    u32 operator<(const PacketF32& o) const { return (u32)_mm256_movemask_ps(_mm256_cmp_ps(v, o.v, _CMP_LT_OQ)); }
+    u32 operator>(const PacketF32& o) const { return (u32)_mm256_movemask_ps(_mm256_cmp_ps(v, o.v, _CMP_GT_OQ)); }
+#elif defined(ERS_SIMD_SSE2)
+    __m128 v;
+
+    PacketF32() = default;
+    explicit PacketF32(f32 s) : v(_mm_set1_ps(s)) { }
+    explicit PacketF32(__m128 m) : v(m) { }
+
+    static PacketF32 Load(const f32* p) { return PacketF32(_mm_loadu_ps(p)); }
+    void Store(f32* p) const { _mm_storeu_ps(p, v); }
+
+    PacketF32 operator+(const PacketF32& o) const { return PacketF32(_mm_add_ps(v, o.v)); }
+    PacketF32 operator-(const PacketF32& o) const { return PacketF32(_mm_sub_ps(v, o.v)); }
+    PacketF32 operator*(const PacketF32& o) const { return PacketF32(_mm_mul_ps(v, o.v)); }
+    PacketF32 operator/(const PacketF32& o) const { return PacketF32(_mm_div_ps(v, o.v)); }
+    PacketF32 operator-() const { return PacketF32(_mm_sub_ps(_mm_setzero_ps(), v)); }
+
+    u32 operator<(const PacketF32& o) const { return (u32)_mm_movemask_ps(_mm_cmplt_ps(v, o.v)); }
+    u32 operator>(const PacketF32& o) const { return (u32)_mm_movemask_ps(_mm_cmpgt_ps(v, o.v)); }
+#else
+    f32 v[ERS_PACKET_LANES];
+
+    PacketF32() = default;
+    explicit PacketF32(f32 s) { for (s32 i = 0; i < ERS_PACKET_LANES; ++i) v[i] = s; }
+
+    static PacketF32 Load(const f32* p) { PacketF32 r; for (s32 i = 0; i < ERS_PACKET_LANES; ++i) r.v[i] = p[i]; return r; }
+    void Store(f32* p) const { for (s32 i = 0; i < ERS_PACKET_LANES; ++i) p[i] = v[i]; }
+
+    PacketF32 operator+(const PacketF32& o) const { PacketF32 r; for (s32 i = 0; i < ERS_PACKET_LANES; ++i) r.v[i] = v[i] + o.v[i]; return r; }
+    PacketF32 operator-(const PacketF32& o) const { PacketF32 r; for (s32 i = 0; i < ERS_PACKET_LANES; ++i) r.v[i] = v[i] - o.v[i]; return r; }
+    PacketF32 operator*(const PacketF32& o) const { PacketF32 r; for (s32 i = 0; i < ERS_PACKET_LANES; ++i) r.v[i] = v[i] * o.v[i]; return r; }
+    PacketF32 operator/(const PacketF32& o) const { PacketF32 r; for (s32 i = 0; i < ERS_PACKET_LANES; ++i) r.v[i] = v[i] / o.v[i]; return r; }
+    PacketF32 operator-() const { PacketF32 r; for (s32 i = 0; i < ERS_PACKET_LANES; ++i) r.v[i] = -v[i]; return r; }
+
+    u32 operator<(const PacketF32& o) const { u32 m = 0; for (s32 i = 0; i < ERS_PACKET_LANES; ++i) m |= (u32)(v[i] < o.v[i]) << i; return m; }
+    u32 operator>(const PacketF32& o) const { u32 m = 0; for (s32 i = 0; i < ERS_PACKET_LANES; ++i) m |= (u32)(v[i] > o.v[i]) << i; return m; }
+#endif
+
+    PacketF32& operator+=(const PacketF32& o) { *this = *this + o; return *this; }
+    PacketF32& operator-=(const PacketF32& o) { *this = *this - o; return *this; }
+    PacketF32& operator*=(const PacketF32& o) { *this = *this * o; return *this; }
+
+    f32 Lane(s32 i) const
+    {
+        f32 lanes[ERS_PACKET_LANES];
+        Store(lanes);
+        return lanes[i];
+    }
+};
+
+inline PacketF32 operator*(f32 s, const PacketF32& p) { return PacketF32(s) * p; }
+inline PacketF32 operator*(const PacketF32& p, f32 s) { return p * PacketF32(s); }
+inline PacketF32 operator+(f32 s, const PacketF32& p) { return PacketF32(s) + p; }
+inline PacketF32 operator+(const PacketF32& p, f32 s) { return p + PacketF32(s); }
+inline PacketF32 operator-(f32 s, const PacketF32& p) { return PacketF32(s) - p; }
+inline PacketF32 operator-(const PacketF32& p, f32 s) { return p - PacketF32(s); }
+inline PacketF32 operator/(f32 s, const PacketF32& p) { return PacketF32(s) / p; }
+inline PacketF32 operator/(const PacketF32& p, f32 s) { return p / PacketF32(s); }
+
+inline PacketF32 packet_min(const PacketF32& a, const PacketF32& b)
+{
+#if defined(ERS_SIMD_AVX2)
+    return PacketF32(_mm256_min_ps(a.v, b.v));
+#elif defined(ERS_SIMD_SSE2)
+    return PacketF32(_mm_min_ps(a.v, b.v));
+#else
+    PacketF32 r;
+    for (s32 i = 0; i < ERS_PACKET_LANES; ++i) r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i];
+    return r;
+#endif
+}
+
+inline PacketF32 packet_max(const PacketF32& a, const PacketF32& b)
+{
+#if defined(ERS_SIMD_AVX2)
+    return PacketF32(_mm256_max_ps(a.v, b.v));
+#elif defined(ERS_SIMD_SSE2)
+    return PacketF32(_mm_max_ps(a.v, b.v));
+#else
+    PacketF32 r;
+    for (s32 i = 0; i < ERS_PACKET_LANES; ++i) r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i];
+    return r;
+#endif
+}
+
+inline PacketF32 packet_sqrt(const PacketF32& a)
+{
+#if defined(ERS_SIMD_AVX2)
+    return PacketF32(_mm256_sqrt_ps(a.v));
+#elif defined(ERS_SIMD_SSE2)
+    return PacketF32(_mm_sqrt_ps(a.v));
+#else
+    PacketF32 r;
+    for (s32 i = 0; i < ERS_PACKET_LANES; ++i) r.v[i] = sqrtf(a.v[i]);
+    return r;
+#endif
+}
+
+// Picks a's lanes where mask is set and b's elsewhere.
+inline PacketF32 packet_select(u32 mask, const PacketF32& a, const PacketF32& b)
+{
+    f32 la[ERS_PACKET_LANES], lb[ERS_PACKET_LANES];
+    a.Store(la);
+    b.Store(lb);
+    for (s32 i = 0; i < ERS_PACKET_LANES; ++i)
+        if ((mask & (1u << i)) == 0) la[i] = lb[i];
+    return PacketF32::Load(la);
+}
+
+// Applies a scalar function lane by lane, for what has no vector equivalent (e.g. powf).
+template<typename FuncT>
+inline PacketF32 packet_map(const PacketF32& a, FuncT func)
+{
+    f32 lanes[ERS_PACKET_LANES];
+    a.Store(lanes);
+    for (s32 i = 0; i < ERS_PACKET_LANES; ++i) lanes[i] = func(lanes[i]);
+    return PacketF32::Load(lanes);
+}
+
+inline PacketF32 packet_clamp(const PacketF32& a, f32 lo, f32 hi) { return packet_min(packet_max(a, PacketF32(lo)), PacketF32(hi)); }
+
+inline PacketF32 packet_smoothstep(f32 edge0, f32 edge1, const PacketF32& x)
+{
+    const PacketF32 t = packet_clamp((x - edge0) / PacketF32(edge1 - edge0), 0.0f, 1.0f);
+    return t * t * (3.0f - t * 2.0f);
+}
+
+// Coarse screen-space derivatives: the difference between the right and left (bottom and top) pixels
+// of each 2x2 quad, the same for all four of its lanes.
+inline PacketF32 packet_ddx(const PacketF32& a)
+{
+    f32 l[ERS_PACKET_LANES], r[ERS_PACKET_LANES];
+    a.Store(l);
+    for (s32 i = 0; i < ERS_PACKET_LANES; ++i)
+    {
+        const s32 left = i % ERS_PACKET_WIDTH & ~1; // top row of the quad.
+        r[i] = l[left + 1] - l[left];
+    }
+    return PacketF32::Load(r);
+}
+
+inline PacketF32 packet_ddy(const PacketF32& a)
+{
+    f32 l[ERS_PACKET_LANES], r[ERS_PACKET_LANES];
+    a.Store(l);
+    for (s32 i = 0; i < ERS_PACKET_LANES; ++i)
+    {
+        const s32 top = i % ERS_PACKET_WIDTH & ~1;
+        r[i] = l[top + ERS_PACKET_WIDTH] - l[top];
+    }
+    return PacketF32::Load(r);
+}
+
+// ers::vec3 in structure of arrays form: the x, y and z components of every lane.
+struct PacketVec3
+{
+    PacketF32 x, y, z;
+
+    PacketVec3() = default;
+    PacketVec3(const PacketF32& px, const PacketF32& py, const PacketF32& pz) : x(px), y(py), z(pz) { }
+    explicit PacketVec3(const ers::vec3& v) : x(v.x()), y(v.y()), z(v.z()) { }
+    explicit PacketVec3(f32 s) : x(s), y(s), z(s) { }
+
+    // Reads 3 consecutive varyings (see FragmentPacket::vars), or writes them (see VertexPacket::vars).
+    static PacketVec3 Load(const PacketF32* p) { return PacketVec3(p[0], p[1], p[2]); }
+    void Store(PacketF32* p) const { p[0] = x; p[1] = y; p[2] = z; }
+
+    PacketVec3 operator+(const PacketVec3& o) const { return PacketVec3(x + o.x, y + o.y, z + o.z); }
+    PacketVec3 operator-(const PacketVec3& o) const { return PacketVec3(x - o.x, y - o.y, z - o.z); }
+    PacketVec3 operator*(const PacketVec3& o) const { return PacketVec3(x * o.x, y * o.y, z * o.z); }
+    PacketVec3 operator*(const PacketF32& s) const { return PacketVec3(x * s, y * s, z * s); }
+    PacketVec3 operator*(f32 s) const { return *this * PacketF32(s); }
+    PacketVec3 operator-() const { return PacketVec3(-x, -y, -z); }
+};
+
+inline PacketVec3 operator*(const PacketF32& s, const PacketVec3& v) { return v * s; }
+inline PacketVec3 operator*(f32 s, const PacketVec3& v) { return v * s; }
+
+inline PacketF32 packet_dot(const PacketVec3& a, const PacketVec3& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+inline PacketF32 packet_length(const PacketVec3& a) { return packet_sqrt(packet_dot(a, a)); }
+inline PacketVec3 packet_normalize(const PacketVec3& a) { return a * (1.0f / packet_length(a)); }
+
+inline PacketVec3 packet_cross(const PacketVec3& a, const PacketVec3& b)
+{
+    return PacketVec3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+}
+
+// ers::vec4 in structure of arrays form, e.g. the output colors of a packet.
+struct PacketVec4
+{
+    PacketF32 x, y, z, w;
+
+    PacketVec4() = default;
+    PacketVec4(const PacketF32& px, const PacketF32& py, const PacketF32& pz, const PacketF32& pw) : x(px), y(py), z(pz), w(pw) { }
+    PacketVec4(const PacketVec3& v, const PacketF32& pw) : x(v.x), y(v.y), z(v.z), w(pw) { }
+    explicit PacketVec4(const ers::vec4& v) : x(v.x()), y(v.y()), z(v.z()), w(v.w()) { }
+
+    static PacketVec4 Load(const PacketF32* p) { return PacketVec4(p[0], p[1], p[2], p[3]); }
+    void Store(PacketF32* p) const { p[0] = x; p[1] = y; p[2] = z; p[3] = w; }
+
+    ers::vec4 Lane(s32 i) const { return ers::vec4(x.Lane(i), y.Lane(i), z.Lane(i), w.Lane(i)); }
+};
+
+// m * v for every lane. The operations are the ones of ers::mat4 * ers::vec4, in the same order, so a packet vertex shader
+// gives the same bits as its scalar counterpart, e.g. for a depth prepass with one and the shading pass with the other.
+inline PacketVec4 packet_transform(const ers::mat4& m, const PacketVec4& v)
+{
+    return PacketVec4(
+        m(0, 0) * v.x + m(0, 1) * v.y + m(0, 2) * v.z + m(0, 3) * v.w,
+        m(1, 0) * v.x + m(1, 1) * v.y + m(1, 2) * v.z + m(1, 3) * v.w,
+        m(2, 0) * v.x + m(2, 1) * v.y + m(2, 2) * v.z + m(2, 3) * v.w,
+        m(3, 0) * v.x + m(3, 1) * v.y + m(3, 2) * v.z + m(3, 3) * v.w
+    );
+}
+
+inline PacketVec3 packet_transform(const ers::mat3& m, const PacketVec3& v)
+{
+    return PacketVec3(
+        m(0, 0) * v.x + m(0, 1) * v.y + m(0, 2) * v.z,
+        m(1, 0) * v.x + m(1, 1) * v.y + m(1, 2) * v.z,
+        m(2, 0) * v.x + m(2, 1) * v.y + m(2, 2) * v.z
+    );
+}
+
+#endif // PACKET_H
\ No newline at end of file
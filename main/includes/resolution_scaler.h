@@ -0,0 +1,32 @@
+#ifndef RESOLUTION_SCALER_H
+#define RESOLUTION_SCALER_H
+
+#include "ers/typedefs.h"
+
+// Dynamic resolution: picks the fraction of the output resolution to render at, so that frames take about
+// frame_budget seconds. Fed with the time each frame took, it shrinks the scale quickly when over budget
+// and grows it slowly when well under, assuming a frame's cost is proportional to its pixel count.
+class ResolutionScaler
+{
+public:
+    ResolutionScaler(f64 frame_budget, f32 min_scale = 0.25f, f32 max_scale = 1.0f);
+
+    // @param frame_time: seconds the last frame took, rendered at the current scale.
+    void Update(f64 frame_time);
+    void Reset(); // back to max_scale, forgetting the frame times so far.
+
+    void SetFrameBudget(f64 frame_budget);
+    f64 GetFrameBudget() const;
+    f32 GetScale() const;
+    // size (a width or a height of the output) at the current scale, at least 2 (the smallest viewport of Renderer).
+    s32 GetScaledSize(s32 size) const;
+
+private:
+    f64 m_frameBudget;
+    f64 m_averageTime; // moving average of the frame times, 0 before the first one.
+    f32 m_minScale;
+    f32 m_maxScale;
+    f32 m_scale;
+};
+
+#endif // RESOLUTION_SCALER_H
\ No newline at end of file
@@ -5,7 +5,12 @@
 #include "ers/macros.h"
 #include "ers/common.h"
 #include "ers/vec.h"
+#include "ers/allocators.h"
+#include "packet.h"
 #include <type_traits>
+#include <new>
+#include <cstddef>
+#include <cstring>
 
 // Helper struct used for interpolating varyings post clipping and automating barycentric intepolation in the interface/base class.
 // Not meant to be public.
@@ -13,23 +18,50 @@ struct VaryingsInfo
 {
     f32* data; // pointer to the first float in the Varyings structure of a shader.
     f32* data_interpolated; // pointer to the first float in the Varyings structure of a shader, for communicating with the basic class.
-    s32* indices; // pointer to array containing the indices defining which vertices make up which tringle.
     s32 count; // size of the Varyings struct in multiples of sizeof(float), i.e. how many floating number are contained in a Varyings struct.
+    s32 count_flat; // how many of the above, at the end of the struct, are flat (see ERS_SHADER_DEFINE_FLAT_VARYINGS).
+
+    // Number of floats that are interpolated, the first ones of the struct.
+    s32 GetInterpolatedCount() const { return count - count_flat; }
 
     // Returns pointer to the 1st floating point element for the varyings of a vertex.
-    // @param triangle: triangle index, it can be either 0 for the 1st triangle or 1 for the 2nd.
     // @param vert: vertex index, it can be 0, 1 or 2
-    f32* GetVars(s32 triangle, s32 vert)
+    f32* GetVars(s32 vert)
     {
-        ERS_ASSERT(triangle == 0 || triangle == 1);
         ERS_ASSERT(vert == 0 || vert == 1 || vert == 2);
-        return data + indices[3 * triangle + vert] * count;
+        return data + vert * count;
     }
+};
+
+// A quad of fragments for IShaderProgram::FragmentShaderPacket, see packet.h for its layout.
+struct FragmentPacket
+{
+    s32 x, y; // the quad's top left pixel.
+    u32 mask; // lanes covered by the triangle and passing the depth test, the only ones that get written.
+    PacketVec3 bar; // perspective correct barycentric coordinates.
+    // Perspective correct varyings, vars[i] holding the i-th float of the shader's Varyings struct for every lane 
+    // (see ERS_SHADER_VARYING_INDEX). The lanes out of the mask are extrapolated from the triangle, for derivatives.
+    const PacketF32* vars;
+};
 
-    void SetSecondTriangleIndices(s32 idx0, s32 idx1, s32 idx2)
+// ERS_PACKET_LANES vertices for IShaderProgram::VertexShaderPacket, shaded together by indexed draws.
+struct VertexPacket
+{
+    const void* in[ERS_PACKET_LANES]; // the vertices' attributes, see VertexShaderPerVertex. Lanes out of the mask repeat another one's.
+    u32 mask; // lanes holding a vertex that's used by the draw, the only ones that get stored.
+    // Outputs for the varyings, vars[i] holding the i-th float of the shader's Varyings struct for every lane 
+    // (see ERS_SHADER_VARYING_INDEX).
+    PacketF32* vars;
+
+    // Gathers the float at offset bytes into every lane's attributes, e.g. offsetof(VertexAttributes1, aPos).
+    PacketF32 LoadF32(size_t offset) const
     {
-        indices[3] = idx0; indices[4] = idx1; indices[5] = idx2;
+        f32 lanes[ERS_PACKET_LANES];
+        for (s32 i = 0; i < ERS_PACKET_LANES; ++i) memcpy(&lanes[i], (const u8*)in[i] + offset, sizeof(f32));
+        return PacketF32::Load(lanes);
     }
+
+    PacketVec3 LoadVec3(size_t offset) const { return PacketVec3(LoadF32(offset), LoadF32(offset + sizeof(f32)), LoadF32(offset + 2 * sizeof(f32))); }
 };
 
 struct VertexAttributes1
@@ -58,6 +90,14 @@ public:
     ers::vec3 m_barNoPerspective;
     ers::vec3 m_bar;
     ers::vec4 m_ndcTri[3];
+    ers::ivec2 m_fragCoord; // the pixel being shaded by FragmentShader (a coarse pixel's first one, see Renderer::SetShadingRate).
+
+    virtual ~IShaderProgram() { }
+
+    // Called once per draw (see Renderer::Draw and Renderer::DrawIndexed), before any of its vertices are shaded, 
+    // for anything derived from the uniforms alone, e.g. products of matrices. Code calling Renderer::RenderTriangle 
+    // directly calls it itself after setting the uniforms.
+    virtual void BeginDraw() { }
     
     // Calculates the current triangle's normal device coordinates.
     // @param in0, in1, in2: pointers to structures containing the vertex attributes, e.g. position, normal, texture coordinates, color etc. 
@@ -65,64 +105,154 @@ public:
     // @param p0, p1, p2: outputs for the current triangle's normal device coordinates calculated in the vertex shader.
     virtual void VertexShader(const void* in0, const void* in1, const void* in2, ers::vec4& p0, ers::vec4& p1, ers::vec4& p2) 
     { 
-        ERS_UNUSED(in0); 
-        ERS_UNUSED(in1); 
-        ERS_UNUSED(in2); 
-        ERS_UNUSED(p0); 
-        ERS_UNUSED(p1); 
-        ERS_UNUSED(p2); 
+        p0 = VertexShaderPerVertex(in0, 0);
+        p1 = VertexShaderPerVertex(in1, 1);
+        p2 = VertexShaderPerVertex(in2, 2);
     } 
 
+    // Calculates a single vertex's clip space position and writes its varyings to the slot which_vert (0, 1 or 2).
+    // Indexed draws (see Renderer::DrawIndexed) only go through this one, shading each vertex once.
+    virtual ers::vec4 VertexShaderPerVertex(const void* in, s32 which_vert)
+    {
+        ERS_UNUSED(in);
+        ERS_UNUSED(which_vert);
+        return ers::vec4(0.0f, 0.0f, 0.0f, 0.0f);
+    }
+
+    // Optional packet interface for indexed draws: shaders returning true here get their vertices shaded 
+    // ERS_PACKET_LANES at a time, through VertexShaderPacket instead of VertexShaderPerVertex. The other draws, 
+    // and indexed draws of the shaders returning false, still go through VertexShaderPerVertex one vertex at a time.
+    virtual bool HasPacketVertexShader() const { return false; }
+
+    // Calculates the clip space positions of a packet of vertices and writes their varyings to packet.vars.
+    // @param packet: the vertices' attributes and the outputs for their varyings.
+    // @param out: the clip space positions, one per lane.
+    virtual void VertexShaderPacket(const VertexPacket& packet, PacketVec4& out)
+    {
+        // Only called for shaders that return true from HasPacketVertexShader, which have to override it.
+        ERS_UNUSED(packet);
+        out = PacketVec4(ers::vec4(0.0f));
+    }
+
     // Calculates the fragment's color.
     // @param out: the color calculated in the fragment shader.
-    virtual bool FragmentShader(ers::vec4& out) { ERS_UNUSED(out); return false; } 
+    virtual bool FragmentShader(ers::vec4& out) { out = ers::vec4(0.0f); return false; } 
+
+    // Optional packet interface: shaders returning true here are shaded a quad of fragments at a time, through
+    // FragmentShaderPacket instead of FragmentShader. FragmentShader still has to be implemented, since
+    // the deferred resolve (see Renderer::DEFERRED) shades its pixels one by one.
+    virtual bool HasPacketShader() const { return false; }
+
+    // Calculates the colors of a packet of fragments.
+    // @param packet: the fragments' positions, coverage and varyings.
+    // @param out: the colors calculated in the fragment shader, one per lane.
+    // @return: the lanes to discard.
+    virtual u32 FragmentShaderPacket(const FragmentPacket& packet, PacketVec4& out) 
+    { 
+        // Only called for shaders that return true from HasPacketShader, which have to override it.
+        out = PacketVec4(ers::vec4(0.0f));
+        return packet.mask;
+    }
 
     // Produces a helper struct containing pointers to and the size of the shaders Varyings struct.
-    virtual VaryingsInfo GetVaryingsInfo() { return { nullptr, nullptr, nullptr, 0 }; }
+    virtual VaryingsInfo GetVaryingsInfo() { return { nullptr, nullptr, 0, 0 }; }
+
+    // Number of flat floats at the end of the Varyings struct, hidden by ERS_SHADER_DEFINE_FLAT_VARYINGS.
+    static s32 GetFlatVaryingsCount() { return 0; }
+
+    // Called before a triangle is rasterized, with the varyings of its three vertices (nullptr if the shader has none).
+    // Anything a fragment shader needs per triangle (and not per fragment) should be derived here and not in the 
+    // vertex shader, since with binning the triangle gets rasterized later on, by a copy of the shader (see Clone).
+    virtual void SetupTriangle(const f32* vars0, const f32* vars1, const f32* vars2) 
+    { 
+        ERS_UNUSED(vars0); 
+        ERS_UNUSED(vars1); 
+        ERS_UNUSED(vars2); 
+    }
+
+    // Shaders returning true only ever get their depth written: their fragment shader is never called and 
+    // they neither write color nor discard (e.g. for shadow maps and depth prepasses). See ERS_SHADER_DEFINE_DEPTH_ONLY.
+    virtual bool IsDepthOnly() const { return false; }
+
+    // The above for the shader's type, hidden by ERS_SHADER_DEFINE_DEPTH_ONLY.
+    static constexpr bool IsDepthOnlyType() { return false; }
 
-    // Performs perspective correct interpolation of the varyings in the shader.
-    void InterpolateVaryings(const ers::vec3& bar_coords, const ers::vec3& bar_coords_correct, s32 tri_idx_after_clipping) 
+    // Produces a copy of the shader allocated with alloc, used by the renderer's worker threads.
+    // Shaders that return nullptr (the default) are rasterized on the calling thread only.
+    virtual IShaderProgram* Clone(ers::IAllocator* alloc) const { ERS_UNUSED(alloc); return nullptr; }
+
+    // Sets the barycentric coordinates and the perspective correct varyings of the current fragment.
+    // @param vars_over_w: the varyings divided by w, interpolated linearly in screen space by the renderer.
+    // @param w: the fragment's w, which turns the above into the perspective correct values.
+    // @param vars_info: this shader's GetVaryingsInfo(), queried once per triangle.
+    void SetFragmentVaryings(
+        const ers::vec3& bar_coords, 
+        const ers::vec3& bar_coords_correct, 
+        const f32* vars_over_w,
+        f32 w,
+        const VaryingsInfo& vars_info
+    ) 
     {         
         m_barNoPerspective = bar_coords;
         m_bar = bar_coords_correct;
 
-        VaryingsInfo vars_info = GetVaryingsInfo();
         if (vars_info.data != nullptr)
         {
-            f32* vars0 = vars_info.GetVars(tri_idx_after_clipping, 0);
-            f32* vars1 = vars_info.GetVars(tri_idx_after_clipping, 1);
-            f32* vars2 = vars_info.GetVars(tri_idx_after_clipping, 2);
+            // The flat varyings are written once per triangle by the renderer.
             f32* vars_interpolated = vars_info.data_interpolated;
-            
-            const s32 count = vars_info.count;
+            const s32 count = vars_info.GetInterpolatedCount();
             for (s32 i = 0; i < count; ++i)
             {
-                vars_interpolated[i] = m_bar.x() * vars0[i] + m_bar.y() * vars1[i] + m_bar.z() * vars2[i];
+                vars_interpolated[i] = w * vars_over_w[i];
             }
         }       
     }   
 };
 
 // Helper macro for defining varyings correctly for the shader programs that inherit the above class.
-// Note: We use an array of 4 varying structs instead of 3 or 6, since we can only ever produce one new vertex when clipping.
+// Note: The vertices made by clipping are kept by the renderer, so 3 varying structs are enough.
 #define ERS_SHADER_DEFINE_VARYINGS(varyings_name_per_vertex, varyings_name_interpolated, definition) \
 public: \
 struct Varyings definition; \
 static_assert(std::is_trivially_copyable<Varyings>::value == true, "Varyings are not trivially copyable."); \
 static_assert(sizeof(Varyings) % sizeof(float) == 0, "sizeof(Varyings) isn't a multiple of 4. \nNOTE: Varyings are interpreted as being bags of floats."); \
 private:  \
-    Varyings varyings_name_per_vertex[4]; \
+    Varyings varyings_name_per_vertex[3]; \
     Varyings varyings_name_interpolated; \
-    s32 vars_indices[6] = { 0, 1, 2, 3, 4, 5 }; \
 public: \
     VaryingsInfo GetVaryingsInfo() override  \
     {  \
         VaryingsInfo result; \
         result.data = reinterpret_cast<f32*>(&((varyings_name_per_vertex)[0])); \
         result.data_interpolated = reinterpret_cast<f32*>(&(varyings_name_interpolated)); \
-        result.indices = reinterpret_cast<s32*>(&((vars_indices)[0])); \
         result.count = sizeof(Varyings) / sizeof(f32); \
+        result.count_flat = GetFlatVaryingsCount(); \
         return result;  \
     } \
 
+// Helper macro for marking the members of the Varyings struct from first_flat_member on, which have to be its last ones,
+// as flat: they aren't interpolated, every fragment gets the values of the triangle's first vertex.
+#define ERS_SHADER_DEFINE_FLAT_VARYINGS(first_flat_member) \
+public: \
+    static s32 GetFlatVaryingsCount() { return (s32)((sizeof(Varyings) - offsetof(Varyings, first_flat_member)) / sizeof(f32)); } \
+
+// Helper macro for marking a shader program as depth-only (see IShaderProgram::IsDepthOnly). The renderer then doesn't 
+// generate rasterizing kernels for its type, since they would never call its fragment shader.
+#define ERS_SHADER_DEFINE_DEPTH_ONLY \
+public: \
+    bool IsDepthOnly() const override { return true; } \
+    static constexpr bool IsDepthOnlyType() { return true; } \
+
+// Index of a member of a shader's Varyings struct in FragmentPacket::vars.
+#define ERS_SHADER_VARYING_INDEX(member) (offsetof(Varyings, member) / sizeof(f32))
+
+// Helper macro for making a shader program copyable by the renderer's worker threads (see IShaderProgram::Clone).
+#define ERS_SHADER_DEFINE_CLONE(class_name) \
+public: \
+    IShaderProgram* Clone(ers::IAllocator* alloc) const override \
+    { \
+        void* mem = alloc->Allocate(sizeof(class_name), alignof(class_name)); \
+        return new (mem) class_name(*this); \
+    } \
+
 #endif // SHADER_PROGRAM_H
\ No newline at end of file
@@ -9,6 +9,11 @@ class ShadowmapShader : public IShaderProgram
 {
 
 // ERS_SHADER_DEFINE_VARYINGS({ ers::vec3 fragpos; })
+ERS_SHADER_DEFINE_CLONE(ShadowmapShader)
+ERS_SHADER_DEFINE_DEPTH_ONLY // nothing but the depth is used, so let the renderer skip the fragment shader.
+
+private:
+    ers::mat4 m_lightspaceModel;
     
 public:
     ers::vec3 uniform_light_pos;
@@ -16,6 +21,11 @@ public:
     ers::mat4 uniform_model;
     f32 uniform_zFar;
 
+    void BeginDraw() override
+    {
+        m_lightspaceModel = uniform_lightspace_mat * uniform_model;
+    }
+
     void VertexShader(
         const void* in0, const void* in1, const void* in2,
         ers::vec4& p0, ers::vec4& p1, ers::vec4& p2        
@@ -26,15 +36,23 @@ public:
 		p2 = VertexShaderPerVertex(in2, 2);
     }
 
-    ers::vec4 VertexShaderPerVertex(const void* in, s32 which_vert)
+    ers::vec4 VertexShaderPerVertex(const void* in, s32 which_vert) override
     {       
+        ERS_UNUSED(which_vert);
         const VertexAttributes1* vert = (const VertexAttributes1*)in;
         //m_vars[which_vert].fragpos = ers::vec3(uniform_model * ers::vec4(vert->aPos, 1.0f));		
 
-		const ers::vec4 position = uniform_lightspace_mat * uniform_model * ers::vec4(vert->aPos, 1.0f);       
+		const ers::vec4 position = m_lightspaceModel * ers::vec4(vert->aPos, 1.0f);       
         return position;
     }
 
+    bool HasPacketVertexShader() const override { return true; }
+
+    void VertexShaderPacket(const VertexPacket& packet, PacketVec4& out) override
+    {
+        const PacketVec3 pos = packet.LoadVec3(offsetof(VertexAttributes1, aPos));
+        out = packet_transform(m_lightspaceModel, PacketVec4(pos, PacketF32(1.0f)));
+    }
 
     bool FragmentShader(ers::vec4& out) override
     {            
@@ -0,0 +1,34 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include "ers/typedefs.h"
+
+// Instruction set selection for the rasterizer's vectorized kernels.
+// AVX2 has to be enabled explicitly (-mavx2, /arch:AVX2, see the ERS_RENDERER_AVX2 cmake option),
+// SSE2 is always there on x86-64. Anything else (e.g. emscripten) gets the scalar code paths.
+#if defined(__AVX2__)
+    #define ERS_SIMD_AVX2
+    #define ERS_SIMD_SSE2
+    #include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define ERS_SIMD_SSE2
+    #include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+#endif
+
+// Index of the lowest set bit. x must not be 0.
+inline s32 ers_count_trailing_zeros(u32 x)
+{
+#if defined(_MSC_VER)
+    unsigned long idx;
+    _BitScanForward(&idx, x);
+    return (s32)idx;
+#else
+    return __builtin_ctz(x);
+#endif
+}
+
+#endif // SIMD_H
\ No newline at end of file
@@ -8,6 +8,7 @@ class SimpleShader : public IShaderProgram
 {
 
 ERS_SHADER_DEFINE_VARYINGS(m_vars, m_varsInterpolated, { ers::vec3 color; })
+ERS_SHADER_DEFINE_CLONE(SimpleShader)
 
 public:
     void VertexShader(
@@ -20,7 +21,7 @@ public:
 		p2 = VertexShaderPerVertex(in2, 2);
     }
 
-    ers::vec4 VertexShaderPerVertex(const void* in, s32 which_vert)
+    ers::vec4 VertexShaderPerVertex(const void* in, s32 which_vert) override
     {       
         const VertexAttributes3* vert = (const VertexAttributes3*)in;
         m_vars[which_vert].color = vert->aColor;		
@@ -34,6 +35,14 @@ public:
         out = ers::vec4(m_varsInterpolated.color, 1.0f);     
         return false;
     }  
+
+    bool HasPacketShader() const override { return true; }
+
+    u32 FragmentShaderPacket(const FragmentPacket& packet, PacketVec4& out) override
+    {
+        out = PacketVec4(PacketVec3::Load(packet.vars + ERS_SHADER_VARYING_INDEX(color)), PacketF32(1.0f));
+        return 0;
+    }
 };
 
 #endif // SIMPLE_SHADER_H
\ No newline at end of file
@@ -5,13 +5,46 @@
 #include "ers/macros.h"
 #include "ers/common.h"
 #include "ers/vec.h"
+#include "ers/matrix.h"
 #include "ers/allocators.h"
+#include "ers/vector.h"
 #include "image.h"
 #include "shader_program.h"
+#include "thread_pool.h"
+#include <type_traits>
 
 #define ERS_RENDERER_EPSILON 5.0e-5f
 #define ERS_RENDERER_MAX_WIDTH 2048
 #define ERS_RENDERER_MAX_HEIGHT 2048
+#define ERS_RENDERER_TILE_SIZE 64
+#define ERS_RENDERER_MAX_TILES_X (ERS_RENDERER_MAX_WIDTH / ERS_RENDERER_TILE_SIZE)
+#define ERS_RENDERER_MAX_TILES_Y (ERS_RENDERER_MAX_HEIGHT / ERS_RENDERER_TILE_SIZE)
+#define ERS_RENDERER_BLOCK_SIZE 8 // must divide ERS_RENDERER_TILE_SIZE.
+#define ERS_RENDERER_SUBBLOCK_SIZE 4
+#define ERS_RENDERER_HIZ_MAX_X (ERS_RENDERER_MAX_WIDTH / ERS_RENDERER_BLOCK_SIZE)
+#define ERS_RENDERER_HIZ_MAX_Y (ERS_RENDERER_MAX_HEIGHT / ERS_RENDERER_BLOCK_SIZE)
+#define ERS_RENDERER_VIS_EMPTY 0xffffffffu // visibility buffer value of pixels without a deferred triangle.
+#define ERS_RENDERER_MAX_VARYINGS 32 // max floats in a shader's Varyings struct.
+#define ERS_RENDERER_SUBPIXEL_BITS 4 // fractional bits of the fixed-point screen coordinates.
+#define ERS_RENDERER_SUBPIXEL_STEPS (1 << ERS_RENDERER_SUBPIXEL_BITS)
+// Triangles are only clipped against the x- and y-planes if they reach beyond [-GUARD_BAND, GUARD_BAND] pixels.
+// Along with the max viewport size and the subpixel bits, this keeps the edge functions at the pixel centers within 32 bits.
+#define ERS_RENDERER_GUARD_BAND 4096
+#define ERS_RENDERER_MAX_CLIP_VERTICES 10 // vertices created by clipping against the near and the 4 guard band planes.
+#define ERS_RENDERER_CLEAR_DEPTH 1.0f
+#define ERS_RENDERER_VERTEX_BATCH 256 // vertices per job of the vertex stage, a multiple of 8.
+#define ERS_RENDERER_MSAA_SAMPLES 4
+#define ERS_RENDERER_MSAA_EXTENT 6 // farthest a sample is from its pixel's center, in subpixels along either axis.
+#define ERS_RENDERER_UPSCALE_ROWS 16 // rows per job of UpscaleColorBuffer.
+
+// Number of set bits of x.
+constexpr u32 ers_count_bits(u32 x) { return (x == 0) ? 0 : (x & 1u) + ers_count_bits(x >> 1); }
+
+// Spreads the low bits of x over the set bits of mask, lowest first (i.e. the inverse of packing the bits of mask).
+constexpr u32 ers_deposit_bits(u32 x, u32 mask) 
+{ 
+    return (mask == 0) ? 0 : (((x & 1u) != 0) ? (mask & (0u - mask)) : 0) | ers_deposit_bits(x >> 1, mask & (mask - 1u)); 
+}
 
 class Renderer
 {
@@ -21,11 +54,43 @@ public:
         DEFAULT = 0,
         CULL_FACE = 1 << 0,
         WIREFRAME = 1 << 1,
-        DEPTH_TEST = 1 << 2
+        DEPTH_TEST = 1 << 2,
+        BINNING = 1 << 3, // Sort triangles into screen tiles and rasterize the tiles on multiple threads. 
+        // Visibility buffer: draws only write depth and triangle ids, and every visible pixel is shaded once, 
+        // when the color buffer is needed (GetColorBuffer, WriteToFile, SetViewport or disabling DEFERRED). 
+        // Shaders are copied per draw (see IShaderProgram::Clone), the ones that can't be are shaded right away.
+        // Fragments discarded by a deferred shader keep the color the pixel had before shading.
+        DEFERRED = 1 << 4,
+        NO_DEPTH_WRITE = 1 << 5, // Fragments are still depth tested (with DEPTH_TEST), but don't write to the z-buffer.
+        // 4x multisampling: coverage and depth per sample (rotated grid), the fragment shader once per pixel, at its center. 
+        // The samples are resolved into the color buffer when it's needed (GetColorBuffer, WriteToFile, SetViewport or 
+        // disabling MSAA), the z-buffer holds the farthest sample of every pixel. DEFERRED and packet shading are 
+        // ignored while it's enabled, and SetPixel/SetZValue only write the resolved buffers.
+        MSAA = 1 << 6,
+        // Alpha blending of the shaded fragments over the color buffer (source over), in drawing order.
+        BLEND = 1 << 7,
+        // Weighted blended order-independent transparency: fragments are added to per-pixel accumulation and revealage 
+        // buffers, weighted by alpha and view depth, so transparent draws don't have to be sorted. They're composited 
+        // over the color buffer when it's needed (GetColorBuffer, WriteToFile, SetViewport or disabling OIT), 
+        // Clear discards them. Meant to be drawn after the opaque geometry, with DEPTH_TEST and NO_DEPTH_WRITE. 
+        // Takes precedence over BLEND. DEFERRED is ignored while either of them is enabled.
+        OIT = 1 << 8,
+        SCISSOR_TEST = 1 << 9 // Draws and Clear only touch the pixels in the scissor rectangle (see SetScissor).
+    };
+
+    // Pixels (width x height) covered by one fragment shader invocation, see SetShadingRate.
+    enum ShadingRate
+    {
+        SHADING_RATE_1X1 = 0,
+        SHADING_RATE_2X1,
+        SHADING_RATE_2X2,
+        SHADING_RATE_4X4
     };
 
-    Renderer(s32 width, s32 height, ers::IAllocator* alloc = &ers::default_alloc);
-    ~Renderer();
+    // @param count_workers: worker threads used when BINNING is enabled, besides the calling thread. 
+    // Negative means "one less than the hardware threads".
+    Renderer(s32 width, s32 height, ers::IAllocator* alloc = &ers::default_alloc, s32 count_workers = -1);
+    ~Renderer(); // discards the triangles that haven't been flushed (see Flush).
 
     void Enable(State state);
     void Disable(State state);
@@ -36,19 +101,91 @@ public:
     void SetZValue(s32 x, s32 y, f32 z_val);
     f32 GetZValue(s32 x, s32 y);
 
+    // Occlusion queries against the depth drawn so far (flushing first), e.g. to skip instances hidden behind 
+    // the occluders drawn in a depth-only pass. Depths are window depths in [0, 1], rectangles are inclusive pixel ranges.
+    // Whether a fragment at depth z_min or farther could pass the depth test anywhere in the rectangle. This is answered 
+    // from the Hi-Z buffer, i.e. per ERS_RENDERER_BLOCK_SIZE^2 pixels, so it may be true for hidden rectangles as well.
+    bool IsRectVisible(s32 x_min, s32 y_min, s32 x_max, s32 y_max, f32 z_min);
+    // Same as the above, for the screen space bounds of the box's corners transformed by mvp.
+    // Boxes reaching behind the eye are always visible.
+    bool IsAabbVisible(const ers::vec3& aabb_min, const ers::vec3& aabb_max, const ers::mat4& mvp);
+    // The exact number of pixels in the rectangle a fragment at depth z would pass the depth test of.
+    s32 CountVisibleSamples(s32 x_min, s32 y_min, s32 x_max, s32 y_max, f32 z);
+
+    // Sets the size of the renderer's own buffers, which only ever grow to fit it. Not allowed while a render target is set.
     void SetViewport(s32 width, s32 height);
+    // Draws into the given images from here on (both nullptr: back to the renderer's own buffers and their viewport). 
+    // color has to be an LDR RGBA image, depth an HDR GRAYSCALE one of the same size, which becomes the viewport. 
+    // Without a color attachment, every draw is depth-only (fragment shaders aren't run, so they can't discard),
+    // without a depth attachment, a scratch z-buffer of the renderer's, cleared when the target is set, is used instead. 
+    // The images keep their contents: deferred shading, MSAA samples and OIT are resolved into the current buffers before 
+    // switching, and so are the pending clears of a render target. The own buffers' pending clears are kept for when 
+    // they're switched back to.
+    void SetRenderTarget(Image* color, Image* depth);
     void SetShaderProgram(IShaderProgram* shader);
+    // Coarse shading for the draws from here on: the fragment shader runs once per screen aligned block of pixels 
+    // of the rate's size, at the block's center, and its color goes to every pixel of the block the triangle covers. 
+    // Coverage, depth testing and depth writes stay per pixel. Meant for low frequency surfaces, e.g. large floors 
+    // or distant geometry. Ignored with MSAA and WIREFRAME, and for the triangles shaded through the visibility buffer.
+    void SetShadingRate(ShadingRate rate);
+    // The pixels (x, y) with x in [x, x + width) and y in [y, y + height) for SCISSOR_TEST, not limited to the viewport.
+    void SetScissor(s32 x, s32 y, s32 width, s32 height);
+
+    // Partial redraws: once any dirty rectangle is added, draws and Clear only touch the tiles (ERS_RENDERER_TILE_SIZE^2 
+    // pixels) the dirty rectangles overlap, all other pixels keep their contents. E.g. for a mostly static view, mark 
+    // where whatever changed was and is now, then clear and draw the whole scene, and reset them for the next frame.
+    // Rectangles are inclusive pixel ranges. Without any, the whole viewport is drawn.
+    void AddDirtyRect(s32 x_min, s32 y_min, s32 x_max, s32 y_max);
+    // Same as the above, for the screen space bounds of the box's corners transformed by mvp.
+    // Boxes reaching behind the eye make the whole viewport dirty.
+    void AddDirtyAabb(const ers::vec3& aabb_min, const ers::vec3& aabb_max, const ers::mat4& mvp);
+    void ResetDirtyRects();
+
+    // Only marks every tile as cleared. A tile's pixels are written when it's first drawn to, 
+    // or when the buffers are read (the getters, GetZValue and WriteToFile). Pending clears survive SetViewport.
     void Clear(f32 r = 0.0f, f32 g = 0.0f, f32 b = 0.0f, f32 a = 1.0f);
 
-    u8* GetColorBuffer();
-    f32* GetZBuffer();
+    u8* GetColorBuffer(); // nullptr if the render target has no color attachment.
+    f32* GetZBuffer(); // Writing through the returned pointer is fine, the Hi-Z buffer is rebuilt before the next triangle.
     s32 GetWidth();
     s32 GetHeight();
-    const ers::vec4* GetNdcVertices();
+    const ers::vec4* GetNdcVertices(); // clip space positions of the current triangle, as output by the vertex shader.
     
     void RenderTriangle(const void* in0, const void* in1, const void* in2);  
+
+    // Same as SetShaderProgram(&shader) followed by the above, but with the vertex and fragment shader calls resolved 
+    // at compile time, so that they can be inlined into the rasterizing kernels. ShaderT has to be the shader's actual 
+    // type (and not one of its bases), since its overrides are called directly.
+    template<typename ShaderT>
+    void RenderTriangle(ShaderT& shader, const void* in0, const void* in1, const void* in2);  
+
+    // Calls the shader's BeginDraw, then renders count_vertices / 3 triangles with the specialized pipeline above and flushes. 
+    // @param vertices: the vertex attributes of the triangles' vertices, stride bytes apart.
+    template<typename ShaderT>
+    void Draw(ShaderT& shader, const void* vertices, size_t stride, s32 count_vertices);
+
+    // Renders count_indices / 3 triangles made of the vertices the indices point to and flushes. After the current shader's
+    // BeginDraw, all vertices referred to are shaded first, once each, through its VertexShaderPerVertex (in batches spread 
+    // over the worker threads, if the shader can be cloned). The triangles are then assembled from their outputs.
+    // @param vertices: the vertex attributes, stride bytes apart.
+    // @param indices: three vertex indices per triangle.
+    void DrawIndexed(const void* vertices, size_t stride, const s32* indices, s32 count_indices);
+
+    // Same as SetShaderProgram(&shader) followed by the above, specialized for the shader's type (see RenderTriangle).
+    template<typename ShaderT>
+    void DrawIndexed(ShaderT& shader, const void* vertices, size_t stride, const s32* indices, s32 count_indices);
+
+    // Rasterizes the triangles binned so far. With BINNING enabled, RenderTriangle only queues triangles, 
+    // so this has to be called before changing any uniforms of the current shader (i.e. at the end of each draw).
+    // State changes, Clear, SetViewport, SetShaderProgram and the buffer getters flush implicitly.
+    void Flush();
+
     void WriteToFile(const char* filename, bool flip = true);
 
+    // Scales the color buffer (resolved like GetColorBuffer does) to width x height RGBA8 pixels into dst, bilinearly,
+    // e.g. to present a frame rendered below the output resolution. The rows are spread over the worker threads.
+    void UpscaleColorBuffer(u8* dst, s32 width, s32 height);
+
 private:
     struct Bbox
     {
@@ -58,46 +195,335 @@ private:
 
     struct NdcTriCoords
     {
-        s32 x0, y0;
+        s32 x0, y0; // fixed-point screen coordinates, with ERS_RENDERER_SUBPIXEL_BITS fractional bits.
         s32 x1, y1;
         s32 x2, y2;
-        s32 surface;
-        ers::ivec2 d01;
-        ers::ivec2 d12;
-        ers::ivec2 d20;
+        s64 surface; // double the signed surface, in subpixels.
+        // Edge functions at the pixel centers, weight_k(x, y) = a_k * x + b_k * y + c_k for pixel (x, y), oriented to be
+        // >= 0 inside the triangle, fill rule included. These are the barycentric coordinates scaled by 
+        // |surface| / ERS_RENDERER_SUBPIXEL_STEPS and rounded down, frac_k being what got rounded off.
+        ers::ivec3 a, b, c;
+        ers::vec3 frac;
+        f32 surface_inv; // ERS_RENDERER_SUBPIXEL_STEPS / |surface|.
+        ers::vec4 p0, p1, p2; // normalized device coordinates, with w replaced by 1/w.
+        const f32* vars[3]; // varyings of the vertices, nullptr if the shader has none.
+        u32 id; // index into m_deferredTris, written to the visibility buffer. ERS_RENDERER_VIS_EMPTY when shaded right away.
+    };
+
+    // Integer barycentric weights of a triangle as a function of the pixel position.
+    struct EdgeFunctions
+    {
+        s32 x0, y0; // pixel at which the weights are weights0.
+        ers::ivec3 weights0;
+        ers::ivec3 wstepx;
+        ers::ivec3 wstepy;
+        ers::vec3 weights_frac; // see NdcTriCoords::frac.
+        f32 tri_surface_inv;
+        // With MSAA, sample s is in the triangle if weights + sample_shifts[s] >= 0 (see setupRasterContext).
+        // sample_min/sample_max are the extremes of the shifts per edge, 0 without MSAA.
+        ers::ivec3 sample_shifts[ERS_RENDERER_MSAA_SAMPLES];
+        ers::ivec3 sample_min, sample_max;
+
+        ers::ivec3 GetWeights(s32 x, s32 y) const { return weights0 + wstepx * (x - x0) + wstepy * (y - y0); }
+
+        ers::vec3 GetBarycentrics(const ers::ivec3& weights) const 
+        { 
+            return ers::vec3(
+                ((f32)weights.x() + weights_frac.x()) * tri_surface_inv, 
+                ((f32)weights.y() + weights_frac.y()) * tri_surface_inv, 
+                ((f32)weights.z() + weights_frac.z()) * tri_surface_inv
+            ); 
+        }
+    };
+
+    // The varyings divided by w, which are linear in screen space: value(x, y) = base + dx * (x - x0) + dy * (y - y0), 
+    // with (x0, y0) the origin of the edge functions. Set up once per triangle and stepped along the rows.
+    struct VaryingPlanes
+    {
+        f32 base[ERS_RENDERER_MAX_VARYINGS];
+        f32 dx[ERS_RENDERER_MAX_VARYINGS];
+        f32 dy[ERS_RENDERER_MAX_VARYINGS];
+        f32 current[ERS_RENDERER_MAX_VARYINGS]; // values at (cur_x, cur_y).
+        s32 cur_x, cur_y;
+    };
+
+    // Depth in [0, 1] as a linear function of the pixel position, relative to the origin of the edge functions.
+    struct DepthPlane
+    {
+        f32 z0;
+        f32 dx, dy;
+        f32 z_min; // nearest depth of the triangle's vertices.
+        f32 sample_dz[ERS_RENDERER_MSAA_SAMPLES]; // depth of the samples relative to their pixel's center.
+    };
+
+    // Per-triangle state of the rasterizing kernel.
+    struct RasterContext
+    {
+        const NdcTriCoords* tri;
+        IShaderProgram* shader;
+        VaryingsInfo vars_info;
+        EdgeFunctions edges;
+        VaryingPlanes planes;
+        DepthPlane depth;
+        bool depth_only; // no shading, only write depth (and the triangle's id to the visibility buffer, if it has one).
+        bool packet; // shaded a quad at a time, see IShaderProgram::HasPacketShader.
+        bool depth_written; // set when a fragment wrote to the z-buffer, so that the Hi-Z buffer gets updated.
+        s32 coarse_width, coarse_height; // pixels per fragment shader invocation, 1 x 1 unless coarse shading applies.
     };
 
-    ers::vec4 m_ndcTri[6];
+    // Triangle waiting in the visibility buffer to be shaded by the shader of its draw.
+    struct DeferredTriangle
+    {
+        NdcTriCoords tri;
+        size_t vars_offset;
+        s32 draw_idx;
+    };
+
+    // Copy of the shader (and its uniforms) a draw was made with.
+    struct DeferredDraw
+    {
+        IShaderProgram* shader;
+        s32 varyings_count;
+    };
+
+    enum class BlockCoverage { OUTSIDE, PARTIAL, INSIDE };
+
+    // rasterizeTriangle instantiated for a shader type and a combination of the states below.
+    typedef void (Renderer::*RasterizeKernel)(const NdcTriCoords& tri, const Bbox& bbox, IShaderProgram* shader);
+
+    // The states the rasterizing kernels are specialized for, so that they aren't checked per pixel. 
+    // Kernels for every combination of them are instantiated per shader type, adding a state here is all it takes.
+    static const u32 KERNEL_STATES = WIREFRAME | DEPTH_TEST | DEFERRED | NO_DEPTH_WRITE | MSAA | BLEND | OIT;
+    static const u32 COUNT_KERNELS = 1u << ers_count_bits(KERNEL_STATES);
+    // DEFERRED is ignored while MSAA, BLEND or OIT is enabled, the visibility buffer is empty then. Those combinations
+    // share the kernels without it, instead of instantiating ones that only differ in a no-op.
+    static constexpr u32 getKernelState(u32 state) { return ((state & (MSAA | BLEND | OIT)) != 0) ? (state & ~(u32)DEFERRED) : state; }
+
+    // Flags of m_tileClears: the tile's part of the buffer still has to be filled with the clear value.
+    enum TileClear : u8
+    {
+        CLEAR_NONE = 0,
+        CLEAR_COLOR = 1 << 0,
+        CLEAR_DEPTH = 1 << 1
+    };
+
+    // Triangle waiting in the bins. Its varyings are kept in m_binnedVaryings, 
+    // since the shader overwrites its own with every vertex shader invocation.
+    struct BinnedTriangle
+    {
+        NdcTriCoords tri;
+        size_t vars_offset;
+    };
+
+    ers::vec4 m_ndcTri[3];
+
+    // The current triangle after clipping, a convex polygon. Varyings of the vertices made by clipping are kept in m_clipVaryings.
+    ers::vec4 m_clipPositions[ERS_RENDERER_MAX_CLIP_VERTICES];
+    const f32* m_clipVars[ERS_RENDERER_MAX_CLIP_VERTICES];
+    f32 m_clipVaryings[(ERS_RENDERER_MAX_CLIP_VERTICES + 1) * ERS_RENDERER_MAX_VARYINGS]; // + 1 for the flat varyings of the first vertex.
     
     s32 m_width;
     s32 m_height;
-    u8* m_colorBuffer;
-    f32* m_zBuffer;
+    u8* m_colorBuffer; // the render target's color attachment, or m_ownColors. nullptr for depth-only targets.
+    f32* m_zBuffer; // the render target's depth attachment (m_scratchDepths if it has none), or m_ownDepths.
+    f32* m_hiZBuffer; // farthest depth of every ERS_RENDERER_BLOCK_SIZE^2 block of m_zBuffer (or more, never less).
+    bool m_hiZDirty; // m_zBuffer may have changed behind the Hi-Z buffer's back, rebuild it before using it.
+    ers::Vector<u32> m_visBuffer; // per pixel, index into m_deferredTris of the visible triangle or ERS_RENDERER_VIS_EMPTY.
+    u8 m_tileDeferred[ERS_RENDERER_MAX_TILES_X * ERS_RENDERER_MAX_TILES_Y]; // whether a deferred triangle overlaps the tile.
+    // The renderer's own buffers, big enough for the largest viewport they were used with, and that viewport's size.
+    ers::Vector<u32> m_ownColors;
+    ers::Vector<f32> m_ownDepths;
+    s32 m_ownWidth;
+    s32 m_ownHeight;
+    ers::Vector<f32> m_scratchDepths; // z-buffer of the render targets without a depth attachment, so the own one stays intact.
+    Image* m_targetColor; // attachments of the render target, both nullptr for the own buffers.
+    Image* m_targetDepth;
+    u8 m_tileClears[ERS_RENDERER_MAX_TILES_X * ERS_RENDERER_MAX_TILES_Y]; // TileClear flags per tile.
+    u32 m_clearColor; // RGBA8 pixel the last Clear set.
+    // The own buffers' m_tileClears and m_clearColor while a render target is set, restored when switching back to them.
+    u8 m_ownTileClears[ERS_RENDERER_MAX_TILES_X * ERS_RENDERER_MAX_TILES_Y];
+    u32 m_ownClearColor;
+    Bbox m_scissor;
+    ShadingRate m_shadingRate;
+    // With dirty rectangles added (m_partialRedraw), the tiles they overlap, and the bounding box of those tiles.
+    bool m_partialRedraw;
+    u8 m_tileDirty[ERS_RENDERER_MAX_TILES_X * ERS_RENDERER_MAX_TILES_Y];
+    Bbox m_dirtyBounds;
+    // MSAA sample buffers, ERS_RENDERER_MSAA_SAMPLES consecutive values per pixel. Pixels whose samples all have 
+    // the same color are compressed: only their first sample's color is stored (and valid).
+    ers::Vector<u32> m_sampleColors;
+    ers::Vector<f32> m_sampleDepths;
+    ers::Vector<u8> m_sampleCompressed;
+    // OIT accumulation buffers: per pixel, the weighted sum of the premultiplied colors (alpha in w), and per 
+    // sample (ERS_RENDERER_MSAA_SAMPLES per pixel, with or without MSAA), the product of 1 - alpha of the fragments 
+    // covering it. Only the tiles flagged in m_tileAccumulated hold anything but (0, 0, 0, 0) and 1.
+    ers::Vector<ers::vec4> m_oitAccumulation;
+    ers::Vector<f32> m_oitRevealage;
+    u8 m_tileAccumulated[ERS_RENDERER_MAX_TILES_X * ERS_RENDERER_MAX_TILES_Y];
     u32 m_state;
     ers::IAllocator* m_alloc;
 
     IShaderProgram* m_shader;
+    const RasterizeKernel* m_rasterizeKernels; // the current shader type's kernels, see getRasterizeKernels.
+    u32 m_kernelIdx; // index of the kernel for m_state.
+
+    ThreadPool m_threadPool;
+    ers::Vector<IShaderProgram*> m_threadShaders; // per-thread copies of m_shader, made when flushing.
+    ers::Vector<BinnedTriangle> m_binnedTris;
+    ers::Vector<f32> m_binnedVaryings;
+    ers::Vector<ers::Vector<u32>> m_bins; // indices into m_binnedTris per tile, in submission order.
+    ers::Vector<s32> m_activeTiles;
+    s32 m_varyingsCount;
+    bool m_binnedDepthOnly; // whether the binned triangles only write depth, so that flushing them needs no shader.
+
+    ers::Vector<DeferredTriangle> m_deferredTris;
+    ers::Vector<f32> m_deferredVaryings;
+    ers::Vector<DeferredDraw> m_deferredDraws;
+    s32 m_deferredDraw; // index into m_deferredDraws of the draw in progress, -1 if none, -2 if it's shaded right away.
+    ers::Vector<IShaderProgram*> m_resolveShaders; // copies of the deferred draws' shaders for every thread but the calling one.
+
+    // The vertex stage of DrawIndexed, shading every vertex of a draw before any of its triangles is assembled.
+    struct VertexStage
+    {
+        const u8* vertices;
+        size_t stride;
+        s32 count;
+        s32 count_padded; // count rounded up to whole batches.
+        s32 vars_count;
+    };
+
+    // Output of the vertex stage per vertex index. The clip space positions are stored as planes of all xs, ys, zs and ws 
+    // (count_padded floats each), so that the clip codes, the bits of the clip planes a vertex is outside of, 
+    // are computed for ERS_RENDERER_LANES vertices at once. The varyings are planes of count_padded floats as well, one per float 
+    // of the shader's Varyings struct, which packet vertex shaders (see IShaderProgram::HasPacketVertexShader) store to directly.
+    VertexStage m_vertexStage;
+    ers::Vector<f32> m_vertexPositions;
+    ers::Vector<f32> m_vertexVaryings;
+    ers::Vector<u8> m_vertexClipCodes;
+    ers::Vector<u8> m_vertexUsed; // whether any triangle of the draw refers to the vertex.
 
-    void clipTriangle(s32& count_tris);
-    void rasterizeTriangle(s32 tri_idx);   
-
-    void lerpVaryings(f32* out, f32* in1, f32* in2, f32 t, s32 count);
-    void clipGetOneTriangle(ers::vec4& p0, ers::vec4& p1, ers::vec4& p2, f32& t0, f32& t1);
-    void clipGetTwoTriangles(
-        ers::vec4& p0, 
-        ers::vec4& p1, 
-        ers::vec4& p2,
-        ers::vec4& q0, 
-        ers::vec4& q1, 
-        ers::vec4& q2,
-        f32& t0,
-        f32& t1
-    );
+    // Destination of UpscaleColorBuffer, for its jobs of ERS_RENDERER_UPSCALE_ROWS rows each.
+    struct UpscaleTarget
+    {
+        u32* pixels;
+        s32 width;
+        s32 height;
+    };
+    UpscaleTarget m_upscaleTarget;
+
+    void setState(u32 state);
+    static u32 getKernelIndex(u32 state);
+    template<typename ShaderT>
+    static const RasterizeKernel* getRasterizeKernels();
+    template<typename ShaderT, u32 Idx>
+    static void fillRasterizeKernels(RasterizeKernel* kernels, std::integral_constant<u32, Idx>);
+    template<typename ShaderT>
+    static void fillRasterizeKernels(RasterizeKernel* kernels, std::integral_constant<u32, 0>);
+    template<typename ShaderT>
+    void drawIndexed(ShaderT* shader, const void* vertices, size_t stride, const s32* indices, s32 count_indices);
+    template<typename ShaderT>
+    void shadeVertices(ShaderT* shader, const void* vertices, size_t stride, s32 count_vertices);
+    template<typename ShaderT>
+    void shadeVertexBatch(ShaderT* shader, s32 batch);
+    template<typename ShaderT>
+    static void shadeVertexBatchJob(void* data, s32 item, s32 thread_idx);
+    void computeClipCodes(s32 first, s32 count);
+    bool cloneThreadShaders();
+    void releaseThreadShaders();
+    void discardBins();
+    void processTriangle(const f32* vars0, const f32* vars1, const f32* vars2);
+    s32 clipTriangle(const f32* vars0, const f32* vars1, const f32* vars2);
+    bool setupTriangle(s32 idx0, s32 idx1, s32 idx2, NdcTriCoords& tri);
+    void binTriangle(const NdcTriCoords& tri);
+    void rasterizeBin(s32 tile_idx, IShaderProgram* shader);
+    template<typename ShaderT, u32 StateT>
+    void rasterizeTriangle(const NdcTriCoords& tri, const Bbox& bbox, IShaderProgram* shader);   
+    void setupRasterContext(RasterContext& ctx, const NdcTriCoords& tri, s32 x0, s32 y0, IShaderProgram* shader);
+    void setupVaryingPlanes(RasterContext& ctx);
+    template<typename ShaderT, u32 StateT>
+    void rasterizeBlock(RasterContext& ctx, const Bbox& block, s32 block_size);
+    template<typename ShaderT, u32 StateT>
+    void rasterizePixels(RasterContext& ctx, const Bbox& block);
+    template<typename ShaderT, u32 StateT>
+    void rasterizeQuads(RasterContext& ctx, const Bbox& block);
+    template<typename ShaderT, u32 StateT>
+    void rasterizeCoarse(RasterContext& ctx, const Bbox& block);
+    void rasterizeDepthBlock(RasterContext& ctx, const Bbox& block, bool depth_test);
+    BlockCoverage classifyBlock(const EdgeFunctions& edges, const Bbox& block);
+    template<typename ShaderT, u32 StateT>
+    void shadeFragment(RasterContext& ctx, s32 x, s32 y, const ers::ivec3& weights);
+    template<typename ShaderT, u32 StateT>
+    void rasterizeSamples(RasterContext& ctx, const Bbox& block);
+    template<typename ShaderT, u32 StateT>
+    void shadeSamples(RasterContext& ctx, s32 x, s32 y, const ers::ivec3& weights, u32 sample_mask);
+    u32 getSampleMask(const EdgeFunctions& edges, const ers::ivec3& weights);
+    void setSamples(s32 x, s32 y, const ers::vec4& color, u32 sample_mask);
+    void setSampleDepths(s32 x, s32 y, const f32* z, u32 sample_mask);
+    void clearSamples(size_t position, s32 count, u8 flags);
+    void loadSamples();
+    void resolveSamples();
+    template<u32 StateT>
+    void writeFragment(s32 x, s32 y, ers::vec4& color, f32 w);
+    template<u32 StateT>
+    void writeSamples(s32 x, s32 y, const ers::vec4& color, u32 sample_mask, f32 w);
+    void expandSamples(size_t pixel);
+    void blendPixel(s32 x, s32 y, const ers::vec4& color);
+    void blendSamples(s32 x, s32 y, const ers::vec4& color, u32 sample_mask);
+    void accumulateFragment(s32 x, s32 y, const ers::vec4& color, f32 w, u32 sample_mask);
+    void reserveTransparency();
+    void clearTransparency(s32 tile_idx);
+    void resolveTransparency();
+    f32 getPerspectiveBarycentrics(const NdcTriCoords& tri, const ers::vec3& bar, ers::vec3& bar_correct);
+    template<typename ShaderT>
+    bool runFragmentShader(RasterContext& ctx, s32 x, s32 y, const ers::vec3& bar, const ers::vec3& bar_correct, f32 w, ers::vec4& col);
+    void stepVaryingPlanes(RasterContext& ctx, s32 x, s32 y);
+    void setupDepthPlane(RasterContext& ctx);
+    f32 getBlockMinDepth(const RasterContext& ctx, const Bbox& block, f32 margin);
+    bool isOccluded(const NdcTriCoords& tri, const Bbox& bbox);
+    void updateHiZ(s32 block_x, s32 block_y);
+    void rebuildHiZ();
+
+    void bindBuffers();
+    void resolveBuffers();
+    Bbox getDrawRegion();
+    void clearRegion(u32 color);
+    bool isTileDrawn(s32 tile_idx) const { return !m_partialRedraw || m_tileDirty[tile_idx] != 0; }
+    bool getAabbScreenRect(const ers::vec3& aabb_min, const ers::vec3& aabb_max, const ers::mat4& mvp, Bbox& rect, f32& z_min);
+    bool isDepthOnlyDraw() const { return m_colorBuffer == nullptr || m_shader->IsDepthOnly(); }
+    void prepareTile(s32 tile_idx, u8 flags) { if ((m_tileClears[tile_idx] & flags) != 0) clearTile(tile_idx, flags); }
+    void prepareTileAt(s32 x, s32 y, u8 flags) { prepareTile((y / ERS_RENDERER_TILE_SIZE) * ERS_RENDERER_MAX_TILES_X + x / ERS_RENDERER_TILE_SIZE, flags); }
+    // SetPixel, SetZValue and GetZValue without preparing the tile, for the raster kernels: 
+    // rasterizeTriangle prepares a block's tile before touching any of its pixels.
+    void setPixel(s32 x, s32 y, const ers::vec4& color) { ((u32*)m_colorBuffer)[(size_t)y * m_width + x] = packColor(color); }
+    void setZValue(s32 x, s32 y, f32 z_val);
+    f32 getZValue(s32 x, s32 y) const { return m_zBuffer[(size_t)y * m_width + x]; }
+    void clearTile(s32 tile_idx, u8 flags);
+    void prepareBuffers(u8 flags);
+
+    bool beginDeferredDraw();
+    void deferTriangle(NdcTriCoords& tri, const Bbox& bbox);
+    void clearVisibility();
+    void resolveVisibility();
+    void discardVisibility();
+    void resolveTile(s32 tile_idx, s32 thread_idx);
+    static void resolveTileJob(void* data, s32 item, s32 thread_idx);
+    static void rasterizeBinJob(void* data, s32 item, s32 thread_idx);
+    void upscaleRows(s32 band);
+    static void upscaleRowsJob(void* data, s32 item, s32 thread_idx);
+
+    void lerpVaryings(f32* out, const f32* in1, const f32* in2, f32 t, s32 count);
+    void copyFlatVaryings(f32* out, const f32* in, s32 count, s32 count_flat);
+    f32 getClipDistance(const ers::vec4& p, s32 plane);
     void normalizeCoordinates(ers::vec4& p);
+    static u32 packColor(const ers::vec4& color);
+    static ers::vec4 unpackColor(u32 rgba);
+    static u32 blendColor(u32 dst, const ers::vec4& color);
 
-    NdcTriCoords getNdcTriCoords(ers::vec4& p0, ers::vec4& p1, ers::vec4& p2);
+    NdcTriCoords getNdcTriCoords(const ers::vec4& p0, const ers::vec4& p1, const ers::vec4& p2);
     Bbox getTriangleBoundingBox(const NdcTriCoords& tri);
-    ers::ivec3 getWeights0(const NdcTriCoords& tri, s32 x0, s32 y0);
+    Bbox getTileRect(s32 tile_idx);
 };
 
+#include "software_renderer_kernels.h"
+
 #endif // SOFTWARE_RENDERER_H
\ No newline at end of file
@@ -0,0 +1,961 @@
+#ifndef SOFTWARE_RENDERER_KERNELS_H
+#define SOFTWARE_RENDERER_KERNELS_H
+
+// Definitions of the templated parts of the Renderer: the rasterizing kernels down to the fragment shader call, 
+// which are instantiated per shader type (see Renderer::Draw). Only meant to be included by software_renderer.h.
+
+#include "simd.h"
+
+// How many horizontally adjacent pixels the coverage test handles at once.
+#if defined(ERS_SIMD_AVX2)
+    #define ERS_RENDERER_LANES 8
+#elif defined(ERS_SIMD_SSE2)
+    #define ERS_RENDERER_LANES 4
+#else
+    #define ERS_RENDERER_LANES 1
+#endif
+
+// Evaluates the (integer) barycentric weights of ERS_RENDERER_LANES pixels of a row at once
+// and tells which of them are inside the triangle, i.e. have no negative weights. The scalar version doubles as the fallback.
+// WriteDepth does the depth test and write of the lanes in mask, with the depth computed exactly like 
+// shadeFragment does it, so that both paths agree to the bit. It returns the lanes written.
+// The lanes are loaded and stored as a whole, the ones not written keep their values.
+struct CoverageStepper
+{
+#if defined(ERS_SIMD_AVX2)
+    __m256i w[3];
+    __m256i step[3];
+
+    CoverageStepper(const ers::ivec3& weights, const ers::ivec3& wstepx)
+    {
+        const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        for (s32 k = 0; k < 3; ++k)
+        {
+            w[k] = _mm256_add_epi32(_mm256_set1_epi32(weights.e[k]), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(wstepx.e[k])));
+            step[k] = _mm256_set1_epi32(ERS_RENDERER_LANES * wstepx.e[k]);
+        }
+    }
+
+    u32 GetMask() const
+    {
+        const __m256i any_negative = _mm256_or_si256(w[0], _mm256_or_si256(w[1], w[2]));
+        return ~(u32)_mm256_movemask_ps(_mm256_castsi256_ps(any_negative)) & 0xffu;
+    }
+
+    u32 WriteDepth(f32 tri_surface_inv, const ers::vec3& frac, const ers::vec3& pz, u32 mask, bool depth_test, f32* zbuf, u32* ids, u32 id) const
+    {
+        const __m256 inv = _mm256_set1_ps(tri_surface_inv);
+        __m256 z = _mm256_mul_ps(_mm256_mul_ps(_mm256_add_ps(_mm256_cvtepi32_ps(w[0]), _mm256_set1_ps(frac.x())), inv), _mm256_set1_ps(pz.x()));
+        z = _mm256_add_ps(z, _mm256_mul_ps(_mm256_mul_ps(_mm256_add_ps(_mm256_cvtepi32_ps(w[1]), _mm256_set1_ps(frac.y())), inv), _mm256_set1_ps(pz.y())));
+        z = _mm256_add_ps(z, _mm256_mul_ps(_mm256_mul_ps(_mm256_add_ps(_mm256_cvtepi32_ps(w[2]), _mm256_set1_ps(frac.z())), inv), _mm256_set1_ps(pz.z())));
+        z = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), z), _mm256_set1_ps(0.5f));
+
+        const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+        __m256 pass = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32((s32)mask), bits), bits));
+        pass = _mm256_and_ps(pass, _mm256_cmp_ps(z, _mm256_setzero_ps(), _CMP_NLT_UQ));
+        pass = _mm256_and_ps(pass, _mm256_cmp_ps(z, _mm256_set1_ps(1.0f), _CMP_NGT_UQ));
+        const __m256 buf = _mm256_loadu_ps(zbuf);
+        if (depth_test) pass = _mm256_and_ps(pass, _mm256_cmp_ps(z, buf, _CMP_LE_OQ));
+
+        const u32 written = (u32)_mm256_movemask_ps(pass);
+        if (written == 0) return 0;
+        _mm256_storeu_ps(zbuf, _mm256_blendv_ps(buf, z, pass));
+        if (ids != nullptr)
+        {
+            const __m256i old_ids = _mm256_loadu_si256((const __m256i*)ids);
+            _mm256_storeu_si256((__m256i*)ids, _mm256_blendv_epi8(old_ids, _mm256_set1_epi32((s32)id), _mm256_castps_si256(pass)));
+        }
+        return written;
+    }
+
+    void Step()
+    {
+        for (s32 k = 0; k < 3; ++k) w[k] = _mm256_add_epi32(w[k], step[k]);
+    }
+#elif defined(ERS_SIMD_SSE2)
+    __m128i w[3];
+    __m128i step[3];
+
+    CoverageStepper(const ers::ivec3& weights, const ers::ivec3& wstepx)
+    {
+        for (s32 k = 0; k < 3; ++k)
+        {
+            const s32 w0 = weights.e[k]; 
+            const s32 s = wstepx.e[k];
+            w[k] = _mm_setr_epi32(w0, w0 + s, w0 + 2 * s, w0 + 3 * s);
+            step[k] = _mm_set1_epi32(ERS_RENDERER_LANES * s);
+        }
+    }
+
+    u32 GetMask() const
+    {
+        const __m128i any_negative = _mm_or_si128(w[0], _mm_or_si128(w[1], w[2]));
+        return ~(u32)_mm_movemask_ps(_mm_castsi128_ps(any_negative)) & 0xfu;
+    }
+
+    u32 WriteDepth(f32 tri_surface_inv, const ers::vec3& frac, const ers::vec3& pz, u32 mask, bool depth_test, f32* zbuf, u32* ids, u32 id) const
+    {
+        const __m128 inv = _mm_set1_ps(tri_surface_inv);
+        __m128 z = _mm_mul_ps(_mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(w[0]), _mm_set1_ps(frac.x())), inv), _mm_set1_ps(pz.x()));
+        z = _mm_add_ps(z, _mm_mul_ps(_mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(w[1]), _mm_set1_ps(frac.y())), inv), _mm_set1_ps(pz.y())));
+        z = _mm_add_ps(z, _mm_mul_ps(_mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(w[2]), _mm_set1_ps(frac.z())), inv), _mm_set1_ps(pz.z())));
+        z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.5f), z), _mm_set1_ps(0.5f));
+
+        const __m128i bits = _mm_setr_epi32(1, 2, 4, 8);
+        __m128 pass = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32((s32)mask), bits), bits));
+        pass = _mm_and_ps(pass, _mm_cmpnlt_ps(z, _mm_setzero_ps()));
+        pass = _mm_and_ps(pass, _mm_cmpngt_ps(z, _mm_set1_ps(1.0f)));
+        const __m128 buf = _mm_loadu_ps(zbuf);
+        if (depth_test) pass = _mm_and_ps(pass, _mm_cmple_ps(z, buf));
+
+        const u32 written = (u32)_mm_movemask_ps(pass);
+        if (written == 0) return 0;
+        _mm_storeu_ps(zbuf, _mm_or_ps(_mm_and_ps(pass, z), _mm_andnot_ps(pass, buf)));
+        if (ids != nullptr)
+        {
+            const __m128i old_ids = _mm_loadu_si128((const __m128i*)ids);
+            const __m128i pass_i = _mm_castps_si128(pass);
+            _mm_storeu_si128((__m128i*)ids, _mm_or_si128(_mm_and_si128(pass_i, _mm_set1_epi32((s32)id)), _mm_andnot_si128(pass_i, old_ids)));
+        }
+        return written;
+    }
+
+    void Step()
+    {
+        for (s32 k = 0; k < 3; ++k) w[k] = _mm_add_epi32(w[k], step[k]);
+    }
+#else
+    ers::ivec3 w;
+    ers::ivec3 step;
+
+    CoverageStepper(const ers::ivec3& weights, const ers::ivec3& wstepx) : w(weights), step(wstepx) { }
+
+    u32 GetMask() const
+    {
+        // Negative barycentric coordinates <=> point is outside triangle.
+        return ((w.x() | w.y() | w.z()) < 0) ? 0u : 1u;
+    }
+
+    u32 WriteDepth(f32 tri_surface_inv, const ers::vec3& frac, const ers::vec3& pz, u32 mask, bool depth_test, f32* zbuf, u32* ids, u32 id) const
+    {
+        if (mask == 0) return 0;
+        f32 z = ((f32)w.x() + frac.x()) * tri_surface_inv * pz.x() 
+            + ((f32)w.y() + frac.y()) * tri_surface_inv * pz.y() 
+            + ((f32)w.z() + frac.z()) * tri_surface_inv * pz.z();
+        z = 0.5f * z + 0.5f;
+        if (z < 0.0f || z > 1.0f || (depth_test && !(z <= *zbuf))) return 0;
+        *zbuf = z;
+        if (ids != nullptr) *ids = id;
+        return 1;
+    }
+
+    void Step()
+    {
+        w += step;
+    }
+#endif
+};
+
+// Calls into a shader of type ShaderT. Qualified calls don't go through the vtable, which lets the compiler 
+// inline the concrete shader's stages. For IShaderProgram itself, these are the usual virtual calls.
+template<typename ShaderT>
+struct ShaderCalls
+{
+    static void VertexShader(ShaderT* shader, const void* in0, const void* in1, const void* in2, ers::vec4& p0, ers::vec4& p1, ers::vec4& p2)
+    {
+        shader->ShaderT::VertexShader(in0, in1, in2, p0, p1, p2);
+    }
+
+    static ers::vec4 VertexShaderPerVertex(ShaderT* shader, const void* in, s32 which_vert)
+    {
+        return shader->ShaderT::VertexShaderPerVertex(in, which_vert);
+    }
+
+    static void VertexShaderPacket(ShaderT* shader, const VertexPacket& packet, PacketVec4& out)
+    {
+        shader->ShaderT::VertexShaderPacket(packet, out);
+    }
+
+    static bool FragmentShader(ShaderT* shader, ers::vec4& out) { return shader->ShaderT::FragmentShader(out); }
+
+    static u32 FragmentShaderPacket(ShaderT* shader, const FragmentPacket& packet, PacketVec4& out)
+    {
+        return shader->ShaderT::FragmentShaderPacket(packet, out);
+    }
+};
+
+template<>
+struct ShaderCalls<IShaderProgram>
+{
+    static void VertexShader(IShaderProgram* shader, const void* in0, const void* in1, const void* in2, ers::vec4& p0, ers::vec4& p1, ers::vec4& p2)
+    {
+        shader->VertexShader(in0, in1, in2, p0, p1, p2);
+    }
+
+    static ers::vec4 VertexShaderPerVertex(IShaderProgram* shader, const void* in, s32 which_vert)
+    {
+        return shader->VertexShaderPerVertex(in, which_vert);
+    }
+
+    static void VertexShaderPacket(IShaderProgram* shader, const VertexPacket& packet, PacketVec4& out)
+    {
+        shader->VertexShaderPacket(packet, out);
+    }
+
+    static bool FragmentShader(IShaderProgram* shader, ers::vec4& out) { return shader->FragmentShader(out); }
+
+    static u32 FragmentShaderPacket(IShaderProgram* shader, const FragmentPacket& packet, PacketVec4& out)
+    {
+        return shader->FragmentShaderPacket(packet, out);
+    }
+};
+
+template<typename ShaderT>
+void Renderer::RenderTriangle(ShaderT& shader, const void* in0, const void* in1, const void* in2)
+{
+    static_assert(std::is_base_of<IShaderProgram, ShaderT>::value, "ShaderT doesn't derive from IShaderProgram.");
+    if (m_shader != &shader) SetShaderProgram(&shader);
+    m_rasterizeKernels = getRasterizeKernels<ShaderT>();
+    ShaderCalls<ShaderT>::VertexShader(&shader, in0, in1, in2, m_ndcTri[0], m_ndcTri[1], m_ndcTri[2]);
+    VaryingsInfo vars_info = shader.GetVaryingsInfo();
+    if (vars_info.data != nullptr)
+        processTriangle(vars_info.GetVars(0), vars_info.GetVars(1), vars_info.GetVars(2));
+    else
+        processTriangle(nullptr, nullptr, nullptr);
+}
+
+template<typename ShaderT>
+void Renderer::Draw(ShaderT& shader, const void* vertices, size_t stride, s32 count_vertices)
+{
+    shader.BeginDraw();
+    const u8* data = (const u8*)vertices;
+    for (s32 i = 0; i + 2 < count_vertices; i += 3)
+        RenderTriangle(shader, data + i * stride, data + (i + 1) * stride, data + (i + 2) * stride);
+    Flush();
+}
+
+template<typename ShaderT>
+void Renderer::DrawIndexed(ShaderT& shader, const void* vertices, size_t stride, const s32* indices, s32 count_indices)
+{
+    static_assert(std::is_base_of<IShaderProgram, ShaderT>::value, "ShaderT doesn't derive from IShaderProgram.");
+    if (m_shader != &shader) SetShaderProgram(&shader);
+    m_rasterizeKernels = getRasterizeKernels<ShaderT>();
+    drawIndexed(&shader, vertices, stride, indices, count_indices);
+}
+
+template<typename ShaderT>
+void Renderer::drawIndexed(ShaderT* shader, const void* vertices, size_t stride, const s32* indices, s32 count_indices)
+{
+    s32 count_vertices = 0;
+    for (s32 i = 0; i < count_indices; ++i) 
+    {
+        ERS_ASSERT(indices[i] >= 0);
+        count_vertices = ers::max(count_vertices, indices[i] + 1);
+    }
+
+    // Vertices no triangle refers to (e.g. the ones of culled meshlets) aren't shaded.
+    if (m_vertexUsed.GetSize() < (size_t)count_vertices) m_vertexUsed.Resize(count_vertices);
+    if (count_vertices > 0) memset(&m_vertexUsed[0], 0, count_vertices);
+    for (s32 i = 0; i < count_indices; ++i) 
+        m_vertexUsed[indices[i]] = 1;
+
+    shader->BeginDraw(); // before the shader gets cloned for the vertex stage.
+    shadeVertices(shader, vertices, stride, count_vertices);
+
+    // Primitive assembly.
+    const s32 count_padded = m_vertexStage.count_padded;
+    const s32 vars_count = m_vertexStage.vars_count;
+    const f32* xs = (count_vertices > 0) ? &m_vertexPositions[0] : nullptr;
+    const f32* vs = (count_vertices > 0 && vars_count > 0) ? &m_vertexVaryings[0] : nullptr;
+    for (s32 i = 0; i + 2 < count_indices; i += 3)
+    {
+        const s32 idx[3] = { indices[i], indices[i + 1], indices[i + 2] };
+        if ((m_vertexClipCodes[idx[0]] & m_vertexClipCodes[idx[1]] & m_vertexClipCodes[idx[2]]) != 0) continue;
+
+        // The varyings are planes like the positions, so they're gathered per triangle.
+        f32 vars[3][ERS_RENDERER_MAX_VARYINGS];
+        for (s32 k = 0; k < 3; ++k)
+        {
+            const f32* p = xs + idx[k];
+            m_ndcTri[k] = ers::vec4(p[0], p[count_padded], p[2 * count_padded], p[3 * count_padded]);
+            const f32* v = vs + idx[k];
+            for (s32 j = 0; j < vars_count; ++j) 
+                vars[k][j] = v[j * count_padded];
+        }
+        if (vars_count > 0) processTriangle(vars[0], vars[1], vars[2]);
+        else processTriangle(nullptr, nullptr, nullptr);
+    }
+    Flush();
+}
+
+template<typename ShaderT>
+void Renderer::shadeVertices(ShaderT* shader, const void* vertices, size_t stride, s32 count_vertices)
+{
+    VaryingsInfo vars_info = shader->GetVaryingsInfo();
+    const s32 count_batches = (count_vertices + ERS_RENDERER_VERTEX_BATCH - 1) / ERS_RENDERER_VERTEX_BATCH;
+
+    VertexStage& stage = m_vertexStage;
+    stage.vertices = (const u8*)vertices;
+    stage.stride = stride;
+    stage.count = count_vertices;
+    stage.count_padded = count_batches * ERS_RENDERER_VERTEX_BATCH;
+    stage.vars_count = (vars_info.data != nullptr) ? vars_info.count : 0;
+    if (m_vertexPositions.GetSize() < (size_t)(4 * stage.count_padded)) m_vertexPositions.Resize(4 * stage.count_padded);
+    if (m_vertexVaryings.GetSize() < (size_t)(stage.count_padded * stage.vars_count)) m_vertexVaryings.Resize(stage.count_padded * stage.vars_count);
+    if (m_vertexClipCodes.GetSize() < (size_t)stage.count_padded) m_vertexClipCodes.Resize(stage.count_padded);
+
+    // Every thread shades its batches with its own copy of the shader, which is of type ShaderT as well (see RenderTriangle).
+    if (m_threadPool.GetThreadCount() > 1 && count_batches > 1 && cloneThreadShaders())
+    {
+        m_threadPool.Run(shadeVertexBatchJob<ShaderT>, this, count_batches);
+    }
+    else
+    {
+        for (s32 i = 0; i < count_batches; ++i)
+            shadeVertexBatch(shader, i);
+    }
+    releaseThreadShaders();
+}
+
+template<typename ShaderT>
+void Renderer::shadeVertexBatchJob(void* data, s32 item, s32 thread_idx)
+{
+    Renderer* renderer = (Renderer*)data;
+    renderer->shadeVertexBatch(static_cast<ShaderT*>(renderer->m_threadShaders[thread_idx]), item);
+}
+
+template<typename ShaderT>
+void Renderer::shadeVertexBatch(ShaderT* shader, s32 batch)
+{
+    const VertexStage& stage = m_vertexStage;
+    VaryingsInfo vars_info = shader->GetVaryingsInfo();
+    const s32 first = batch * ERS_RENDERER_VERTEX_BATCH;
+    const s32 last = ers::min(first + ERS_RENDERER_VERTEX_BATCH, stage.count);
+
+    const s32 count_padded = stage.count_padded;
+    f32* xs = &m_vertexPositions[0];
+    f32* ys = xs + count_padded;
+    f32* zs = ys + count_padded;
+    f32* ws = zs + count_padded;
+    f32* vs = (stage.vars_count > 0) ? &m_vertexVaryings[0] : nullptr; // vs[j * count_padded + i]: the j-th varying of vertex i.
+    if (shader->HasPacketVertexShader())
+    {
+        // ERS_RENDERER_VERTEX_BATCH is a multiple of ERS_PACKET_LANES, so the packets don't straddle batches.
+        PacketF32 vars[ERS_RENDERER_MAX_VARYINGS];
+        VertexPacket packet;
+        packet.vars = vars;
+        for (s32 i = first; i < last; i += ERS_PACKET_LANES)
+        {
+            packet.mask = 0;
+            for (s32 k = 0; k < ERS_PACKET_LANES; ++k)
+                if (i + k < last && m_vertexUsed[i + k] != 0) packet.mask |= 1u << k;
+            if (packet.mask == 0)
+            {
+                for (s32 k = 0; k < ERS_PACKET_LANES; ++k) xs[i + k] = ys[i + k] = zs[i + k] = ws[i + k] = 0.0f;
+                continue;
+            }
+
+            const s32 any = i + ers_count_trailing_zeros(packet.mask);
+            for (s32 k = 0; k < ERS_PACKET_LANES; ++k)
+                packet.in[k] = stage.vertices + (((packet.mask >> k) & 1u) ? i + k : any) * stage.stride;
+
+            PacketVec4 p;
+            ShaderCalls<ShaderT>::VertexShaderPacket(shader, packet, p);
+            const PacketF32 zero(0.0f);
+            packet_select(packet.mask, p.x, zero).Store(xs + i);
+            packet_select(packet.mask, p.y, zero).Store(ys + i);
+            packet_select(packet.mask, p.z, zero).Store(zs + i);
+            packet_select(packet.mask, p.w, zero).Store(ws + i);
+            for (s32 j = 0; j < stage.vars_count; ++j) 
+                vars[j].Store(vs + j * count_padded + i);
+        }
+    }
+    else
+    {
+        for (s32 i = first; i < last; ++i)
+        {
+            if (m_vertexUsed[i] == 0)
+            {
+                xs[i] = ys[i] = zs[i] = ws[i] = 0.0f;
+                continue;
+            }
+
+            const ers::vec4 p = ShaderCalls<ShaderT>::VertexShaderPerVertex(shader, stage.vertices + i * stage.stride, 0);
+            xs[i] = p.x();
+            ys[i] = p.y();
+            zs[i] = p.z();
+            ws[i] = p.w();
+            const f32* v = vars_info.GetVars(0);
+            for (s32 j = 0; j < stage.vars_count; ++j) 
+                vs[j * count_padded + i] = v[j];
+        }
+    }
+    for (s32 i = last; i < first + ERS_RENDERER_VERTEX_BATCH; ++i) // padding.
+        xs[i] = ys[i] = zs[i] = ws[i] = 0.0f;
+
+    computeClipCodes(first, ERS_RENDERER_VERTEX_BATCH);
+}
+
+template<typename ShaderT>
+const Renderer::RasterizeKernel* Renderer::getRasterizeKernels()
+{
+    // Depth-only shaders are rasterized without a shader (see setupRasterContext), so they use the kernels
+    // of IShaderProgram instead of instantiating their own, whose shading paths would never run.
+    typedef typename std::conditional<ShaderT::IsDepthOnlyType(), IShaderProgram, ShaderT>::type KernelShaderT;
+    struct Table
+    {
+        RasterizeKernel kernels[COUNT_KERNELS];
+        Table() { fillRasterizeKernels<KernelShaderT>(kernels, std::integral_constant<u32, COUNT_KERNELS>()); }
+    };
+    static const Table table; // built once per shader type.
+    return table.kernels;
+}
+
+template<typename ShaderT, u32 Idx>
+void Renderer::fillRasterizeKernels(RasterizeKernel* kernels, std::integral_constant<u32, Idx>)
+{
+    // The kernel for index i handles the states whose bits in KERNEL_STATES are the bits of i (see getKernelIndex).
+    kernels[Idx - 1] = &Renderer::rasterizeTriangle<ShaderT, getKernelState(ers_deposit_bits(Idx - 1, KERNEL_STATES))>;
+    fillRasterizeKernels<ShaderT>(kernels, std::integral_constant<u32, Idx - 1>());
+}
+
+template<typename ShaderT>
+void Renderer::fillRasterizeKernels(RasterizeKernel* kernels, std::integral_constant<u32, 0>)
+{
+    ERS_UNUSED(kernels);
+}
+
+template<typename ShaderT, u32 StateT>
+void Renderer::rasterizeTriangle(const NdcTriCoords& tri, const Bbox& bbox, IShaderProgram* shader)
+{   
+    // ******************************************************
+    // Rasterizing kernel. Only ever touches the pixels in bbox, so that bins can be rasterized in parallel.
+    // Without a shader, only the depth buffer is written, and the visibility buffer for deferred triangles.
+    // Instantiated for every shader type drawn with Renderer::Draw, and for IShaderProgram (virtual calls),
+    // and for every combination of KERNEL_STATES, StateT being the enabled ones.
+
+    // The interpolation starts at the corner of the whole triangle's bounding box, not bbox's: when binning, bbox is
+    // clipped to a tile, and starting from there would round the varyings (and coarse centers) differently.
+    RasterContext ctx;
+    const Bbox tri_bbox = getTriangleBoundingBox(tri);
+    setupRasterContext(ctx, tri, tri_bbox.x_min, tri_bbox.y_min, shader);
+    const bool depth_test = (StateT & DEPTH_TEST) != 0;
+
+    // Coarse-to-fine traversal: screen aligned blocks of ERS_RENDERER_BLOCK_SIZE^2 pixels first, 
+    // so that big triangles don't test every pixel of their bounding box.
+    const s32 block_mask = ~(ERS_RENDERER_BLOCK_SIZE - 1);
+    for (s32 by = bbox.y_min & block_mask; by <= bbox.y_max; by += ERS_RENDERER_BLOCK_SIZE)
+    {
+        for (s32 bx = bbox.x_min & block_mask; bx <= bbox.x_max; bx += ERS_RENDERER_BLOCK_SIZE)
+        {
+            Bbox block;
+            block.x_min = ers::max(bx, bbox.x_min);
+            block.y_min = ers::max(by, bbox.y_min);
+            block.x_max = ers::min(bx + ERS_RENDERER_BLOCK_SIZE - 1, bbox.x_max);
+            block.y_max = ers::min(by + ERS_RENDERER_BLOCK_SIZE - 1, bbox.y_max);
+
+            if (m_partialRedraw && !isTileDrawn((by / ERS_RENDERER_TILE_SIZE) * ERS_RENDERER_MAX_TILES_X + bx / ERS_RENDERER_TILE_SIZE)) continue;
+
+            // Hi-Z test: the whole block is behind what has been drawn there already.
+            const f32 hi_z = m_hiZBuffer[(by / ERS_RENDERER_BLOCK_SIZE) * ERS_RENDERER_HIZ_MAX_X + bx / ERS_RENDERER_BLOCK_SIZE];
+            if (depth_test && getBlockMinDepth(ctx, block, (StateT & MSAA) != 0 ? 0.5f : 0.0f) > hi_z) continue;
+
+            // Blocks never straddle tiles, so this stays within the tile being rasterized when binning.
+            prepareTileAt(bx, by, ctx.depth_only ? CLEAR_DEPTH : (CLEAR_COLOR | CLEAR_DEPTH));
+
+            ctx.depth_written = false;
+            if (ctx.depth_only && (StateT & (WIREFRAME | MSAA)) == 0 && bx + ERS_RENDERER_BLOCK_SIZE <= m_width)
+                rasterizeDepthBlock(ctx, block, depth_test);
+            else if ((StateT & (WIREFRAME | MSAA)) == 0 && ctx.coarse_width * ctx.coarse_height > 1)
+                rasterizeCoarse<ShaderT, StateT>(ctx, block);
+            else
+                rasterizeBlock<ShaderT, StateT>(ctx, block, ERS_RENDERER_BLOCK_SIZE);
+            if (ctx.depth_written) updateHiZ(bx / ERS_RENDERER_BLOCK_SIZE, by / ERS_RENDERER_BLOCK_SIZE);
+        }
+    }
+}
+
+template<typename ShaderT, u32 StateT>
+void Renderer::rasterizeBlock(RasterContext& ctx, const Bbox& block, s32 block_size)
+{
+    const EdgeFunctions& edges = ctx.edges;
+    const BlockCoverage coverage = classifyBlock(edges, block);
+    if (coverage == BlockCoverage::OUTSIDE) return;
+
+    if (ctx.packet && (coverage == BlockCoverage::INSIDE || block_size <= ERS_RENDERER_SUBBLOCK_SIZE))
+    {
+        rasterizeQuads<ShaderT, StateT>(ctx, block);
+    }
+    else if (coverage == BlockCoverage::INSIDE)
+    {
+        // Every pixel (every sample, with MSAA) is in the triangle, no need to test them one by one.
+        for (s32 y = block.y_min; y <= block.y_max; ++y)
+        {
+            ers::ivec3 weights = edges.GetWeights(block.x_min, y);
+            for (s32 x = block.x_min; x <= block.x_max; ++x)
+            {
+                if ((StateT & MSAA) != 0)
+                    shadeSamples<ShaderT, StateT>(ctx, x, y, weights, (1u << ERS_RENDERER_MSAA_SAMPLES) - 1u);
+                else
+                    shadeFragment<ShaderT, StateT>(ctx, x, y, weights);
+                weights += edges.wstepx;
+            }
+        }
+    }
+    else if (block_size > ERS_RENDERER_SUBBLOCK_SIZE)
+    {
+        for (s32 sy = block.y_min; sy <= block.y_max; sy += ERS_RENDERER_SUBBLOCK_SIZE)
+        {
+            for (s32 sx = block.x_min; sx <= block.x_max; sx += ERS_RENDERER_SUBBLOCK_SIZE)
+            {
+                Bbox subblock;
+                subblock.x_min = sx;
+                subblock.y_min = sy;
+                subblock.x_max = ers::min(sx + ERS_RENDERER_SUBBLOCK_SIZE - 1, block.x_max);
+                subblock.y_max = ers::min(sy + ERS_RENDERER_SUBBLOCK_SIZE - 1, block.y_max);
+                rasterizeBlock<ShaderT, StateT>(ctx, subblock, ERS_RENDERER_SUBBLOCK_SIZE);
+            }
+        }
+    }
+    else if ((StateT & MSAA) != 0)
+    {
+        rasterizeSamples<ShaderT, StateT>(ctx, block);
+    }
+    else
+    {
+        rasterizePixels<ShaderT, StateT>(ctx, block);
+    }
+}
+
+template<typename ShaderT, u32 StateT>
+void Renderer::rasterizePixels(RasterContext& ctx, const Bbox& block)
+{
+    const EdgeFunctions& edges = ctx.edges;
+    for (s32 y = block.y_min; y <= block.y_max; ++y)
+    {
+        const ers::ivec3 weights0 = edges.GetWeights(block.x_min, y);
+        CoverageStepper coverage(weights0, edges.wstepx);
+        for (s32 x = block.x_min; x <= block.x_max; x += ERS_RENDERER_LANES)
+        {
+            // Check which of the next pixels are in the triangle, ignoring the ones past the block.
+            u32 mask = coverage.GetMask();
+            coverage.Step();
+            if (block.x_max - x + 1 < ERS_RENDERER_LANES) 
+                mask &= (1u << (block.x_max - x + 1)) - 1u;
+
+            while (mask != 0)
+            {
+                const s32 lane = ers_count_trailing_zeros(mask);
+                mask &= mask - 1u;
+                const s32 dx = x + lane - block.x_min;
+                shadeFragment<ShaderT, StateT>(ctx, x + lane, y, weights0 + edges.wstepx * dx);
+            }
+        }
+    }
+}
+
+template<typename ShaderT, u32 StateT>
+void Renderer::rasterizeQuads(RasterContext& ctx, const Bbox& block)
+{
+    // Packet shading: the block is walked in screen aligned quads of ERS_PACKET_WIDTH x ERS_PACKET_HEIGHT pixels,
+    // which are shaded together. Coverage, depth and the perspective correction are done per lane exactly like 
+    // shadeFragment does them; the lanes out of the triangle or the block still get varyings, for derivatives.
+    const EdgeFunctions& edges = ctx.edges;
+    const NdcTriCoords& tri = *ctx.tri;
+    const VaryingPlanes& planes = ctx.planes;
+    const s32 count = (ctx.vars_info.data != nullptr) ? ctx.vars_info.count : 0;
+    const s32 count_interpolated = (ctx.vars_info.data != nullptr) ? ctx.vars_info.GetInterpolatedCount() : 0;
+    ShaderT* shader = static_cast<ShaderT*>(ctx.shader);
+    const bool depth_write = (StateT & NO_DEPTH_WRITE) == 0;
+
+    alignas(32) f32 bar[3][ERS_PACKET_LANES];
+    alignas(32) f32 ws[ERS_PACKET_LANES];
+    alignas(32) f32 zs[ERS_PACKET_LANES];
+    alignas(32) f32 vars_lanes[ERS_PACKET_LANES];
+    PacketF32 vars[ERS_RENDERER_MAX_VARYINGS];
+
+    FragmentPacket packet;
+    packet.vars = vars;
+    for (s32 i = count_interpolated; i < count; ++i)
+        vars[i] = PacketF32(tri.vars[0][i]);
+
+    for (s32 qy = block.y_min & ~(ERS_PACKET_HEIGHT - 1); qy <= block.y_max; qy += ERS_PACKET_HEIGHT)
+    {
+        for (s32 qx = block.x_min & ~(ERS_PACKET_WIDTH - 1); qx <= block.x_max; qx += ERS_PACKET_WIDTH)
+        {
+            u32 mask = 0;
+            for (s32 lane = 0; lane < ERS_PACKET_LANES; ++lane)
+            {
+                const s32 x = qx + lane % ERS_PACKET_WIDTH;
+                const s32 y = qy + lane / ERS_PACKET_WIDTH;
+                const ers::ivec3 weights = edges.GetWeights(x, y);
+                const ers::vec3 bar_lane = edges.GetBarycentrics(weights);
+                ers::vec3 bar_correct;
+                ws[lane] = getPerspectiveBarycentrics(tri, bar_lane, bar_correct);
+                for (s32 k = 0; k < 3; ++k) bar[k][lane] = bar_correct.e[k];
+
+                if (x < block.x_min || x > block.x_max || y < block.y_min || y > block.y_max) continue;
+                if ((weights.x() | weights.y() | weights.z()) < 0) continue;
+                if ((StateT & WIREFRAME) != 0 && bar_correct.y() > 0.01f && bar_correct.z() > 0.01f && bar_correct.x() > 0.01f) continue;
+
+                f32 z_curr = bar_lane.x() * tri.p0.z() + bar_lane.y() * tri.p1.z() + bar_lane.z() * tri.p2.z();
+                z_curr = 0.5f * z_curr + 0.5f;
+                if (z_curr < 0.0f || z_curr > 1.0f) continue;
+                if ((StateT & DEPTH_TEST) != 0 && z_curr > getZValue(x, y)) continue;
+                zs[lane] = z_curr;
+                mask |= 1u << lane;
+            }
+            if (mask == 0) continue;
+
+            for (s32 i = 0; i < count_interpolated; ++i)
+            {
+                for (s32 lane = 0; lane < ERS_PACKET_LANES; ++lane)
+                {
+                    const f32 nx = (f32)(qx + lane % ERS_PACKET_WIDTH - edges.x0);
+                    const f32 ny = (f32)(qy + lane / ERS_PACKET_WIDTH - edges.y0);
+                    vars_lanes[lane] = ws[lane] * (planes.base[i] + nx * planes.dx[i] + ny * planes.dy[i]);
+                }
+                vars[i] = PacketF32::Load(vars_lanes);
+            }
+
+            packet.x = qx;
+            packet.y = qy;
+            packet.mask = mask;
+            packet.bar = PacketVec3(PacketF32::Load(bar[0]), PacketF32::Load(bar[1]), PacketF32::Load(bar[2]));
+
+            PacketVec4 out(ers::vec4(0.0f));
+            mask &= ~ShaderCalls<ShaderT>::FragmentShaderPacket(shader, packet, out);
+            if (mask == 0) continue;
+
+            alignas(32) f32 col[4][ERS_PACKET_LANES];
+            out.x.Store(col[0]);
+            out.y.Store(col[1]);
+            out.z.Store(col[2]);
+            out.w.Store(col[3]);
+            while (mask != 0)
+            {
+                const s32 lane = ers_count_trailing_zeros(mask);
+                mask &= mask - 1u;
+                const s32 x = qx + lane % ERS_PACKET_WIDTH;
+                const s32 y = qy + lane / ERS_PACKET_WIDTH;
+                ers::vec4 c(col[0][lane], col[1][lane], col[2][lane], col[3][lane]);
+                writeFragment<StateT>(x, y, c, ws[lane]);
+                if (depth_write)
+                {
+                    setZValue(x, y, zs[lane]);
+                    ctx.depth_written = true;
+                }
+                if ((StateT & DEFERRED) != 0) 
+                    m_visBuffer[y * m_width + x] = ERS_RENDERER_VIS_EMPTY;
+            }
+        }
+    }
+}
+
+template<typename ShaderT, u32 StateT>
+void Renderer::rasterizeCoarse(RasterContext& ctx, const Bbox& block)
+{
+    // Coarse shading: the block is walked in screen aligned coarse pixels of coarse_width x coarse_height pixels.
+    // Coverage and depth are per pixel, exactly like shadeFragment does them, but every coarse pixel with any
+    // fragment left is shaded only once, at its center (which may be outside of the triangle), for all of them.
+    // Packet shaders get quads of coarse pixels, so their derivatives are over the coarse pixels as well, unless
+    // such a quad is bigger than the block: they're shaded one coarse pixel at a time then, through FragmentShader.
+    if (classifyBlock(ctx.edges, block) == BlockCoverage::OUTSIDE) return;
+
+    const EdgeFunctions& edges = ctx.edges;
+    const NdcTriCoords& tri = *ctx.tri;
+    const VaryingPlanes& planes = ctx.planes;
+    const s32 count = (ctx.vars_info.data != nullptr) ? ctx.vars_info.count : 0;
+    const s32 count_interpolated = (ctx.vars_info.data != nullptr) ? ctx.vars_info.GetInterpolatedCount() : 0;
+    ShaderT* shader = static_cast<ShaderT*>(ctx.shader);
+    const bool depth_write = (StateT & NO_DEPTH_WRITE) == 0;
+
+    const s32 cw = ctx.coarse_width;
+    const s32 ch = ctx.coarse_height;
+    const bool use_packet = ctx.packet && ERS_PACKET_WIDTH * cw <= ERS_RENDERER_BLOCK_SIZE && ERS_PACKET_HEIGHT * ch <= ERS_RENDERER_BLOCK_SIZE;
+    const s32 lanes = use_packet ? ERS_PACKET_LANES : 1;
+    const s32 quad_w = (use_packet ? ERS_PACKET_WIDTH : 1) * cw;
+    const s32 quad_h = (use_packet ? ERS_PACKET_HEIGHT : 1) * ch;
+    const f32 center_x = 0.5f * (f32)(cw - 1);
+    const f32 center_y = 0.5f * (f32)(ch - 1);
+
+    alignas(32) f32 bar[3][ERS_PACKET_LANES];
+    alignas(32) f32 ws[ERS_PACKET_LANES];
+    alignas(32) f32 nxs[ERS_PACKET_LANES];
+    alignas(32) f32 nys[ERS_PACKET_LANES];
+    alignas(32) f32 vars_lanes[ERS_PACKET_LANES];
+    alignas(32) f32 col[4][ERS_PACKET_LANES];
+    f32 zs[ERS_PACKET_LANES][16]; // per pixel of the coarse pixel, row by row (at most 4 x 4).
+    u32 pixels[ERS_PACKET_LANES]; // bits of the pixels of the coarse pixel that passed.
+    PacketF32 vars[ERS_RENDERER_MAX_VARYINGS];
+
+    FragmentPacket packet;
+    packet.vars = vars;
+    for (s32 i = count_interpolated; i < count; ++i)
+        vars[i] = PacketF32(tri.vars[0][i]);
+
+    for (s32 qy = block.y_min & ~(quad_h - 1); qy <= block.y_max; qy += quad_h)
+    {
+        for (s32 qx = block.x_min & ~(quad_w - 1); qx <= block.x_max; qx += quad_w)
+        {
+            u32 mask = 0;
+            for (s32 lane = 0; lane < lanes; ++lane)
+            {
+                const s32 cx = qx + (lane % ERS_PACKET_WIDTH) * cw;
+                const s32 cy = qy + (lane / ERS_PACKET_WIDTH) * ch;
+                pixels[lane] = 0;
+                for (s32 py = 0; py < ch; ++py)
+                {
+                    for (s32 px = 0; px < cw; ++px)
+                    {
+                        const s32 x = cx + px;
+                        const s32 y = cy + py;
+                        if (x < block.x_min || x > block.x_max || y < block.y_min || y > block.y_max) continue;
+                        const ers::ivec3 weights = edges.GetWeights(x, y);
+                        if ((weights.x() | weights.y() | weights.z()) < 0) continue;
+
+                        const ers::vec3 bar_pixel = edges.GetBarycentrics(weights);
+                        f32 z_curr = bar_pixel.x() * tri.p0.z() + bar_pixel.y() * tri.p1.z() + bar_pixel.z() * tri.p2.z();
+                        z_curr = 0.5f * z_curr + 0.5f;
+                        if (z_curr < 0.0f || z_curr > 1.0f) continue;
+                        if ((StateT & DEPTH_TEST) != 0 && z_curr > getZValue(x, y)) continue;
+                        zs[lane][py * cw + px] = z_curr;
+                        pixels[lane] |= 1u << (py * cw + px);
+                    }
+                }
+                if (pixels[lane] != 0) mask |= 1u << lane;
+
+                // The coarse pixel's center, between pixel centers for even sizes.
+                const ers::ivec3 weights = edges.GetWeights(cx, cy);
+                ers::vec3 bar_center;
+                for (s32 k = 0; k < 3; ++k)
+                {
+                    const f32 weight = (f32)weights.e[k] + center_x * (f32)edges.wstepx.e[k] + center_y * (f32)edges.wstepy.e[k];
+                    bar_center.e[k] = (weight + edges.weights_frac.e[k]) * edges.tri_surface_inv;
+                }
+                ers::vec3 bar_correct;
+                ws[lane] = getPerspectiveBarycentrics(tri, bar_center, bar_correct);
+                for (s32 k = 0; k < 3; ++k) bar[k][lane] = bar_correct.e[k];
+                nxs[lane] = (f32)(cx - edges.x0) + center_x;
+                nys[lane] = (f32)(cy - edges.y0) + center_y;
+
+                if (!use_packet && mask != 0)
+                {
+                    f32 vars_over_w[ERS_RENDERER_MAX_VARYINGS];
+                    for (s32 i = 0; i < count_interpolated; ++i)
+                        vars_over_w[i] = planes.base[i] + nxs[0] * planes.dx[i] + nys[0] * planes.dy[i];
+                    shader->SetFragmentVaryings(bar_center, bar_correct, vars_over_w, ws[0], ctx.vars_info);
+                    shader->m_fragCoord = ers::ivec2(cx, cy);
+                }
+            }
+            if (mask == 0) continue;
+
+            if (use_packet)
+            {
+                for (s32 i = 0; i < count_interpolated; ++i)
+                {
+                    for (s32 lane = 0; lane < ERS_PACKET_LANES; ++lane)
+                        vars_lanes[lane] = ws[lane] * (planes.base[i] + nxs[lane] * planes.dx[i] + nys[lane] * planes.dy[i]);
+                    vars[i] = PacketF32::Load(vars_lanes);
+                }
+                packet.x = qx;
+                packet.y = qy;
+                packet.mask = mask;
+                packet.bar = PacketVec3(PacketF32::Load(bar[0]), PacketF32::Load(bar[1]), PacketF32::Load(bar[2]));
+
+                PacketVec4 out(ers::vec4(0.0f));
+                mask &= ~ShaderCalls<ShaderT>::FragmentShaderPacket(shader, packet, out);
+                out.x.Store(col[0]);
+                out.y.Store(col[1]);
+                out.z.Store(col[2]);
+                out.w.Store(col[3]);
+            }
+            else
+            {
+                ers::vec4 c(0.0f);
+                if (ShaderCalls<ShaderT>::FragmentShader(shader, c)) continue;
+                for (s32 k = 0; k < 4; ++k) col[k][0] = c.e[k];
+            }
+
+            // Every pixel of a coarse pixel that passed gets its color, and keeps its own depth.
+            while (mask != 0)
+            {
+                const s32 lane = ers_count_trailing_zeros(mask);
+                mask &= mask - 1u;
+                const s32 cx = qx + (lane % ERS_PACKET_WIDTH) * cw;
+                const s32 cy = qy + (lane / ERS_PACKET_WIDTH) * ch;
+                u32 lane_pixels = pixels[lane];
+                while (lane_pixels != 0)
+                {
+                    const s32 pixel = ers_count_trailing_zeros(lane_pixels);
+                    lane_pixels &= lane_pixels - 1u;
+                    const s32 x = cx + pixel % cw;
+                    const s32 y = cy + pixel / cw;
+                    ers::vec4 c(col[0][lane], col[1][lane], col[2][lane], col[3][lane]);
+                    writeFragment<StateT>(x, y, c, ws[lane]);
+                    if (depth_write)
+                    {
+                        setZValue(x, y, zs[lane][pixel]);
+                        ctx.depth_written = true;
+                    }
+                    if ((StateT & DEFERRED) != 0)
+                        m_visBuffer[y * m_width + x] = ERS_RENDERER_VIS_EMPTY;
+                }
+            }
+        }
+    }
+}
+
+template<typename ShaderT, u32 StateT>
+void Renderer::shadeFragment(RasterContext& ctx, s32 x, s32 y, const ers::ivec3& weights)
+{
+    const NdcTriCoords& tri = *ctx.tri;
+    const ers::vec4& p0 = tri.p0;
+    const ers::vec4& p1 = tri.p1;
+    const ers::vec4& p2 = tri.p2;
+
+    // Calculate normalized barycentric coordinates... 
+    const ers::vec3 bar = ctx.edges.GetBarycentrics(weights);
+
+    // ... and the perspective correct ones, unless only the depth is needed.
+    ers::vec3 bar_correct;
+    f32 w = 1.0f;
+    if (!ctx.depth_only || (StateT & WIREFRAME) != 0)
+        w = getPerspectiveBarycentrics(tri, bar, bar_correct);
+
+    // Low effort wireframe.
+    if ((StateT & WIREFRAME) != 0 && bar_correct.y() > 0.01f && bar_correct.z() > 0.01f && bar_correct.x() > 0.01f) return;
+    
+    // Interpolate the z coordinate (in ndc-space). 
+    f32 z_curr = bar.x() * p0.z() + bar.y() * p1.z() + bar.z() * p2.z();
+    z_curr = 0.5f * z_curr + 0.5f;
+
+    // Clip in the z-axis. We already clip against the near z-plane so we don't need z_curr < 0.0f, 
+    // but leaving it in in case I mess around with clipping again.
+    if (z_curr < 0.0f || z_curr > 1.0f) return; 
+
+    const bool depth_write = (StateT & NO_DEPTH_WRITE) == 0;
+    if ((StateT & DEPTH_TEST) == 0 || (z_curr <= getZValue(x, y))) // early depth test. more negative z is "in front".
+    {              
+        if (ctx.depth_only)
+        {
+            // Depth-only triangles are dropped before rasterizing without depth writes, they'd have no effect.
+            if (tri.id != ERS_RENDERER_VIS_EMPTY)
+                m_visBuffer[y * m_width + x] = tri.id;
+            setZValue(x, y, z_curr);
+            ctx.depth_written = true;
+            return;
+        }
+
+        ers::vec4 col;               
+        bool discard = runFragmentShader<ShaderT>(ctx, x, y, bar, bar_correct, w, col);           
+        if (!discard)
+        {                  
+            writeFragment<StateT>(x, y, col, w);
+            if (depth_write)
+            {
+                setZValue(x, y, z_curr);
+                ctx.depth_written = true;
+            }
+            if ((StateT & DEFERRED) != 0) 
+                m_visBuffer[y * m_width + x] = ERS_RENDERER_VIS_EMPTY; // shaded right away, don't shade it again.
+        }
+    }           
+}
+
+template<typename ShaderT, u32 StateT>
+void Renderer::rasterizeSamples(RasterContext& ctx, const Bbox& block)
+{
+    const EdgeFunctions& edges = ctx.edges;
+    for (s32 y = block.y_min; y <= block.y_max; ++y)
+    {
+        ers::ivec3 weights = edges.GetWeights(block.x_min, y);
+        for (s32 x = block.x_min; x <= block.x_max; ++x)
+        {
+            const u32 sample_mask = getSampleMask(edges, weights);
+            if (sample_mask != 0) 
+                shadeSamples<ShaderT, StateT>(ctx, x, y, weights, sample_mask);
+            weights += edges.wstepx;
+        }
+    }
+}
+
+template<typename ShaderT, u32 StateT>
+void Renderer::shadeSamples(RasterContext& ctx, s32 x, s32 y, const ers::ivec3& weights, u32 sample_mask)
+{
+    // MSAA counterpart of shadeFragment: the samples in sample_mask are covered. They're depth tested one by one, 
+    // and if any of them passes, the fragment is shaded once at the pixel center (even if that's outside of the triangle).
+    const NdcTriCoords& tri = *ctx.tri;
+    const ers::vec3 bar = ctx.edges.GetBarycentrics(weights);
+    ers::vec3 bar_correct;
+    f32 w = 1.0f;
+    if (!ctx.depth_only || (StateT & WIREFRAME) != 0)
+        w = getPerspectiveBarycentrics(tri, bar, bar_correct);
+
+    if ((StateT & WIREFRAME) != 0 && bar_correct.y() > 0.01f && bar_correct.z() > 0.01f && bar_correct.x() > 0.01f) return;
+
+    const DepthPlane& depth = ctx.depth;
+    const f32 z_center = depth.z0 + depth.dx * (f32)(x - ctx.edges.x0) + depth.dy * (f32)(y - ctx.edges.y0);
+    const f32* sample_depths = &m_sampleDepths[((size_t)y * m_width + x) * ERS_RENDERER_MSAA_SAMPLES];
+    f32 z[ERS_RENDERER_MSAA_SAMPLES];
+    u32 pass = 0;
+    for (s32 s = 0; s < ERS_RENDERER_MSAA_SAMPLES; ++s)
+    {
+        if ((sample_mask & (1u << s)) == 0) continue;
+        z[s] = z_center + depth.sample_dz[s];
+        if (z[s] < 0.0f || z[s] > 1.0f) continue;
+        if ((StateT & DEPTH_TEST) != 0 && z[s] > sample_depths[s]) continue;
+        pass |= 1u << s;
+    }
+    if (pass == 0) return;
+
+    const bool depth_write = (StateT & NO_DEPTH_WRITE) == 0;
+    if (!ctx.depth_only)
+    {
+        ers::vec4 col;
+        if (runFragmentShader<ShaderT>(ctx, x, y, bar, bar_correct, w, col)) return;
+        writeSamples<StateT>(x, y, col, pass, w);
+    }
+    if (depth_write)
+    {
+        setSampleDepths(x, y, z, pass);
+        ctx.depth_written = true;
+    }
+}
+
+template<typename ShaderT>
+bool Renderer::runFragmentShader(RasterContext& ctx, s32 x, s32 y, const ers::vec3& bar, const ers::vec3& bar_correct, f32 w, ers::vec4& col)
+{
+    // ctx.shader is a ShaderT, so the fragment shader can be called without going through the vtable (and inlined).
+    ShaderT* shader = static_cast<ShaderT*>(ctx.shader);
+    if (ctx.vars_info.data != nullptr) 
+        stepVaryingPlanes(ctx, x, y);
+    shader->SetFragmentVaryings(bar, bar_correct, ctx.planes.current, w, ctx.vars_info);                     	
+    shader->m_fragCoord = ers::ivec2(x, y);
+    return ShaderCalls<ShaderT>::FragmentShader(shader, col);
+}
+
+template<u32 StateT>
+void Renderer::writeFragment(s32 x, s32 y, ers::vec4& color, f32 w)
+{
+    // w is the fragment's view depth (its clip space w), which weighs it with OIT.
+    if ((StateT & OIT) != 0)
+        accumulateFragment(x, y, color, w, (1u << ERS_RENDERER_MSAA_SAMPLES) - 1u);
+    else if ((StateT & BLEND) != 0)
+        blendPixel(x, y, color);
+    else
+        setPixel(x, y, color);
+}
+
+template<u32 StateT>
+void Renderer::writeSamples(s32 x, s32 y, const ers::vec4& color, u32 sample_mask, f32 w)
+{
+    if ((StateT & OIT) != 0)
+        accumulateFragment(x, y, color, w, sample_mask);
+    else if ((StateT & BLEND) != 0)
+        blendSamples(x, y, color, sample_mask);
+    else
+        setSamples(x, y, color, sample_mask);
+}
+
+#endif // SOFTWARE_RENDERER_KERNELS_H
\ No newline at end of file
@@ -0,0 +1,57 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include "ers/typedefs.h"
+#include "ers/macros.h"
+#include "ers/vector.h"
+
+#ifndef __EMSCRIPTEN__
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#endif
+
+// Minimal fork-join pool: Run() hands out the indices [0, count) of a job to the worker threads
+// and the calling thread, and returns once every index has been processed.
+// Under emscripten (no pthreads) there are no workers and everything runs on the calling thread.
+class ThreadPool
+{
+public:
+	// @param data: user pointer passed along to every invocation.
+	// @param item: index of the work item in [0, count).
+	// @param thread_idx: index of the executing thread in [0, GetThreadCount()), 0 being the calling thread.
+	typedef void (*job_t)(void* data, s32 item, s32 thread_idx);
+
+	// @param count_workers: number of threads spawned besides the calling one. Negative means "one less than the hardware threads".
+	ThreadPool(s32 count_workers = -1);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	void Run(job_t job, void* data, s32 count);
+
+	// Number of threads taking part in Run(), including the calling thread.
+	s32 GetThreadCount() const;
+
+private:
+#ifndef __EMSCRIPTEN__
+	ers::Vector<std::thread> m_workers;
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::condition_variable m_done;
+	std::atomic<s32> m_next;
+	u64 m_generation;
+	s32 m_busy;
+	bool m_quit;
+#endif
+	job_t m_job;
+	void* m_data;
+	s32 m_count;
+
+	void workerLoop(s32 thread_idx);
+	void consume(s32 thread_idx);
+};
+
+#endif // THREAD_POOL_H
\ No newline at end of file
@@ -0,0 +1,47 @@
+#include "frustum.h"
+
+Frustum::Frustum(const ers::mat4& m)
+{
+    // Clip space is -w <= x, y, z <= w, so every plane is the last row of m plus or minus one of the others.
+    for (s32 i = 0; i < 3; ++i)
+    {
+        for (s32 j = 0; j < 4; ++j)
+        {
+            planes[2 * i].e[j] = m(3, j) + m(i, j);
+            planes[2 * i + 1].e[j] = m(3, j) - m(i, j);
+        }
+    }
+
+    for (s32 i = 0; i < 6; ++i)
+    {
+        const f32 len = ers::length(ers::vec3(planes[i]));
+        if (len > 0.0f) planes[i] = planes[i] * (1.0f / len);
+    }
+}
+
+bool Frustum::IntersectsSphere(const ers::vec3& center, f32 radius) const
+{
+    for (s32 i = 0; i < 6; ++i)
+    {
+        if (ers::dot(ers::vec3(planes[i]), center) + planes[i].w() < -radius) 
+            return false;
+    }
+    return true;
+}
+
+bool Frustum::IntersectsAabb(const ers::vec3& aabb_min, const ers::vec3& aabb_max) const
+{
+    for (s32 i = 0; i < 6; ++i)
+    {
+        // The corner farthest along the plane's normal.
+        const ers::vec4& plane = planes[i];
+        const ers::vec3 corner(
+            (plane.x() >= 0.0f) ? aabb_max.x() : aabb_min.x(),
+            (plane.y() >= 0.0f) ? aabb_max.y() : aabb_min.y(),
+            (plane.z() >= 0.0f) ? aabb_max.z() : aabb_min.z()
+        );
+        if (ers::dot(ers::vec3(plane), corner) + plane.w() < 0.0f) 
+            return false;
+    }
+    return true;
+}
\ No newline at end of file
@@ -497,6 +497,11 @@ s32 Image::GetChannels()
     return m_channels;
 }
 
+Image::Range Image::GetRange()
+{
+    return m_range;
+}
+
 void Image::Write(const char* filename, bool flip)
 {
 	stbi_flip_vertically_on_write(flip);
@@ -0,0 +1,150 @@
+#include "light_grid.h"
+#include "frustum.h"
+#include "ers/macros.h"
+#include "ers/common.h"
+#include <cfloat>
+
+LightGrid::LightGrid(ers::IAllocator* alloc)
+    :
+    m_lights(alloc),
+    m_tileOffsets(alloc),
+    m_tileLights(alloc),
+    m_lightRects(alloc),
+    m_width(0),
+    m_height(0),
+    m_tilesX(0),
+    m_tilesY(0)
+{
+
+}
+
+void LightGrid::Build(const PointLight* lights, s32 count, const ers::mat4& view_proj, s32 width, s32 height, const f32* zbuffer)
+{
+    ERS_ASSERT(count >= 0 && width > 0 && height > 0);
+    m_width = width;
+    m_height = height;
+    m_tilesX = (width + ERS_LIGHT_TILE_SIZE - 1) / ERS_LIGHT_TILE_SIZE;
+    m_tilesY = (height + ERS_LIGHT_TILE_SIZE - 1) / ERS_LIGHT_TILE_SIZE;
+    m_lights.Clear();
+    m_lightRects.Clear();
+    m_tileOffsets.Clear();
+    m_tileLights.Clear();
+    for (s32 i = 0; i < count; ++i)
+        m_lights.PushBack(lights[i]);
+
+    // The tiles the corners of each light's bounding box project into, so that a tile only tests the lights near it.
+    // Boxes reaching behind the eye may project anywhere.
+    for (s32 i = 0; i < count; ++i)
+    {
+        const PointLight& light = lights[i];
+        f32 sx_min = FLT_MAX, sy_min = FLT_MAX, sx_max = -FLT_MAX, sy_max = -FLT_MAX;
+        bool behind = false;
+        for (s32 c = 0; c < 8 && !behind; ++c)
+        {
+            const ers::vec3 corner(
+                light.position.x() + (((c & 1) != 0) ? light.radius : -light.radius),
+                light.position.y() + (((c & 2) != 0) ? light.radius : -light.radius),
+                light.position.z() + (((c & 4) != 0) ? light.radius : -light.radius)
+            );
+            const ers::vec4 p = view_proj * ers::vec4(corner, 1.0f);
+            behind = (p.w() <= 1.0e-5f);
+            const f32 sx = (0.5f + 0.5f * p.x() / p.w()) * (f32)width;
+            const f32 sy = (0.5f + 0.5f * p.y() / p.w()) * (f32)height;
+            sx_min = ers::min(sx_min, sx);
+            sy_min = ers::min(sy_min, sy);
+            sx_max = ers::max(sx_max, sx);
+            sy_max = ers::max(sy_max, sy);
+        }
+        if (behind)
+        {
+            sx_min = sy_min = 0.0f;
+            sx_max = (f32)width;
+            sy_max = (f32)height;
+        }
+        // Empty (min > max) if it's off screen. Clamped on both sides before the casts: corners with a w close to 0 
+        // project far out of s32's range.
+        const f32 tile_size = (f32)ERS_LIGHT_TILE_SIZE;
+        m_lightRects.PushBack((s32)ers::clamp(sx_min / tile_size, 0.0f, (f32)m_tilesX));
+        m_lightRects.PushBack((s32)ers::clamp(sy_min / tile_size, 0.0f, (f32)m_tilesY));
+        m_lightRects.PushBack((s32)ers::clamp(sx_max / tile_size, 0.0f, (f32)(m_tilesX - 1)));
+        m_lightRects.PushBack((s32)ers::clamp(sy_max / tile_size, 0.0f, (f32)(m_tilesY - 1)));
+        if (sx_max < 0.0f || sy_max < 0.0f) m_lightRects[4 * i] = m_tilesX; // clamped into tile 0 above.
+    }
+
+    // A tile's frustum is view_proj's, with the clip space rows for x, y and z remapped so that the tile's ranges of
+    // normalized device coordinates become [-1, 1]: r' = (r - center * w_row) / half_extent.
+    ers::mat4 tile_proj = view_proj;
+    for (s32 ty = 0; ty < m_tilesY; ++ty)
+    {
+        for (s32 tx = 0; tx < m_tilesX; ++tx)
+        {
+            m_tileOffsets.PushBack((s32)m_tileLights.GetSize());
+
+            f32 z_min = 0.0f, z_max = 1.0f;
+            if (zbuffer != nullptr)
+            {
+                getTileDepthBounds(zbuffer, tx, ty, z_min, z_max);
+                if (z_min >= 1.0f) continue; // nothing drawn.
+            }
+
+            const f32 x0 = 2.0f * (f32)(tx * ERS_LIGHT_TILE_SIZE) / (f32)width - 1.0f;
+            const f32 x1 = 2.0f * (f32)ers::min((tx + 1) * ERS_LIGHT_TILE_SIZE, width) / (f32)width - 1.0f;
+            const f32 y0 = 2.0f * (f32)(ty * ERS_LIGHT_TILE_SIZE) / (f32)height - 1.0f;
+            const f32 y1 = 2.0f * (f32)ers::min((ty + 1) * ERS_LIGHT_TILE_SIZE, height) / (f32)height - 1.0f;
+            const f32 ranges[3][2] = { { x0, x1 }, { y0, y1 }, { 2.0f * z_min - 1.0f, 2.0f * z_max - 1.0f } };
+            for (s32 k = 0; k < 3; ++k)
+            {
+                const f32 center = 0.5f * (ranges[k][0] + ranges[k][1]);
+                const f32 half_extent = ers::max(0.5f * (ranges[k][1] - ranges[k][0]), 1.0e-6f);
+                for (s32 j = 0; j < 4; ++j)
+                    tile_proj(k, j) = (view_proj(k, j) - center * view_proj(3, j)) / half_extent;
+            }
+            const Frustum frustum(tile_proj);
+
+            for (s32 i = 0; i < count; ++i)
+            {
+                const s32* rect = &m_lightRects[4 * i];
+                if (tx < rect[0] || tx > rect[2] || ty < rect[1] || ty > rect[3]) continue;
+                if (frustum.IntersectsSphere(lights[i].position, lights[i].radius))
+                    m_tileLights.PushBack(i);
+            }
+        }
+    }
+    m_tileOffsets.PushBack((s32)m_tileLights.GetSize());
+}
+
+void LightGrid::getTileDepthBounds(const f32* zbuffer, s32 tile_x, s32 tile_y, f32& z_min, f32& z_max) const
+{
+    const s32 x_end = ers::min((tile_x + 1) * ERS_LIGHT_TILE_SIZE, m_width);
+    const s32 y_end = ers::min((tile_y + 1) * ERS_LIGHT_TILE_SIZE, m_height);
+    z_min = 1.0f;
+    z_max = 0.0f;
+    for (s32 y = tile_y * ERS_LIGHT_TILE_SIZE; y < y_end; ++y)
+    {
+        const f32* row = zbuffer + (size_t)y * m_width;
+        for (s32 x = tile_x * ERS_LIGHT_TILE_SIZE; x < x_end; ++x)
+        {
+            z_min = ers::min(z_min, row[x]);
+            z_max = ers::max(z_max, row[x]);
+        }
+    }
+}
+
+const s32* LightGrid::GetTileLights(s32 x, s32 y, s32& count) const
+{
+    count = 0;
+    if (x < 0 || y < 0 || x >= m_width || y >= m_height) return nullptr;
+    const s32 tile_idx = (y / ERS_LIGHT_TILE_SIZE) * m_tilesX + x / ERS_LIGHT_TILE_SIZE;
+    count = m_tileOffsets[tile_idx + 1] - m_tileOffsets[tile_idx];
+    return (count > 0) ? &m_tileLights[m_tileOffsets[tile_idx]] : nullptr;
+}
+
+const PointLight* LightGrid::GetLights() const
+{
+    return (m_lights.GetSize() > 0) ? &m_lights[0] : nullptr;
+}
+
+s32 LightGrid::GetLightCount() const
+{
+    return (s32)m_lights.GetSize();
+}
\ No newline at end of file
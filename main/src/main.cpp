@@ -31,11 +31,17 @@
 #include "gl_surface.h"
 #include "camera.h"
 #include "transform.h"
+#include "timer.h"
+#include "resolution_scaler.h"
+#include "light_grid.h"
 
 #include "simple_shader.h"
 #include "debug_light_shader.h"
 #include "blinn_phong_shader.h"
 #include "shadowmap_shader.h"
+#include "depth_only_shader.h"
+
+#include <algorithm>
 
 #define RESOURCES "./resources/"
 
@@ -73,12 +79,22 @@ private:
 	SimpleShader m_simpleShader;
 	DebugLightShader m_debugLightShader;
 	ShadowmapShader m_shadowmapShader;
+	DepthOnlyShader m_depthOnlyShader;
 	BlinnPhongShader m_blinnPhongShader;	
 
 	Camera* m_playerCamera;
 
 	GLSurface m_surface;
 
+	// Dynamic resolution: the scenes are rendered at m_renderWidth x m_renderHeight, picked by the scaler 
+	// to keep the frames within its budget, and upscaled into m_outputBuffer for the surface.
+	ResolutionScaler m_resolutionScaler;
+	bool m_dynamicResolution;
+	s32 m_renderWidth;
+	s32 m_renderHeight;
+	Timer m_frameTimer;
+	ers::Vector<u32> m_outputBuffer;
+
 	struct MeshInstance
 	{
 		const Mesh* mesh;
@@ -93,6 +109,13 @@ private:
 	MeshInstance m_floorInstance;
 
 	ers::Vector<MeshInstance> m_cubes;
+	ers::Vector<s32> m_cubeOrder; // the opaque cubes' indices, front to back.
+
+	// Point lights wandering over the floor of the monkey scene, culled per screen tile against the depth prepass.
+	ers::Vector<PointLight> m_pointLights;
+	ers::Vector<ers::vec3> m_pointLightOrigins;
+	LightGrid m_lightGrid;
+	bool m_manyLights;
 
 	enum Scene
 	{
@@ -105,13 +128,17 @@ private:
 	s32 m_whichScene;
 	s32 m_numOfImages;
 	s32 m_numOfPcfDims;
+	bool m_transparentCubes;
+	bool m_randomColors;
+	Renderer::ShadingRate m_floorShadingRate;
 
 public:
 	App(const char* title_, int width_, int height_, int windowpos_x, int windowpos_y)
 		: 
 		Window(title_, width_, height_, windowpos_x, windowpos_y),
 		m_stringBuf(ers::String(1024)),
-		m_surface(width_, height_)
+		m_surface(width_, height_),
+		m_resolutionScaler(1.0 / 30.0)
 	{ 
 		
 	}
@@ -128,6 +155,20 @@ public:
 		return result;
 	}
 
+	// Draws only the depth of the occluders, so that the instances drawn after them can be skipped if they're hidden 
+	// (see Renderer::IsAabbVisible). Drawing the occluders themselves afterwards only shades their visible fragments:
+	// their depths are equal to the prepass' to the bit, so they pass the depth test (<=) wherever they're in front.
+	// That holds as long as the shading pass gets the same mvp, computed as vp * model like here, and its vertex shader 
+	// transforms aPos the same way, since every raster path (depth-only or not) interpolates depth with the same operations.
+	void DrawOccluders(const MeshInstance* const* occluders, s32 count, const ers::mat4& vp)
+	{
+		for (s32 i = 0; i < count; ++i)
+		{
+			m_depthOnlyShader.uniform_mvp_mat = vp * occluders[i]->transform.GetModelMatrix();
+			occluders[i]->mesh->Draw(m_renderer, m_depthOnlyShader, m_depthOnlyShader.uniform_mvp_mat);
+		}
+	}
+
 	void HelloTriangleSceneUpdateAndDraw()
 	{
 		m_renderer->Clear();
@@ -142,8 +183,7 @@ public:
 		v2.aPos = ers::vec3(m_triangle[2][0], m_triangle[2][1], m_triangle[2][2]);
 		v2.aColor = ers::vec3(m_triangle[2][3], m_triangle[2][4], m_triangle[2][5]);
 		
-		m_renderer->SetShaderProgram(&m_simpleShader);
-		m_renderer->RenderTriangle(&v0, &v1, &v2);
+		m_renderer->RenderTriangle(m_simpleShader, &v0, &v1, &v2);
 	}
 
 	void CubesSceneInit()
@@ -163,10 +203,10 @@ public:
 		for (s32 i = 0; i < count_cubes; ++i)
 			m_cubes[i].transform.SetRotation(5.0f * current_time, m_cubes[i].rotation_axis);
 
-		m_renderer->SetViewport(GetWindowWidth(), GetWindowHeight());
+		m_renderer->SetViewport(m_renderWidth, m_renderHeight);
 		m_renderer->Clear(0.2f, 0.2f, 0.3f);
 
-		m_blinnPhongShader.uniform_do_random_color = false;
+		m_blinnPhongShader.uniform_do_random_color = m_randomColors; // per triangle, see BlinnPhongShader::random_color.
 		m_blinnPhongShader.uniform_do_specific_color = true;
 		m_blinnPhongShader.uniform_do_point_light = true;
 		m_blinnPhongShader.uniform_light_pos = light_pos;
@@ -182,17 +222,21 @@ public:
 		m_blinnPhongShader.sampler2d_shadow_map = nullptr;	
 
 		m_blinnPhongShader.uniform_lightspace_mat = m_shadowmapShader.uniform_lightspace_mat;
-		m_renderer->SetShaderProgram(&m_blinnPhongShader);
-		
+		m_blinnPhongShader.uniform_alpha = 1.0f;
+
+		// The opaque cubes front to back, so that the ones hidden behind those drawn before them are skipped (see DrawCube).
+		const ers::vec3 view_pos = m_playerCamera->GetPosition();
+		m_cubeOrder.Clear();
 		for (s32 i = 0; i < count_cubes; ++i)
 		{
-			ers::mat4 tr = m_cubes[i].transform.GetModelMatrix();
-			m_blinnPhongShader.uniform_mvp_mat = vp * tr; 	
-			m_blinnPhongShader.uniform_model = tr;
-			m_blinnPhongShader.uniform_model_it = ers::mat3(ers::transpose(ers::inverse(tr)));
-			m_blinnPhongShader.uniform_color = m_cubes[i].color;
-			m_cubes[i].mesh->Draw(m_renderer);
+			if (m_transparentCubes && i % 2 == 1) continue;
+			m_cubeOrder.PushBack(i);
 		}
+		std::sort(m_cubeOrder.begin(), m_cubeOrder.end(), [this, &view_pos](s32 a, s32 b) { 
+			return ers::length2(m_cubes[a].transform.GetTranslation() - view_pos) < ers::length2(m_cubes[b].transform.GetTranslation() - view_pos); 
+		});
+		for (size_t i = 0; i < m_cubeOrder.GetSize(); ++i)
+			DrawCube(m_cubes[m_cubeOrder[i]], vp);
 
 		m_lightCube.transform.SetTranslation(light_pos);
 		ers::mat4 tr_cube = m_lightCube.transform.GetModelMatrix();	
@@ -202,8 +246,36 @@ public:
 		m_debugLightShader.uniform_model = tr_cube;
 		m_debugLightShader.uniform_color = m_lightCube.color;
 		m_debugLightShader.uniform_light_pos = light_pos;
-		m_renderer->SetShaderProgram(&m_debugLightShader);
-		m_lightCube.mesh->Draw(m_renderer);
+		m_lightCube.mesh->Draw(m_renderer, m_debugLightShader, m_debugLightShader.uniform_mvp_mat);
+
+		// Every other cube is see-through. They're drawn last, in no particular order and with their back faces,
+		// into the OIT buffers, which are composited over the opaque ones when OIT is disabled.
+		if (m_transparentCubes)
+		{
+			m_renderer->Disable(Renderer::CULL_FACE);
+			m_renderer->Enable(Renderer::NO_DEPTH_WRITE);
+			m_renderer->Enable(Renderer::OIT);
+			m_blinnPhongShader.uniform_alpha = 0.4f;
+			for (s32 i = 1; i < count_cubes; i += 2)
+				DrawCube(m_cubes[i], vp);
+			m_renderer->Disable(Renderer::OIT);
+			m_renderer->Disable(Renderer::NO_DEPTH_WRITE);
+			m_renderer->Enable(Renderer::CULL_FACE);
+		}
+	}
+
+	// Skips the cube if it's hidden behind what's been drawn so far.
+	void DrawCube(const MeshInstance& cube, const ers::mat4& vp)
+	{
+		const ers::mat4 tr = cube.transform.GetModelMatrix();
+		const ers::mat4 mvp = vp * tr;
+		if (!m_renderer->IsAabbVisible(cube.mesh->GetAabbMin(), cube.mesh->GetAabbMax(), mvp)) return;
+
+		m_blinnPhongShader.uniform_mvp_mat = mvp; 	
+		m_blinnPhongShader.uniform_model = tr;
+		m_blinnPhongShader.uniform_model_it = ers::mat3(ers::transpose(ers::inverse(tr)));
+		m_blinnPhongShader.uniform_color = cube.color;
+		cube.mesh->Draw(m_renderer, m_blinnPhongShader, m_blinnPhongShader.uniform_mvp_mat);
 	}
 
 	void MakeFloorTextures()
@@ -289,6 +361,29 @@ public:
 		m_floorInstance.transform.Translate(ers::vec3(0.0f, -1.5f, -4.0f));
 		m_floorInstance.transform.Scale(ers::vec3(10.0f));
 		m_floorInstance.transform.Rotate(ers::radians(-90.0f), ers::vec3(1.0f, 0.0f, 0.0f));		
+
+		// A jittered 16 x 16 grid of small lights just above the floor (10 x 10 units, centered at (0, -1.5, -4)).
+		const s32 lights_per_side = 16;
+		const f32 spacing = 10.0f / (f32)lights_per_side;
+		m_pointLights.Reserve(lights_per_side * lights_per_side);
+		m_pointLightOrigins.Reserve(lights_per_side * lights_per_side);
+		for (s32 i = 0; i < lights_per_side; ++i)
+		{
+			for (s32 j = 0; j < lights_per_side; ++j)
+			{
+				const ers::vec3 origin(
+					-5.0f + ((f32)j + RAND_F32) * spacing, 
+					-1.3f, 
+					-9.0f + ((f32)i + RAND_F32) * spacing
+				);
+				PointLight light;
+				light.position = origin;
+				light.color = ers::normalize(RAND_V3F32 + ers::vec3(0.1f)) * 1.5f;
+				light.radius = 0.8f + 0.4f * RAND_F32;
+				m_pointLights.PushBack(light);
+				m_pointLightOrigins.PushBack(origin);
+			}
+		}
 	}
 
 	void TextureSceneUpdateAndDraw()
@@ -306,34 +401,30 @@ public:
 		const ers::mat4 light_proj = ers::ortho(-10.0f, 10.0f, -10.0f, 10.0f, 1.0f, zFar);
 		const ers::mat4 light_view = ers::lookAt(light_pos, pos_texture_cube + ers::vec3(0.0f, 0.0f, -1.0f), ers::vec3(0.0f, 1.0f, 0.0f));
 
-		// Do a renderpass for shadows.
-		m_renderer->SetViewport(m_shadowmap->GetWidth(), m_shadowmap->GetHeight());
+		// Do a renderpass for shadows, straight into the shadowmap.
+		m_renderer->SetRenderTarget(nullptr, m_shadowmap);
 		m_renderer->Clear();
 		
 		m_shadowmapShader.uniform_light_pos = light_pos;		
 		m_shadowmapShader.uniform_lightspace_mat = light_proj * light_view;
 		m_shadowmapShader.uniform_zFar = zFar;
 		m_shadowmapShader.uniform_model = tr_texture_cube;
-		m_renderer->SetShaderProgram(&m_shadowmapShader);
-		m_monkeyInstance.mesh->Draw(m_renderer);
+		m_monkeyInstance.mesh->Draw(m_renderer, m_shadowmapShader, m_shadowmapShader.uniform_lightspace_mat * tr_texture_cube);
 
 		const ers::mat4 tr_floor = m_floorInstance.transform.GetModelMatrix();	
 		m_shadowmapShader.uniform_model = tr_floor;
-		m_floorInstance.mesh->Draw(m_renderer);
-
-		// Copy z_buffer to shadowmap.
-		void* p_to = m_shadowmap->GetData();
-		void* p_from = m_renderer->GetZBuffer();
-		memcpy(p_to, p_from, m_shadowmap->GetSize() * sizeof(f32));
+		m_floorInstance.mesh->Draw(m_renderer, m_shadowmapShader, m_shadowmapShader.uniform_lightspace_mat * tr_floor);
 
 		// Render normally.
-		m_renderer->SetViewport(GetWindowWidth(), GetWindowHeight());
+		m_renderer->SetRenderTarget(nullptr, nullptr);
+		m_renderer->SetViewport(m_renderWidth, m_renderHeight);
 		m_renderer->Clear();
 
 		m_blinnPhongShader.uniform_do_random_color = false;
 		m_blinnPhongShader.uniform_do_specific_color = false;
 		m_blinnPhongShader.uniform_do_point_light = false;
 		m_blinnPhongShader.uniform_pcf_dims = m_numOfPcfDims;
+		m_blinnPhongShader.uniform_alpha = 1.0f;
 		m_blinnPhongShader.uniform_light_dir = ers::normalize(pos_texture_cube - light_pos);
 		m_blinnPhongShader.uniform_view_pos = m_playerCamera->GetPosition();
 
@@ -341,6 +432,22 @@ public:
 		const ers::mat4 view = m_playerCamera->GetViewMatrix();
 		const ers::mat4 vp = proj * view;
 
+		const MeshInstance* occluders[] = { &m_floorInstance, &m_monkeyInstance };
+		DrawOccluders(occluders, 2, vp);
+
+		// The prepass' depths bound the tiles, so that the lights hidden behind the monkey or the floor are culled too.
+		m_blinnPhongShader.uniform_light_grid = nullptr;
+		if (m_manyLights)
+		{
+			for (size_t i = 0; i < m_pointLights.GetSize(); ++i)
+			{
+				const f32 phase = current_time + 0.37f * (f32)i;
+				m_pointLights[i].position = m_pointLightOrigins[i] + ers::vec3(0.3f * cosf(phase), 0.0f, 0.3f * sinf(phase));
+			}
+			m_lightGrid.Build(&m_pointLights[0], (s32)m_pointLights.GetSize(), vp, m_renderWidth, m_renderHeight, m_renderer->GetZBuffer());
+			m_blinnPhongShader.uniform_light_grid = &m_lightGrid;
+		}
+
 		m_blinnPhongShader.sampler2d_diffuse_map = m_modelDiffuse;
 		m_blinnPhongShader.sampler2d_normal_map = nullptr;
 		m_blinnPhongShader.sampler2d_specular_map = nullptr;	
@@ -352,8 +459,7 @@ public:
 		m_blinnPhongShader.uniform_model_it = ers::mat3(ers::transpose(ers::inverse(tr_texture_cube)));
 		m_blinnPhongShader.uniform_color = ers::vec3(0.1f, 0.5f, 0.2f);
 
-		m_renderer->SetShaderProgram(&m_blinnPhongShader);
-		m_monkeyInstance.mesh->Draw(m_renderer);
+		m_monkeyInstance.mesh->Draw(m_renderer, m_blinnPhongShader, m_blinnPhongShader.uniform_mvp_mat);
 
 		m_blinnPhongShader.uniform_do_specific_color = false;
 		m_blinnPhongShader.uniform_color = m_floorInstance.color;
@@ -364,7 +470,9 @@ public:
 		m_blinnPhongShader.sampler2d_normal_map = m_floorNormal;
 		m_blinnPhongShader.sampler2d_specular_map = m_floorSpecular;	
 		m_blinnPhongShader.sampler2d_shadow_map = m_shadowmap;	
-		m_floorInstance.mesh->Draw(m_renderer);
+		m_renderer->SetShadingRate(m_floorShadingRate); // the floor is low frequency enough for coarse shading.
+		m_floorInstance.mesh->Draw(m_renderer, m_blinnPhongShader, m_blinnPhongShader.uniform_mvp_mat);
+		m_renderer->SetShadingRate(Renderer::SHADING_RATE_1X1);
 
 		m_arrowInstance.transform.SetTranslation(light_pos);
 		m_arrowInstance.transform.SetRotation(acosf(m_blinnPhongShader.uniform_light_dir.y()), ers::cross(ers::vec3(0.0f, 1.0f, 0.0f), m_blinnPhongShader.uniform_light_dir));
@@ -375,8 +483,8 @@ public:
 		m_debugLightShader.uniform_model = tr_cube;
 		m_debugLightShader.uniform_color = m_arrowInstance.color;
 		m_debugLightShader.uniform_light_pos = light_pos;
-		m_renderer->SetShaderProgram(&m_debugLightShader);
-		m_arrowInstance.mesh->Draw(m_renderer);
+		if (m_renderer->IsAabbVisible(m_arrowInstance.mesh->GetAabbMin(), m_arrowInstance.mesh->GetAabbMax(), m_debugLightShader.uniform_mvp_mat))
+			m_arrowInstance.mesh->Draw(m_renderer, m_debugLightShader, m_debugLightShader.uniform_mvp_mat);
 	}
 
 	void TextureSceneCleanup()
@@ -394,6 +502,12 @@ public:
 		m_whichScene = Scene::HELLO_TRIANGLE;
 		m_numOfImages = 0;
 		m_numOfPcfDims = 1;
+		m_transparentCubes = false;
+		m_randomColors = false;
+		m_floorShadingRate = Renderer::SHADING_RATE_2X2;
+		m_dynamicResolution = true;
+		m_manyLights = false;
+		m_blinnPhongShader.uniform_light_grid = nullptr;
 
 		m_shadowmap = new Image(512, 512, Image::Format::GRAYSCALE, Image::Range::HDR);	
 
@@ -420,6 +534,7 @@ public:
 		m_renderer = new Renderer(w, h);	
 		m_renderer->Enable(Renderer::DEPTH_TEST);
 		m_renderer->Enable(Renderer::CULL_FACE); 
+		m_renderer->Enable(Renderer::BINNING); 
 
 		CubesSceneInit();
 		TextureSceneInit();
@@ -446,6 +561,30 @@ public:
 		if (KeyPressed(GLFW_KEY_V))
 			m_renderer->Toggle(Renderer::WIREFRAME);
 
+		if (KeyPressed(GLFW_KEY_B))
+			m_renderer->Toggle(Renderer::DEFERRED);
+
+		if (KeyPressed(GLFW_KEY_M))
+			m_renderer->Toggle(Renderer::MSAA);
+
+		if (KeyPressed(GLFW_KEY_T))
+			m_transparentCubes = !m_transparentCubes;
+
+		if (KeyPressed(GLFW_KEY_P))
+			m_randomColors = !m_randomColors;
+
+		if (KeyPressed(GLFW_KEY_G))
+		{
+			m_dynamicResolution = !m_dynamicResolution;
+			m_resolutionScaler.Reset();
+		}
+
+		if (KeyPressed(GLFW_KEY_R))
+			m_floorShadingRate = (Renderer::ShadingRate)((m_floorShadingRate + 1) % (Renderer::SHADING_RATE_4X4 + 1));
+
+		if (KeyPressed(GLFW_KEY_L))
+			m_manyLights = !m_manyLights;
+
 		if (KeyPressed(GLFW_KEY_F))
 		{
 			s32 n = m_numOfImages;
@@ -517,13 +656,20 @@ public:
 		{
 			const s32 w = GetWindowWidth();
 			const s32 h = GetWindowHeight();
-			m_renderer->SetViewport(w, h);
 			m_playerCamera->UpdateProjection((f32)w, (f32)h);
 			m_surface.Resize(w, h);
 		}
 
 		ProcessInput();
 
+		const s32 w = GetWindowWidth();
+		const s32 h = GetWindowHeight();
+		m_renderWidth = m_dynamicResolution ? m_resolutionScaler.GetScaledSize(w) : w;
+		m_renderHeight = m_dynamicResolution ? m_resolutionScaler.GetScaledSize(h) : h;
+		m_frameTimer.Reset();
+		m_frameTimer.Begin();
+		m_renderer->SetViewport(m_renderWidth, m_renderHeight);
+
 		switch (m_whichScene)
 		{
 			case Scene::HELLO_TRIANGLE:
@@ -539,7 +685,19 @@ public:
 				ERS_UNREACHABLE();
 		}
 
-		m_surface.Draw(m_renderer->GetColorBuffer());
+		u8* output = m_renderer->GetColorBuffer();
+		if (m_renderWidth != w || m_renderHeight != h)
+		{
+			if (m_outputBuffer.GetSize() < (size_t)(w * h)) 
+				m_outputBuffer.Resize(w * h);
+			output = (u8*)&m_outputBuffer[0];
+			m_renderer->UpscaleColorBuffer(output, w, h);
+		}
+		m_frameTimer.End();
+		if (m_dynamicResolution) 
+			m_resolutionScaler.Update(m_frameTimer.GetAccumulated());
+
+		m_surface.Draw(output);
 	}
 
 	void Cleanup() override
@@ -1,6 +1,24 @@
 #include "mesh.h"
-
-Mesh::Mesh() : m_status(0) {}
+#include <cstddef>
+#include <algorithm>
+
+static_assert(
+	sizeof(Vertex) == sizeof(VertexAttributes1)
+	&& offsetof(Vertex, normal) == offsetof(VertexAttributes1, aNormal)
+	&& offsetof(Vertex, tex_coords) == offsetof(VertexAttributes1, aTexcoord),
+	"Mesh::Draw passes its vertices to the shaders as VertexAttributes1."
+);
+
+Mesh::Mesh() 
+	: 
+	m_status(0), 
+	m_aabbMin(0.0f), 
+	m_aabbMax(0.0f), 
+	m_sphereCenter(0.0f), 
+	m_sphereRadius(0.0f) 
+{
+	
+}
 
 const Vertex& Mesh::GetVertex(size_t idx) const
 {
@@ -56,24 +74,245 @@ bool Mesh::GetHasTexcoords() const
 {
     return (m_status & HAS_TEXCOORDS) > 0;
 }
-void Mesh::Draw(Renderer* renderer) const
+
+void Mesh::UpdateBounds()
+{
+	const size_t count = m_vertices.GetSize();
+	if (count == 0) return;
+
+	m_aabbMin = m_aabbMax = m_vertices[0].position;
+	for (size_t i = 1; i < count; ++i)
+	{
+		const ers::vec3& p = m_vertices[i].position;
+		for (s32 k = 0; k < 3; ++k)
+		{
+			m_aabbMin.e[k] = ers::min(m_aabbMin.e[k], p.e[k]);
+			m_aabbMax.e[k] = ers::max(m_aabbMax.e[k], p.e[k]);
+		}
+	}
+
+	// Centered on the box, which is usually tighter than half of its diagonal.
+	m_sphereCenter = (m_aabbMin + m_aabbMax) * 0.5f;
+	f32 radius2 = 0.0f;
+	for (size_t i = 0; i < count; ++i)
+		radius2 = ers::max(radius2, ers::length2(m_vertices[i].position - m_sphereCenter));
+	m_sphereRadius = sqrtf(radius2);
+}
+
+const ers::vec3& Mesh::GetAabbMin() const
+{
+	return m_aabbMin;
+}
+
+const ers::vec3& Mesh::GetAabbMax() const
 {
-	const s32 count_tris = (s32)GetFaceCount();	
-	for (s32 i = 0; i < count_tris; ++i)
+	return m_aabbMax;
+}
+
+const ers::vec3& Mesh::GetBoundingSphereCenter() const
+{
+	return m_sphereCenter;
+}
+
+f32 Mesh::GetBoundingSphereRadius() const
+{
+	return m_sphereRadius;
+}
+
+void Mesh::Draw(Renderer* renderer, const ers::mat4& mvp) const
+{
+	s32 count_indices = 0;
+	const s32* indices = cullMeshlets(renderer, mvp, count_indices);
+	if (count_indices == 0) return;
+	renderer->DrawIndexed(&m_vertices[0], sizeof(Vertex), indices, count_indices);
+}
+
+const s32* Mesh::cullMeshlets(Renderer* renderer, const ers::mat4& mvp, s32& count_indices) const
+{
+	count_indices = 0;
+	if (m_indices.GetSize() == 0 || !IsInFrustum(mvp)) return nullptr;
+	if (m_meshlets.GetSize() <= 1) 
+	{
+		count_indices = (s32)m_indices.GetSize();
+		return &m_indices[0];
+	}
+
+	// The eye in model space, as a homogeneous point: the clip space direction (0, 0, -1, 0) is where it maps to 
+	// for perspective projections, while for orthographic ones it's the point at infinity behind the view (w = 0).
+	// Either way, p * eye.w - eye.xyz points from the eye towards p.
+	const Frustum frustum(mvp);
+	const bool cull_backfaces = renderer->IsEnabled(Renderer::CULL_FACE);
+	const ers::vec4 eye = ers::inverse(mvp) * ers::vec4(0.0f, 0.0f, -1.0f, 0.0f);
+
+	m_visibleIndices.Clear();
+	for (const Meshlet& meshlet : m_meshlets)
+	{
+		if (!frustum.IntersectsSphere(meshlet.center, meshlet.radius)) continue;
+		if (cull_backfaces && meshlet.cone_cutoff <= 1.0f)
+		{
+			// Every triangle faces away if the directions from the eye to all points in the bounding sphere are 
+			// within 90 degrees of every triangle's normal (meshoptimizer's cone test).
+			const ers::vec3 view = meshlet.center * eye.w() - ers::vec3(eye);
+			if (ers::dot(view, meshlet.cone_axis) >= meshlet.cone_cutoff * ers::length(view) + meshlet.radius * eye.w()) continue;
+		}
+		for (s32 i = 0; i < meshlet.count_indices; ++i)
+			m_visibleIndices.PushBack(m_indices[meshlet.first_index + i]);
+	}
+
+	count_indices = (s32)m_visibleIndices.GetSize();
+	return (count_indices > 0) ? &m_visibleIndices[0] : nullptr;
+}
+
+void Mesh::BuildMeshlets(s32 max_vertices, s32 max_triangles)
+{
+	ERS_ASSERT(max_vertices >= 3 && max_triangles >= 1);
+	m_meshlets.Clear();
+	const s32 count_indices = (s32)m_indices.GetSize();
+	if (count_indices == 0) return;
+
+	// Meshlets are cut from the triangles in order, so the triangles are sorted first: by the dominant axis of their normal, 
+	// for narrow normal cones, and then along a Morton curve through the mesh's bounding box, for small bounding spheres.
+	const s32 count_tris = count_indices / 3;
+	ERS_ASSERT(count_tris < (1 << 24));
+	ers::Vector<u64> keys;
+	keys.Resize(count_tris);
+	const ers::vec3 extent = m_aabbMax - m_aabbMin;
+	for (s32 t = 0; t < count_tris; ++t)
+	{
+		const ers::vec3& p0 = m_vertices[m_indices[3 * t]].position;
+		const ers::vec3& p1 = m_vertices[m_indices[3 * t + 1]].position;
+		const ers::vec3& p2 = m_vertices[m_indices[3 * t + 2]].position;
+		const ers::vec3 n = ers::cross(p1 - p0, p2 - p0);
+		s32 axis = 0;
+		for (s32 k = 1; k < 3; ++k) 
+			if (ers::abs(n.e[k]) > ers::abs(n.e[axis])) axis = k;
+		const u64 face = (u64)(2 * axis + ((n.e[axis] < 0.0f) ? 1 : 0));
+
+		const ers::vec3 centroid = (p0 + p1 + p2) * (1.0f / 3.0f);
+		u64 morton = 0;
+		for (s32 k = 0; k < 3; ++k)
+		{
+			const f32 t_k = (extent.e[k] > 0.0f) ? (centroid.e[k] - m_aabbMin.e[k]) / extent.e[k] : 0.0f;
+			const u64 cell = (u64)ers::clamp(t_k * 1023.0f, 0.0f, 1023.0f);
+			for (s32 bit = 0; bit < 10; ++bit)
+				morton |= ((cell >> bit) & 1u) << (3 * bit + k);
+		}
+		keys[t] = (face << 56) | (morton << 24) | (u64)t; // the triangle's index last, which also keeps the sort stable.
+	}
+	std::sort(keys.begin(), keys.end());
+
+	const ers::Vector<s32> indices_unsorted = m_indices;
+	for (s32 t = 0; t < count_tris; ++t)
+	{
+		const s32 src = (s32)(keys[t] & 0xffffffu);
+		for (s32 k = 0; k < 3; ++k)
+			m_indices[3 * t + k] = indices_unsorted[3 * src + k];
+	}
+
+	// The meshlet each vertex was last added to, for counting the distinct vertices of the current one.
+	ers::Vector<s32> vertex_meshlet;
+	vertex_meshlet.Resize(m_vertices.GetSize());
+	for (s32& idx : vertex_meshlet) idx = -1;
+
+	Meshlet meshlet = {};
+	s32 count_vertices = 0;
+	for (s32 i = 0; i + 2 < count_indices; i += 3)
+	{
+		const s32 idx = (s32)m_meshlets.GetSize();
+		s32 count_new = 0;
+		for (s32 k = 0; k < 3; ++k)
+			count_new += (vertex_meshlet[m_indices[i + k]] != idx) ? 1 : 0;
+
+		if (count_vertices + count_new > max_vertices || meshlet.count_indices / 3 == max_triangles)
+		{
+			m_meshlets.PushBack(meshlet);
+			meshlet.first_index = i;
+			meshlet.count_indices = 0;
+			count_vertices = 0;
+		}
+
+		const s32 idx_current = (s32)m_meshlets.GetSize();
+		for (s32 k = 0; k < 3; ++k)
+		{
+			s32& vert_meshlet = vertex_meshlet[m_indices[i + k]];
+			if (vert_meshlet != idx_current) 
+			{
+				vert_meshlet = idx_current;
+				++count_vertices;
+			}
+		}
+		meshlet.count_indices += 3;
+	}
+	m_meshlets.PushBack(meshlet);
+
+	for (Meshlet& m : m_meshlets)
 	{
-		// Assembly.
-		const s32 base = 3 * i;
-		const Vertex& vert0 = GetVertex(GetIndex(base));
-		const Vertex& vert1 = GetVertex(GetIndex(base + 1));
-		const Vertex& vert2 = GetVertex(GetIndex(base + 2));
-
-		VertexAttributes1 v0, v1, v2;
-		v0 = { vert0.position, vert0.normal, vert0.tex_coords };
-		v1 = { vert1.position, vert1.normal, vert1.tex_coords };
-		v2 = { vert2.position, vert2.normal, vert2.tex_coords };
-
-        renderer->RenderTriangle(&v0, &v1, &v2);
-    }
+		ers::vec3 aabb_min = m_vertices[m_indices[m.first_index]].position;
+		ers::vec3 aabb_max = aabb_min;
+		ers::vec3 normal_sum(0.0f);
+		for (s32 i = m.first_index; i < m.first_index + m.count_indices; i += 3)
+		{
+			const ers::vec3& p0 = m_vertices[m_indices[i]].position;
+			const ers::vec3& p1 = m_vertices[m_indices[i + 1]].position;
+			const ers::vec3& p2 = m_vertices[m_indices[i + 2]].position;
+			for (s32 k = 0; k < 3; ++k)
+			{
+				aabb_min.e[k] = ers::min(aabb_min.e[k], ers::min(p0.e[k], ers::min(p1.e[k], p2.e[k])));
+				aabb_max.e[k] = ers::max(aabb_max.e[k], ers::max(p0.e[k], ers::max(p1.e[k], p2.e[k])));
+			}
+
+			// The winding's normal, which is what backface culling goes by, and not the vertex normals.
+			const ers::vec3 n = ers::cross(p1 - p0, p2 - p0);
+			const f32 len = ers::length(n);
+			if (len > 0.0f) normal_sum += n * (1.0f / len);
+		}
+
+		m.center = (aabb_min + aabb_max) * 0.5f;
+		f32 radius2 = 0.0f;
+		for (s32 i = m.first_index; i < m.first_index + m.count_indices; ++i)
+			radius2 = ers::max(radius2, ers::length2(m_vertices[m_indices[i]].position - m.center));
+		m.radius = sqrtf(radius2);
+
+		m.cone_axis = ers::vec3(0.0f);
+		m.cone_cutoff = 2.0f;
+		const f32 axis_len = ers::length(normal_sum);
+		if (axis_len <= 0.0f) continue;
+
+		m.cone_axis = normal_sum * (1.0f / axis_len);
+		f32 min_dot = 1.0f;
+		for (s32 i = m.first_index; i < m.first_index + m.count_indices; i += 3)
+		{
+			const ers::vec3& p0 = m_vertices[m_indices[i]].position;
+			const ers::vec3 n = ers::cross(m_vertices[m_indices[i + 1]].position - p0, m_vertices[m_indices[i + 2]].position - p0);
+			const f32 len = ers::length(n);
+			if (len > 0.0f) min_dot = ers::min(min_dot, ers::dot(n, m.cone_axis) / len);
+		}
+		if (min_dot > 0.0f) m.cone_cutoff = sqrtf(1.0f - min_dot * min_dot);
+	}
+}
+
+size_t Mesh::GetMeshletCount() const
+{
+	return m_meshlets.GetSize();
+}
+
+const Meshlet& Mesh::GetMeshlet(size_t i) const
+{
+	return m_meshlets[i];
+}
+
+bool Mesh::IsInFrustum(const ers::mat4& mvp) const
+{
+	// The planes are in model space, so the bounds are tested as they are. The sphere goes first, since it's cheaper.
+	const Frustum frustum(mvp);
+	return frustum.IntersectsSphere(m_sphereCenter, m_sphereRadius) && frustum.IntersectsAabb(m_aabbMin, m_aabbMax);
+}
+
+void Mesh::Draw(Renderer* renderer) const
+{
+	// Flushes at the end, since the shader's uniforms may change after this.
+	if (m_indices.GetSize() == 0) return;
+	renderer->DrawIndexed(&m_vertices[0], sizeof(Vertex), &m_indices[0], (s32)m_indices.GetSize());
 }
 
 ers::vec3 calculate_tangent(const Vertex& vert0, const Vertex& vert1, const Vertex& vert2)
@@ -142,6 +381,8 @@ void make_quad(float xpos, float ypos, float width, float height, Mesh& quad)
 
 	quad.SetHasNormals();
 	quad.SetHasTexcoords();
+	quad.UpdateBounds();
+	quad.BuildMeshlets();
 }
 
 void make_cube(Mesh& cube)
@@ -228,6 +469,8 @@ void make_cube(const ers::vec3& dim, Mesh& cube)
 
 	cube.SetHasNormals();
 	cube.SetHasTexcoords();
+	cube.UpdateBounds();
+	cube.BuildMeshlets();
 }
 
 size_t hash(const Vertex& v)
@@ -402,4 +645,7 @@ void load_object_file(const char* filename, Mesh& model)
 			model.PushIndex(last_vert);
 		}
 	}	
+
+	model.UpdateBounds();
+	model.BuildMeshlets();
 }
\ No newline at end of file
@@ -0,0 +1,62 @@
+#include "resolution_scaler.h"
+#include "ers/macros.h"
+#include "ers/common.h"
+#include <cmath>
+
+ResolutionScaler::ResolutionScaler(f64 frame_budget, f32 min_scale, f32 max_scale)
+    :
+    m_frameBudget(frame_budget),
+    m_averageTime(0.0),
+    m_minScale(min_scale),
+    m_maxScale(max_scale),
+    m_scale(max_scale)
+{
+    ERS_ASSERT(frame_budget > 0.0);
+    ERS_ASSERT(min_scale > 0.0f && min_scale <= max_scale);
+}
+
+void ResolutionScaler::Update(f64 frame_time)
+{
+    // Averaged over a few frames, so that a single hitch doesn't make the resolution jump.
+    m_averageTime = (m_averageTime > 0.0) ? ers::lerp(0.25, m_averageTime, frame_time) : frame_time;
+    if (m_averageTime <= 0.0) return;
+
+    // Keep the scale while between 85% and 100% of the budget, so that it doesn't flicker around the target.
+    const f64 ratio = m_frameBudget / m_averageTime;
+    if (ratio >= 1.0 && ratio <= 1.0 / 0.85) return;
+
+    // Aim a bit below the budget, with the pixel count shrinking by at most 30% and growing by at most 10% per frame.
+    const f64 area_ratio = ers::clamp(0.925 * ratio, 0.7, 1.1);
+    const f32 new_scale = ers::clamp(m_scale * (f32)sqrt(area_ratio), m_minScale, m_maxScale);
+
+    // The frames timed so far were rendered at the old scale, this is what they would have taken at the new one.
+    m_averageTime *= (f64)(new_scale * new_scale) / (f64)(m_scale * m_scale);
+    m_scale = new_scale;
+}
+
+void ResolutionScaler::Reset()
+{
+    m_averageTime = 0.0;
+    m_scale = m_maxScale;
+}
+
+void ResolutionScaler::SetFrameBudget(f64 frame_budget)
+{
+    ERS_ASSERT(frame_budget > 0.0);
+    m_frameBudget = frame_budget;
+}
+
+f64 ResolutionScaler::GetFrameBudget() const
+{
+    return m_frameBudget;
+}
+
+f32 ResolutionScaler::GetScale() const
+{
+    return m_scale;
+}
+
+s32 ResolutionScaler::GetScaledSize(s32 size) const
+{
+    return ers::max((s32)((f32)size * m_scale + 0.5f), 2);
+}
\ No newline at end of file
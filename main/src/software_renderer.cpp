@@ -1,42 +1,135 @@
 #include "software_renderer.h"
 #include "stb_image_write.h"
+#include "simd.h"
 
-Renderer::Renderer(int width, int height, ers::IAllocator* alloc)
+// Fills count 32-bit values (pixels or depths) starting at dst.
+static void fillValues(u32* dst, u32 value, s32 count)
+{
+    s32 i = 0;
+#if defined(ERS_SIMD_AVX2)
+    const __m256i v8 = _mm256_set1_epi32((s32)value);
+    for (; i + 8 <= count; i += 8) _mm256_storeu_si256((__m256i*)(dst + i), v8);
+#endif
+#if defined(ERS_SIMD_SSE2)
+    const __m128i v4 = _mm_set1_epi32((s32)value);
+    for (; i + 4 <= count; i += 4) _mm_storeu_si128((__m128i*)(dst + i), v4);
+#endif
+    for (; i < count; ++i) dst[i] = value;
+}
+
+// MSAA sample positions relative to the pixel center in subpixels, a rotated grid.
+static const s32 s_sampleOffsets[ERS_RENDERER_MSAA_SAMPLES][2] = { { -2, -6 }, { 6, -2 }, { -6, 2 }, { 2, 6 } };
+
+Renderer::Renderer(int width, int height, ers::IAllocator* alloc, s32 count_workers)
     : 
     m_width(width),
     m_height(height),
     m_colorBuffer(nullptr),
     m_zBuffer(nullptr),
+    m_hiZBuffer(nullptr),
+    m_hiZDirty(false),
+    m_visBuffer(alloc),
+    m_ownColors(alloc),
+    m_ownDepths(alloc),
+    m_ownWidth(width),
+    m_ownHeight(height),
+    m_scratchDepths(alloc),
+    m_targetColor(nullptr),
+    m_targetDepth(nullptr),
+    m_clearColor(0),
+    m_ownClearColor(0),
     m_state(State::DEFAULT),
     m_alloc(alloc),
-    m_shader(nullptr)
+    m_shader(nullptr),
+    m_rasterizeKernels(getRasterizeKernels<IShaderProgram>()),
+    m_kernelIdx(0),
+    m_threadPool(count_workers),
+    m_varyingsCount(0),
+    m_binnedDepthOnly(false),
+    m_deferredDraw(-1),
+    m_vertexStage()
 {
     ERS_ASSERT(width >= 2 && width <= ERS_RENDERER_MAX_WIDTH);
     ERS_ASSERT(height >= 2 && height <= ERS_RENDERER_MAX_HEIGHT);
-    m_colorBuffer = (u8*)m_alloc->Allocate(sizeof(u8) * ERS_RENDERER_MAX_WIDTH * ERS_RENDERER_MAX_HEIGHT * 4, alignof(u8)); 
-    m_zBuffer = (f32*)m_alloc->Allocate(sizeof(f32) * ERS_RENDERER_MAX_WIDTH * ERS_RENDERER_MAX_HEIGHT, alignof(f32));     
+    m_hiZBuffer = (f32*)m_alloc->Allocate(sizeof(f32) * ERS_RENDERER_HIZ_MAX_X * ERS_RENDERER_HIZ_MAX_Y, alignof(f32));     
+    memset(m_tileAccumulated, 0, sizeof(m_tileAccumulated));
+    memset(m_tileDeferred, 0, sizeof(m_tileDeferred));
+    memset(m_ownTileClears, CLEAR_NONE, sizeof(m_ownTileClears));
+    SetScissor(0, 0, ERS_RENDERER_MAX_WIDTH, ERS_RENDERER_MAX_HEIGHT);
+    m_shadingRate = SHADING_RATE_1X1;
+    m_partialRedraw = false;
+    memset(m_tileDirty, 0, sizeof(m_tileDirty));
+    bindBuffers();
     Clear(); 
+
+    m_threadShaders.Resize(m_threadPool.GetThreadCount());
+    for (IShaderProgram*& shader : m_threadShaders) shader = nullptr;
+    m_bins.Resize(ERS_RENDERER_MAX_TILES_X * ERS_RENDERER_MAX_TILES_Y);
 }
 
 Renderer::~Renderer()
 {
-    m_alloc->Deallocate(m_colorBuffer);
-    m_alloc->Deallocate(m_zBuffer);    
+    // Whatever is still pending is dropped, not drawn: the shaders it was submitted with may be gone already.
+    releaseThreadShaders();
+    discardBins();
+    discardVisibility();
+    m_alloc->Deallocate(m_hiZBuffer);    
 }
 
 void Renderer::Enable(State state)
 {
-    m_state |= state;
+    setState(m_state | state);
 }
 
 void Renderer::Disable(State state)
 {
-    m_state &= ~state;
+    setState(m_state & ~state);
 }
 
 void Renderer::Toggle(State state)
 {
-    m_state ^= state;
+    setState(m_state ^ state);
+}
+
+void Renderer::setState(u32 state)
+{
+    Flush();
+    const bool was_deferred = IsEnabled(DEFERRED);
+    const bool is_deferred = (state & DEFERRED) > 0;
+    const bool was_msaa = IsEnabled(MSAA);
+    const bool is_msaa = (state & MSAA) > 0;
+    const bool was_oit = IsEnabled(OIT);
+    const bool is_oit = (state & OIT) > 0;
+    if (was_deferred && (!is_deferred || (state & (MSAA | BLEND | OIT)) != 0)) 
+    {
+        // Also before multisampling, which would resolve its samples over the shaded pixels, 
+        // and before blending, which has to blend over them.
+        resolveVisibility(); 
+    }
+    else if (!was_deferred && is_deferred)
+    {
+        clearVisibility();
+    }
+    if (was_oit && !is_oit) resolveTransparency(); // into the samples, if they're still there.
+    if (was_msaa && !is_msaa) resolveSamples();
+    m_state = state;
+    m_kernelIdx = getKernelIndex(state);
+    if (!was_msaa && is_msaa) loadSamples();
+    if (!was_oit && is_oit) reserveTransparency();
+}
+
+u32 Renderer::getKernelIndex(u32 state)
+{
+    // Packs the bits of KERNEL_STATES, lowest first.
+    state = getKernelState(state);
+    u32 idx = 0;
+    u32 bit = 0;
+    for (u32 mask = KERNEL_STATES; mask != 0; mask &= mask - 1u, ++bit)
+    {
+        if ((state & mask & (0u - mask)) != 0) 
+            idx |= 1u << bit;
+    }
+    return idx;
 }
 
 bool Renderer::IsEnabled(State state)
@@ -48,47 +141,254 @@ void Renderer::SetPixel(s32 x, s32 y, ers::vec4& color)
 {
     ERS_ASSERT(x >= 0 && x < m_width);
     ERS_ASSERT(y >= 0 && y < m_height);
-    size_t position = 4 * (m_width * y + x);
-    m_colorBuffer[position] = (u8)(ers::clamp(color.x(), 0.0f, 1.0f) * 255.999f);
-    m_colorBuffer[position + 1] = (u8)(ers::clamp(color.y(), 0.0f, 1.0f) * 255.999f);
-    m_colorBuffer[position + 2] = (u8)(ers::clamp(color.z(), 0.0f, 1.0f) * 255.999f);
-    m_colorBuffer[position + 3] = (u8)(ers::clamp(color.w(), 0.0f, 1.0f) * 255.999f);
+    ERS_ASSERT(m_colorBuffer != nullptr);
+    prepareTileAt(x, y, CLEAR_COLOR);
+    setPixel(x, y, color);
 }
 
 void Renderer::SetZValue(s32 x, s32 y, f32 z_val)
 {
     ERS_ASSERT(x >= 0 && x < m_width);
     ERS_ASSERT(y >= 0 && y < m_height);
-    m_zBuffer[y * m_width + x] = z_val;
+    prepareTileAt(x, y, CLEAR_DEPTH);
+    setZValue(x, y, z_val);
 }
 
 f32 Renderer::GetZValue(s32 x, s32 y)
 {
     ERS_ASSERT(x >= 0 && x < m_width);
     ERS_ASSERT(y >= 0 && y < m_height);
-    return m_zBuffer[y * m_width + x];
+    prepareTileAt(x, y, CLEAR_DEPTH);
+    return getZValue(x, y);
+}
+
+void Renderer::setZValue(s32 x, s32 y, f32 z_val)
+{
+    m_zBuffer[(size_t)y * m_width + x] = z_val;
+
+    // Only ever raise the block's value here, lowering it needs the whole block (see updateHiZ).
+    f32& hi_z = m_hiZBuffer[(y / ERS_RENDERER_BLOCK_SIZE) * ERS_RENDERER_HIZ_MAX_X + x / ERS_RENDERER_BLOCK_SIZE];
+    if (z_val > hi_z) hi_z = z_val;
+}
+
+bool Renderer::IsRectVisible(s32 x_min, s32 y_min, s32 x_max, s32 y_max, f32 z_min)
+{
+    Flush();
+    x_min = ers::max(x_min, 0);
+    y_min = ers::max(y_min, 0);
+    x_max = ers::min(x_max, m_width - 1);
+    y_max = ers::min(y_max, m_height - 1);
+    if (x_min > x_max || y_min > y_max) return false;
+
+    // The same test as isOccluded, for every block the rectangle touches.
+    if (m_hiZDirty) rebuildHiZ();
+    for (s32 by = y_min / ERS_RENDERER_BLOCK_SIZE; by <= y_max / ERS_RENDERER_BLOCK_SIZE; ++by)
+        for (s32 bx = x_min / ERS_RENDERER_BLOCK_SIZE; bx <= x_max / ERS_RENDERER_BLOCK_SIZE; ++bx)
+            if (z_min - ERS_RENDERER_EPSILON <= m_hiZBuffer[by * ERS_RENDERER_HIZ_MAX_X + bx]) return true;
+    return false;
+}
+
+bool Renderer::IsAabbVisible(const ers::vec3& aabb_min, const ers::vec3& aabb_max, const ers::mat4& mvp)
+{
+    Bbox rect;
+    f32 z_min;
+    if (!getAabbScreenRect(aabb_min, aabb_max, mvp, rect, z_min)) return true;
+    if (rect.x_min > rect.x_max || rect.y_min > rect.y_max || z_min > 1.0f) return false;
+    return IsRectVisible(rect.x_min, rect.y_min, rect.x_max, rect.y_max, ers::max(z_min, 0.0f));
+}
+
+bool Renderer::getAabbScreenRect(const ers::vec3& aabb_min, const ers::vec3& aabb_max, const ers::mat4& mvp, Bbox& rect, f32& z_min)
+{
+    // The pixels the box's corners project into, empty if they're all outside of the viewport, and their nearest depth.
+    // False if the box reaches behind the eye, where the projected bounds would be meaningless.
+    f32 sx_min = FLT_MAX, sy_min = FLT_MAX;
+    z_min = FLT_MAX;
+    f32 sx_max = -FLT_MAX, sy_max = -FLT_MAX;
+    for (s32 i = 0; i < 8; ++i)
+    {
+        const ers::vec3 corner(
+            ((i & 1) != 0) ? aabb_max.x() : aabb_min.x(),
+            ((i & 2) != 0) ? aabb_max.y() : aabb_min.y(),
+            ((i & 4) != 0) ? aabb_max.z() : aabb_min.z()
+        );
+        const ers::vec4 p = mvp * ers::vec4(corner, 1.0f);
+        if (p.w() <= ERS_RENDERER_EPSILON) return false;
+
+        // Like getNdcTriCoords, but in whole pixels.
+        const f32 w_inv = 1.0f / p.w();
+        const f32 sx = (0.5f + 0.5f * p.x() * w_inv) * (f32)m_width;
+        const f32 sy = (0.5f + 0.5f * p.y() * w_inv) * (f32)m_height;
+        sx_min = ers::min(sx_min, sx); sx_max = ers::max(sx_max, sx);
+        sy_min = ers::min(sy_min, sy); sy_max = ers::max(sy_max, sy);
+        z_min = ers::min(z_min, 0.5f + 0.5f * p.z() * w_inv);
+    }
+
+    if (sx_max < 0.0f || sy_max < 0.0f || sx_min > (f32)m_width || sy_min > (f32)m_height)
+    {
+        rect.x_min = rect.y_min = 0;
+        rect.x_max = rect.y_max = -1;
+        return true;
+    }
+    rect.x_min = (s32)floorf(ers::max(sx_min, 0.0f));
+    rect.y_min = (s32)floorf(ers::max(sy_min, 0.0f));
+    rect.x_max = ers::min((s32)ers::min(sx_max, (f32)m_width), m_width - 1);
+    rect.y_max = ers::min((s32)ers::min(sy_max, (f32)m_height), m_height - 1);
+    return true;
+}
+
+s32 Renderer::CountVisibleSamples(s32 x_min, s32 y_min, s32 x_max, s32 y_max, f32 z)
+{
+    Flush();
+    x_min = ers::max(x_min, 0);
+    y_min = ers::max(y_min, 0);
+    x_max = ers::min(x_max, m_width - 1);
+    y_max = ers::min(y_max, m_height - 1);
+
+    // Tiles still waiting for their clear are counted as such, without clearing them.
+    s32 count = 0;
+    for (s32 ty = y_min / ERS_RENDERER_TILE_SIZE; ty <= y_max / ERS_RENDERER_TILE_SIZE && x_min <= x_max; ++ty)
+    {
+        for (s32 tx = x_min / ERS_RENDERER_TILE_SIZE; tx <= x_max / ERS_RENDERER_TILE_SIZE; ++tx)
+        {
+            const s32 x0 = ers::max(x_min, tx * ERS_RENDERER_TILE_SIZE);
+            const s32 y0 = ers::max(y_min, ty * ERS_RENDERER_TILE_SIZE);
+            const s32 x1 = ers::min(x_max, (tx + 1) * ERS_RENDERER_TILE_SIZE - 1);
+            const s32 y1 = ers::min(y_max, (ty + 1) * ERS_RENDERER_TILE_SIZE - 1);
+            if ((m_tileClears[ty * ERS_RENDERER_MAX_TILES_X + tx] & CLEAR_DEPTH) != 0)
+            {
+                if (z <= ERS_RENDERER_CLEAR_DEPTH) count += (x1 - x0 + 1) * (y1 - y0 + 1);
+                continue;
+            }
+
+            for (s32 y = y0; y <= y1; ++y)
+            {
+                const f32* row = &m_zBuffer[y * m_width];
+                for (s32 x = x0; x <= x1; ++x)
+                    count += (z <= row[x]) ? 1 : 0;
+            }
+        }
+    }
+    return count;
 }
 
 void Renderer::SetViewport(s32 width, s32 height)
 { 
     ERS_ASSERT(width >= 2 && width <= ERS_RENDERER_MAX_WIDTH);
     ERS_ASSERT(height >= 2 && height <= ERS_RENDERER_MAX_HEIGHT);
-    m_width = width; 
-    m_height = height; 
+    ERS_ASSERT(m_targetColor == nullptr && m_targetDepth == nullptr);
+    Flush();
+    resolveBuffers();
+    m_width = m_ownWidth = width; 
+    m_height = m_ownHeight = height; 
+    bindBuffers();
+}
+
+void Renderer::SetRenderTarget(Image* color, Image* depth)
+{
+    Flush();
+    resolveBuffers();
+    const bool had_target = (m_targetColor != nullptr || m_targetDepth != nullptr);
+    const bool has_target = (color != nullptr || depth != nullptr);
+    if (had_target)
+    {
+        // The attachments are read directly (e.g. a shadow map sampled by the next pass), so their clears can't stay pending.
+        // Nothing reads the scratch z-buffer of a target without a depth attachment.
+        prepareBuffers((m_targetDepth != nullptr) ? (CLEAR_COLOR | CLEAR_DEPTH) : CLEAR_COLOR);
+    }
+    else if (has_target)
+    {
+        // Only the own buffers' tiles drawn into have been filled in, the rest stays pending until they're switched back to.
+        memcpy(m_ownTileClears, m_tileClears, sizeof(m_tileClears));
+        m_ownClearColor = m_clearColor;
+    }
+    if (has_target)
+    {
+        // The scratch z-buffer holds whatever the last target without a depth attachment left in it.
+        memset(m_tileClears, (depth == nullptr) ? CLEAR_DEPTH : CLEAR_NONE, sizeof(m_tileClears));
+    }
+    else if (had_target)
+    {
+        memcpy(m_tileClears, m_ownTileClears, sizeof(m_tileClears));
+        m_clearColor = m_ownClearColor;
+    }
+
+    m_targetColor = color;
+    m_targetDepth = depth;
+    if (color == nullptr && depth == nullptr)
+    {
+        m_width = m_ownWidth;
+        m_height = m_ownHeight;
+    }
+    else
+    {
+        Image* attachment = (color != nullptr) ? color : depth;
+        m_width = attachment->GetWidth();
+        m_height = attachment->GetHeight();
+        ERS_ASSERT(m_width >= 2 && m_width <= ERS_RENDERER_MAX_WIDTH);
+        ERS_ASSERT(m_height >= 2 && m_height <= ERS_RENDERER_MAX_HEIGHT);
+        ERS_ASSERT(color == nullptr || (color->GetChannels() == 4 && color->GetRange() == Image::Range::LDR));
+        ERS_ASSERT(depth == nullptr || (depth->GetChannels() == 1 && depth->GetRange() == Image::Range::HDR));
+        ERS_ASSERT(depth == nullptr || (depth->GetWidth() == m_width && depth->GetHeight() == m_height));
+    }
+    bindBuffers();
+}
+
+void Renderer::bindBuffers()
+{
+    // Points the buffers at the render target's attachments or at the own buffers, which only grow.
+    const bool has_target = (m_targetColor != nullptr || m_targetDepth != nullptr);
+    const size_t count = (size_t)m_width * m_height;
+    if (!has_target && m_ownColors.GetSize() < count) m_ownColors.Resize(count);
+    if (!has_target && m_ownDepths.GetSize() < count) m_ownDepths.Resize(count);
+    if (has_target && m_targetDepth == nullptr && m_scratchDepths.GetSize() < count) m_scratchDepths.Resize(count);
+    if (has_target)
+    {
+        m_colorBuffer = (m_targetColor != nullptr) ? (u8*)m_targetColor->GetData() : nullptr;
+        m_zBuffer = (m_targetDepth != nullptr) ? (f32*)m_targetDepth->GetData() : &m_scratchDepths[0];
+    }
+    else
+    {
+        m_colorBuffer = (u8*)&m_ownColors[0];
+        m_zBuffer = &m_ownDepths[0];
+    }
+
+    m_hiZDirty = true; // different z-buffer memory, or a different layout.
+    if (IsEnabled(DEFERRED))
+        clearVisibility();
+    if (IsEnabled(MSAA))
+        loadSamples();
+    if (IsEnabled(OIT))
+        reserveTransparency();
+}
+
+void Renderer::resolveBuffers()
+{
+    // Everything that's only drawn into the color buffer when it's needed.
+    resolveVisibility();
+    resolveTransparency();
+    resolveSamples();
 }
 
 void Renderer::SetShaderProgram(IShaderProgram* shader)
 {
+    Flush();
     m_shader = shader;
+    m_rasterizeKernels = getRasterizeKernels<IShaderProgram>();
 }
 
 u8* Renderer::GetColorBuffer()
 {
+    Flush();
+    resolveBuffers();
+    prepareBuffers(CLEAR_COLOR);
     return m_colorBuffer;
 }
 
 f32* Renderer::GetZBuffer()
 {
+    Flush();
+    prepareBuffers(CLEAR_DEPTH);
+    m_hiZDirty = true;
     return m_zBuffer;
 }
 
@@ -109,38 +409,416 @@ const ers::vec4* Renderer::GetNdcVertices()
 
 void Renderer::Clear(f32 r, f32 g, f32 b, f32 a)
 {
-    for (s32 i = 0; i < m_width * m_height; ++i)
+    Flush();
+    const u8 color[4] = { (u8)(r * 255.999f), (u8)(g * 255.999f), (u8)(b * 255.999f), (u8)(a * 255.999f) };
+    u32 rgba;
+    memcpy(&rgba, color, sizeof(color));
+    if (IsEnabled(SCISSOR_TEST) || m_partialRedraw)
+    {
+        clearRegion(rgba);
+        return;
+    }
+    m_clearColor = rgba;
+
+    // Every tile, not just the viewport's, so that the clear holds for any viewport set afterwards.
+    memset(m_tileClears, (m_colorBuffer != nullptr) ? (CLEAR_COLOR | CLEAR_DEPTH) : CLEAR_DEPTH, sizeof(m_tileClears));
+    for (s32 i = 0; i < ERS_RENDERER_HIZ_MAX_X * ERS_RENDERER_HIZ_MAX_Y; ++i) m_hiZBuffer[i] = ERS_RENDERER_CLEAR_DEPTH;
+    m_hiZDirty = false;
+
+    // Anything deferred or accumulated so far would be drawn over anyway.
+    discardVisibility();
+    for (s32 i = 0; i < ERS_RENDERER_MAX_TILES_X * ERS_RENDERER_MAX_TILES_Y; ++i)
+        if (m_tileAccumulated[i] != 0) clearTransparency(i);
+    if (IsEnabled(DEFERRED))
+        clearVisibility();
+}
+
+void Renderer::clearRegion(u32 color)
+{
+    // Only what can be drawn to is cleared, the rest keeps its contents, including what's deferred or accumulated there 
+    // (resolved first). Whole tiles are cleared lazily, the pixels of tiles the scissor rectangle cuts through right away.
+    resolveVisibility();
+    resolveTransparency();
+    if (color != m_clearColor) prepareBuffers(CLEAR_COLOR); // pending clears keep the color they were made with.
+    m_clearColor = color;
+
+    u32 depth;
+    const f32 clear_depth = ERS_RENDERER_CLEAR_DEPTH;
+    memcpy(&depth, &clear_depth, sizeof(depth));
+    const u8 flags = (m_colorBuffer != nullptr) ? (CLEAR_COLOR | CLEAR_DEPTH) : CLEAR_DEPTH;
+    const Bbox region = getDrawRegion();
+    if (region.x_min > region.x_max || region.y_min > region.y_max) return;
+
+    for (s32 ty = region.y_min / ERS_RENDERER_TILE_SIZE; ty <= region.y_max / ERS_RENDERER_TILE_SIZE; ++ty)
+    {
+        for (s32 tx = region.x_min / ERS_RENDERER_TILE_SIZE; tx <= region.x_max / ERS_RENDERER_TILE_SIZE; ++tx)
+        {
+            const s32 tile_idx = ty * ERS_RENDERER_MAX_TILES_X + tx;
+            if (!isTileDrawn(tile_idx)) continue;
+            const Bbox tile = getTileRect(tile_idx);
+            Bbox rect;
+            rect.x_min = ers::max(tile.x_min, region.x_min);
+            rect.y_min = ers::max(tile.y_min, region.y_min);
+            rect.x_max = ers::min(tile.x_max, region.x_max);
+            rect.y_max = ers::min(tile.y_max, region.y_max);
+
+            const bool whole_tile = rect.x_min == tile.x_min && rect.y_min == tile.y_min && rect.x_max == tile.x_max && rect.y_max == tile.y_max;
+            if (whole_tile) 
+                m_tileClears[tile_idx] |= flags;
+            const s32 count = rect.x_max - rect.x_min + 1;
+            for (s32 y = rect.y_min; y <= rect.y_max; ++y)
+            {
+                const size_t position = y * m_width + rect.x_min;
+                if (IsEnabled(DEFERRED)) fillValues(&m_visBuffer[position], ERS_RENDERER_VIS_EMPTY, count);
+                if (whole_tile) continue;
+                if ((flags & CLEAR_COLOR) != 0) fillValues((u32*)m_colorBuffer + position, m_clearColor, count);
+                fillValues((u32*)m_zBuffer + position, depth, count);
+                if (IsEnabled(MSAA)) clearSamples(position, count, flags);
+            }
+            for (s32 by = rect.y_min / ERS_RENDERER_BLOCK_SIZE; by <= rect.y_max / ERS_RENDERER_BLOCK_SIZE; ++by)
+                for (s32 bx = rect.x_min / ERS_RENDERER_BLOCK_SIZE; bx <= rect.x_max / ERS_RENDERER_BLOCK_SIZE; ++bx)
+                    updateHiZ(bx, by);
+        }
+    }
+}
+
+void Renderer::SetScissor(s32 x, s32 y, s32 width, s32 height)
+{
+    Flush();
+    m_scissor.x_min = x;
+    m_scissor.y_min = y;
+    m_scissor.x_max = x + width - 1;
+    m_scissor.y_max = y + height - 1;
+}
+
+void Renderer::SetShadingRate(ShadingRate rate)
+{
+    Flush(); // binned triangles are rasterized with the rate of their draw.
+    m_shadingRate = rate;
+}
+
+void Renderer::AddDirtyRect(s32 x_min, s32 y_min, s32 x_max, s32 y_max)
+{
+    Flush();
+    if (!m_partialRedraw)
+    {
+        m_dirtyBounds.x_min = m_dirtyBounds.y_min = ERS_RENDERER_MAX_WIDTH;
+        m_dirtyBounds.x_max = m_dirtyBounds.y_max = -1;
+    }
+    m_partialRedraw = true;
+
+    x_min = ers::max(x_min, 0);
+    y_min = ers::max(y_min, 0);
+    x_max = ers::min(x_max, m_width - 1);
+    y_max = ers::min(y_max, m_height - 1);
+    if (x_min > x_max || y_min > y_max) return;
+
+    // Rounded out to whole tiles.
+    for (s32 ty = y_min / ERS_RENDERER_TILE_SIZE; ty <= y_max / ERS_RENDERER_TILE_SIZE; ++ty)
+        for (s32 tx = x_min / ERS_RENDERER_TILE_SIZE; tx <= x_max / ERS_RENDERER_TILE_SIZE; ++tx)
+            m_tileDirty[ty * ERS_RENDERER_MAX_TILES_X + tx] = 1;
+    m_dirtyBounds.x_min = ers::min(m_dirtyBounds.x_min, (x_min / ERS_RENDERER_TILE_SIZE) * ERS_RENDERER_TILE_SIZE);
+    m_dirtyBounds.y_min = ers::min(m_dirtyBounds.y_min, (y_min / ERS_RENDERER_TILE_SIZE) * ERS_RENDERER_TILE_SIZE);
+    m_dirtyBounds.x_max = ers::max(m_dirtyBounds.x_max, (x_max / ERS_RENDERER_TILE_SIZE + 1) * ERS_RENDERER_TILE_SIZE - 1);
+    m_dirtyBounds.y_max = ers::max(m_dirtyBounds.y_max, (y_max / ERS_RENDERER_TILE_SIZE + 1) * ERS_RENDERER_TILE_SIZE - 1);
+}
+
+void Renderer::AddDirtyAabb(const ers::vec3& aabb_min, const ers::vec3& aabb_max, const ers::mat4& mvp)
+{
+    Bbox rect;
+    f32 z_min;
+    if (!getAabbScreenRect(aabb_min, aabb_max, mvp, rect, z_min))
+        AddDirtyRect(0, 0, m_width - 1, m_height - 1);
+    else if (z_min <= 1.0f) // a pixel more on every side, for the samples of MSAA.
+        AddDirtyRect(rect.x_min - 1, rect.y_min - 1, rect.x_max + 1, rect.y_max + 1);
+}
+
+void Renderer::ResetDirtyRects()
+{
+    Flush();
+    m_partialRedraw = false;
+    memset(m_tileDirty, 0, sizeof(m_tileDirty));
+}
+
+Renderer::Bbox Renderer::getDrawRegion()
+{
+    // The viewport, within the scissor rectangle and the dirty rectangles' tiles.
+    Bbox region;
+    region.x_min = 0;
+    region.y_min = 0;
+    region.x_max = m_width - 1;
+    region.y_max = m_height - 1;
+    if (IsEnabled(SCISSOR_TEST))
     {
-        size_t position = 4 * i;
-        m_colorBuffer[position] = (u8)(r * 255.999f);
-        m_colorBuffer[position + 1] = (u8)(g * 255.999f);
-        m_colorBuffer[position + 2] = (u8)(b * 255.999f);
-        m_colorBuffer[position + 3] = (u8)(a * 255.999f);
+        region.x_min = ers::max(region.x_min, m_scissor.x_min);
+        region.y_min = ers::max(region.y_min, m_scissor.y_min);
+        region.x_max = ers::min(region.x_max, m_scissor.x_max);
+        region.y_max = ers::min(region.y_max, m_scissor.y_max);
     }
-    for (s32 i = 0; i < m_width * m_height; ++i) m_zBuffer[i] = 1.0f;
+    if (m_partialRedraw)
+    {
+        region.x_min = ers::max(region.x_min, m_dirtyBounds.x_min);
+        region.y_min = ers::max(region.y_min, m_dirtyBounds.y_min);
+        region.x_max = ers::min(region.x_max, m_dirtyBounds.x_max);
+        region.y_max = ers::min(region.y_max, m_dirtyBounds.y_max);
+    }
+    return region;
 }
 
 void Renderer::RenderTriangle(const void* in0, const void* in1, const void* in2)
 {
     ERS_ASSERT(m_shader != nullptr);
     m_shader->VertexShader(in0, in1, in2, m_ndcTri[0], m_ndcTri[1], m_ndcTri[2]);
-    s32 count_tris_after_clipping;
-    clipTriangle(count_tris_after_clipping);
-    for (s32 tri_idx = 0; tri_idx < count_tris_after_clipping; ++tri_idx) 
-        rasterizeTriangle(tri_idx);
+    VaryingsInfo vars_info = m_shader->GetVaryingsInfo();
+    if (vars_info.data != nullptr)
+        processTriangle(vars_info.GetVars(0), vars_info.GetVars(1), vars_info.GetVars(2));
+    else
+        processTriangle(nullptr, nullptr, nullptr);
+}
+
+void Renderer::DrawIndexed(const void* vertices, size_t stride, const s32* indices, s32 count_indices)
+{
+    ERS_ASSERT(m_shader != nullptr);
+    drawIndexed(m_shader, vertices, stride, indices, count_indices);
 }
 
-void Renderer::clipTriangle(s32& count_tris)
+void Renderer::processTriangle(const f32* vars0, const f32* vars1, const f32* vars2)
 {
-    bool should_clip = true;
-    count_tris = -1; 
+    const bool depth_only = isDepthOnlyDraw();
+    if (depth_only && IsEnabled(NO_DEPTH_WRITE)) return;
+    const s32 count_vertices = clipTriangle(vars0, vars1, vars2);
+    if (m_hiZDirty) rebuildHiZ();
+    for (s32 i = 2; i < count_vertices; ++i) // triangle fan of the clipped polygon.
+    {
+        NdcTriCoords tri;
+        if (!setupTriangle(0, i - 1, i, tri)) continue;
+        const Bbox bbox = getTriangleBoundingBox(tri);
+        if (bbox.x_min > bbox.x_max || bbox.y_min > bbox.y_max) continue;
+        if (IsEnabled(DEPTH_TEST) && isOccluded(tri, bbox)) continue;
+
+        // Deferred triangles only become visible through the depth they write, and only one of them per pixel.
+        const bool deferred = IsEnabled(DEFERRED) && (m_state & (NO_DEPTH_WRITE | MSAA | BLEND | OIT)) == 0 && !depth_only && beginDeferredDraw();
+        if (deferred) 
+            deferTriangle(tri, bbox);
 
-    ers::vec4& p0 = m_ndcTri[0];
-    ers::vec4& p1 = m_ndcTri[1];
-    ers::vec4& p2 = m_ndcTri[2];
+        if (IsEnabled(BINNING))
+        {
+            binTriangle(tri);
+        }
+        else if (deferred || depth_only)
+        {
+            (this->*m_rasterizeKernels[m_kernelIdx])(tri, bbox, nullptr);
+        }
+        else
+        {
+            m_shader->SetupTriangle(tri.vars[0], tri.vars[1], tri.vars[2]);
+            (this->*m_rasterizeKernels[m_kernelIdx])(tri, bbox, m_shader);
+        }
+    }
+}
+
+void Renderer::Flush()
+{
+    // Uniforms may change from here on, so the next deferred triangle starts a new draw.
+    m_deferredDraw = -1;
+
+    // Nothing pending: the shader isn't touched, it may not even exist anymore.
+    if (m_binnedTris.GetSize() == 0) return;
+    const bool depth_only = m_binnedDepthOnly;
+
+    // m_binnedVaryings won't grow anymore, so the offsets can be turned into pointers.
+    if (m_varyingsCount > 0)
+    {
+        for (BinnedTriangle& binned : m_binnedTris)
+        {
+            const f32* vars = &m_binnedVaryings[binned.vars_offset];
+            binned.tri.vars[0] = vars;
+            binned.tri.vars[1] = vars + m_varyingsCount;
+            binned.tri.vars[2] = vars + 2 * m_varyingsCount;
+        }
+    }
+
+    const s32 count_tiles = (s32)m_activeTiles.GetSize();
+    const s32 count_threads = m_threadPool.GetThreadCount();
+
+    // Every thread interpolates varyings into and shades with its own copy of the shader. 
+    // Writing only depth (and the visibility buffer) needs no shader at all.
+    bool can_parallelize = count_threads > 1 && count_tiles > 1;
+    if (can_parallelize && !depth_only) 
+        can_parallelize = cloneThreadShaders();
+
+    if (can_parallelize)
+    {
+        m_threadPool.Run(rasterizeBinJob, this, count_tiles);
+    }
+    else
+    {
+        for (s32 i = 0; i < count_tiles; ++i)
+            rasterizeBin(m_activeTiles[i], depth_only ? nullptr : m_shader);
+    }
+
+    releaseThreadShaders();
+    discardBins();
+}
+
+bool Renderer::cloneThreadShaders()
+{
+    for (IShaderProgram*& shader : m_threadShaders)
+    {
+        shader = m_shader->Clone(m_alloc);
+        if (shader == nullptr) return false;
+    }
+    return true;
+}
+
+void Renderer::releaseThreadShaders()
+{
+    for (IShaderProgram*& shader : m_threadShaders)
+    {
+        if (shader != nullptr)
+        {
+            shader->~IShaderProgram();
+            m_alloc->Deallocate(shader);
+            shader = nullptr;
+        }
+    }
+}
+
+void Renderer::discardBins()
+{
+    for (s32 tile_idx : m_activeTiles) 
+        m_bins[tile_idx].Clear();
+    m_activeTiles.Clear();
+    m_binnedTris.Clear();
+    m_binnedVaryings.Clear();
+}
+
+void Renderer::computeClipCodes(s32 first, s32 count)
+{
+    // Same comparisons as the early discarding in clipTriangle, bit 2 * axis for the negative and 2 * axis + 1 for the positive side.
+    const s32 count_padded = m_vertexStage.count_padded;
+    const f32* xs = &m_vertexPositions[first];
+    const f32* ys = xs + count_padded;
+    const f32* zs = ys + count_padded;
+    const f32* ws = zs + count_padded;
+    u8* codes = &m_vertexClipCodes[first];
+
+    s32 i = 0;
+#if defined(ERS_SIMD_AVX2)
+    alignas(32) s32 lanes[8];
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m256 w = _mm256_loadu_ps(ws + i);
+        const __m256 neg_w = _mm256_sub_ps(_mm256_setzero_ps(), w);
+        const __m256 p[3] = { _mm256_loadu_ps(xs + i), _mm256_loadu_ps(ys + i), _mm256_loadu_ps(zs + i) };
+        __m256i code = _mm256_setzero_si256();
+        for (s32 axis = 0; axis < 3; ++axis)
+        {
+            code = _mm256_or_si256(code, _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(p[axis], neg_w, _CMP_LT_OQ)), _mm256_set1_epi32(1 << (2 * axis))));
+            code = _mm256_or_si256(code, _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(p[axis], w, _CMP_GT_OQ)), _mm256_set1_epi32(2 << (2 * axis))));
+        }
+        _mm256_store_si256((__m256i*)lanes, code);
+        for (s32 k = 0; k < 8; ++k) codes[i + k] = (u8)lanes[k];
+    }
+#elif defined(ERS_SIMD_SSE2)
+    alignas(16) s32 lanes[4];
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128 w = _mm_loadu_ps(ws + i);
+        const __m128 neg_w = _mm_sub_ps(_mm_setzero_ps(), w);
+        const __m128 p[3] = { _mm_loadu_ps(xs + i), _mm_loadu_ps(ys + i), _mm_loadu_ps(zs + i) };
+        __m128i code = _mm_setzero_si128();
+        for (s32 axis = 0; axis < 3; ++axis)
+        {
+            code = _mm_or_si128(code, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(p[axis], neg_w)), _mm_set1_epi32(1 << (2 * axis))));
+            code = _mm_or_si128(code, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(p[axis], w)), _mm_set1_epi32(2 << (2 * axis))));
+        }
+        _mm_store_si128((__m128i*)lanes, code);
+        for (s32 k = 0; k < 4; ++k) codes[i + k] = (u8)lanes[k];
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        const f32 p[3] = { xs[i], ys[i], zs[i] };
+        u8 code = 0;
+        for (s32 axis = 0; axis < 3; ++axis)
+        {
+            if (p[axis] < -ws[i]) code |= (u8)(1 << (2 * axis));
+            if (p[axis] > ws[i]) code |= (u8)(2 << (2 * axis));
+        }
+        codes[i] = code;
+    }
+}
+
+void Renderer::binTriangle(const NdcTriCoords& tri)
+{
+    BinnedTriangle binned;
+    binned.tri = tri;
+    binned.vars_offset = m_binnedVaryings.GetSize();
+
+    // Deferred triangles only write depth (and their visibility) as well. Everything binned until the next flush
+    // belongs to the same draw, since the shader, the render target and the states can only change by flushing.
+    m_binnedDepthOnly = (m_deferredDraw >= 0) || isDepthOnlyDraw();
+    m_varyingsCount = 0;
+    if (tri.vars[0] != nullptr && !m_binnedDepthOnly) // writing only depth doesn't need them.
+    {
+        m_varyingsCount = m_shader->GetVaryingsInfo().count;
+        for (s32 k = 0; k < 3; ++k)
+            for (s32 i = 0; i < m_varyingsCount; ++i)
+                m_binnedVaryings.PushBack(tri.vars[k][i]);
+    }
+
+    const u32 tri_idx = (u32)m_binnedTris.GetSize();
+    m_binnedTris.PushBack(binned);
+
+    // Primitive order is preserved in every bin, since triangles are only ever appended.
+    const Bbox bbox = getTriangleBoundingBox(tri);
+    for (s32 ty = bbox.y_min / ERS_RENDERER_TILE_SIZE; ty <= bbox.y_max / ERS_RENDERER_TILE_SIZE; ++ty)
+    {
+        for (s32 tx = bbox.x_min / ERS_RENDERER_TILE_SIZE; tx <= bbox.x_max / ERS_RENDERER_TILE_SIZE; ++tx)
+        {
+            const s32 tile_idx = ty * ERS_RENDERER_MAX_TILES_X + tx;
+            if (!isTileDrawn(tile_idx)) continue;
+            if (m_bins[tile_idx].GetSize() == 0) 
+                m_activeTiles.PushBack(tile_idx);
+            m_bins[tile_idx].PushBack(tri_idx);
+        }
+    }
+}
+
+void Renderer::rasterizeBinJob(void* data, s32 item, s32 thread_idx)
+{
+    Renderer* renderer = (Renderer*)data;
+    renderer->rasterizeBin(renderer->m_activeTiles[item], renderer->m_threadShaders[thread_idx]);
+}
+
+void Renderer::rasterizeBin(s32 tile_idx, IShaderProgram* shader)
+{
+    const Bbox tile = getTileRect(tile_idx);
+    const ers::Vector<u32>& bin = m_bins[tile_idx];
+    const s32 count = (s32)bin.GetSize();
+    for (s32 i = 0; i < count; ++i)
+    {
+        const NdcTriCoords& tri = m_binnedTris[bin[i]].tri;
+        Bbox bbox = getTriangleBoundingBox(tri);
+        bbox.x_min = ers::max(bbox.x_min, tile.x_min);
+        bbox.y_min = ers::max(bbox.y_min, tile.y_min);
+        bbox.x_max = ers::min(bbox.x_max, tile.x_max);
+        bbox.y_max = ers::min(bbox.y_max, tile.y_max);
+
+        if (shader != nullptr)
+            shader->SetupTriangle(tri.vars[0], tri.vars[1], tri.vars[2]);
+        (this->*m_rasterizeKernels[m_kernelIdx])(tri, bbox, shader);
+    }
+}
+
+s32 Renderer::clipTriangle(const f32* vars0, const f32* vars1, const f32* vars2)
+{
+    const ers::vec4& p0 = m_ndcTri[0];
+    const ers::vec4& p1 = m_ndcTri[1];
+    const ers::vec4& p2 = m_ndcTri[2];
     
-    // Lazy early discarding of triangles that are completely behind (one of) the clip planes.
-    // TODO: Actual full frustum culling.
+    // Early discarding of triangles that are completely behind one of the clip planes.
     if (
         (p0.x() < -p0.w() && p1.x() < -p1.w() && p2.x() < -p2.w())
      || (p0.x() >  p0.w() && p1.x() >  p1.w() && p2.x() >  p2.w())
@@ -150,201 +828,670 @@ void Renderer::clipTriangle(s32& count_tris)
      || (p0.z() >  p0.w() && p1.z() >  p1.w() && p2.z() >  p2.w())
     ) 
     {
-        should_clip = false;
-        count_tris = 0;
+        return 0;
     }
-    
-    // No need to clip if in front of z plane, just discard fragments/triangles in the rasterizer.
-    if (should_clip && p0.z() > -p0.w() && p1.z() > -p1.w() && p2.z() > -p2.w()) 
+
+    VaryingsInfo vars_info = m_shader->GetVaryingsInfo();
+    const s32 vars_count = (vars_info.data != nullptr) ? vars_info.count : 0;
+    const s32 vars_count_flat = (vars_info.data != nullptr) ? vars_info.count_flat : 0;
+    ERS_ASSERT(vars_count <= ERS_RENDERER_MAX_VARYINGS);
+
+    s32 count = 3;
+    const f32* vars_tri[3] = { vars0, vars1, vars2 };
+    for (s32 i = 0; i < 3; ++i)
     {
-        should_clip = false;
-        count_tris = 1;
+        m_clipPositions[i] = m_ndcTri[i];
+        m_clipVars[i] = (vars_count > 0) ? vars_tri[i] : nullptr;
     }
 
-    // At least one vertex is behind the near z-plane, so we clip the triangle.
-    if (should_clip) 
+    // Sutherland-Hodgman against the near plane and the guard band planes, skipping the planes all vertices are in front of,
+    // i.e. usually all of them. Triangles partly outside of the viewport but within the guard band are left to the rasterizer.
+    s32 count_new = 0;
+    for (s32 plane = 0; plane < 5; ++plane)
     {
-        bool is_behind[3] = { false };
-        s32 how_many_behind = 0;
-        for (s32 i = 0; i < 3; ++i)
+        f32 dist[ERS_RENDERER_MAX_CLIP_VERTICES];
+        bool is_clipped = false;
+        for (s32 i = 0; i < count; ++i)
         {
-            if (m_ndcTri[i].z() < -m_ndcTri[i].w()) 
-            { 
-                is_behind[i] = true; 
-                ++how_many_behind; 
-            }
+            dist[i] = getClipDistance(m_clipPositions[i], plane);
+            is_clipped = is_clipped || (dist[i] < 0.0f);
         }
-        ERS_ASSERT(how_many_behind == 1 || how_many_behind == 2);
-
-        VaryingsInfo vars_info = m_shader->GetVaryingsInfo();
-        const s32 vars_count = vars_info.count;
-        s32 idx0, idx1, idx2;    
-        if (how_many_behind == 1) // one point behind clip-plane = quad case/2 new triangles
-        {                 
-            if (is_behind[0])
-            {               
-                idx0 = 0; idx1 = 1; idx2 = 2;
-            }
-            else if (is_behind[1])
+        if (!is_clipped) continue;
+
+        ers::vec4 positions[ERS_RENDERER_MAX_CLIP_VERTICES];
+        const f32* vars[ERS_RENDERER_MAX_CLIP_VERTICES];
+        s32 count_clipped = 0;
+        for (s32 i = 0; i < count; ++i)
+        {
+            const s32 j = (i + 1 < count) ? i + 1 : 0;
+            if (dist[i] >= 0.0f)
             {
-                idx0 = 1; idx1 = 2; idx2 = 0;
+                positions[count_clipped] = m_clipPositions[i];
+                vars[count_clipped] = m_clipVars[i];
+                ++count_clipped;
             }
-            else if (is_behind[2])
-            {                
-                idx0 = 2; idx1 = 0; idx2 = 1;
+            if ((dist[i] >= 0.0f) != (dist[j] >= 0.0f))
+            {
+                // Always interpolate from the inside vertex, so that neighbouring triangles get the exact same new vertex.
+                const s32 in = (dist[i] >= 0.0f) ? i : j;
+                const s32 out = (dist[i] >= 0.0f) ? j : i;
+                const f32 t = dist[in] / (dist[in] - dist[out]);
+                ERS_ASSERT(count_clipped < ERS_RENDERER_MAX_CLIP_VERTICES && count_new < ERS_RENDERER_MAX_CLIP_VERTICES);
+                positions[count_clipped] = (1.0f - t) * m_clipPositions[in] + t * m_clipPositions[out];
+                vars[count_clipped] = nullptr;
+                if (vars_count > 0)
+                {
+                    f32* vars_new = &m_clipVaryings[count_new * ERS_RENDERER_MAX_VARYINGS];
+                    lerpVaryings(vars_new, m_clipVars[in], m_clipVars[out], t, vars_count - vars_count_flat);
+                    copyFlatVaryings(vars_new, vars0, vars_count, vars_count_flat);
+                    vars[count_clipped] = vars_new;
+                    ++count_new;
+                }
+                ++count_clipped;
             }
+        }
 
-            if (vars_info.data != nullptr)
-            {             
-                f32 t0, t1; 
-                clipGetTwoTriangles(m_ndcTri[idx0], m_ndcTri[idx1], m_ndcTri[idx2], m_ndcTri[3], m_ndcTri[4], m_ndcTri[5], t0, t1);
-                f32* vars00 = vars_info.GetVars(0, idx0);
-                f32* vars01 = vars_info.GetVars(0, idx1);
-                f32* vars02 = vars_info.GetVars(0, idx2);
-                f32* vars10 = vars_info.GetVars(1, 0);
-                lerpVaryings(vars10, vars00, vars01, t1, vars_count);
-                lerpVaryings(vars00, vars00, vars02, t0, vars_count);
-                vars_info.SetSecondTriangleIndices(3, idx1, idx0);
-            }
+        count = count_clipped;
+        if (count < 3) return 0;
+        for (s32 i = 0; i < count; ++i)
+        {
+            m_clipPositions[i] = positions[i];
+            m_clipVars[i] = vars[i];
         }
-        else if (how_many_behind == 2) // two points behind clip-plane = 1 new triangle
-        {         
-            if (is_behind[0] && is_behind[1])
-            {  
-                idx0 = 0; idx1 = 1; idx2 = 2;
-            }
-            else if (is_behind[1] && is_behind[2])
-            {
-                idx0 = 1; idx1 = 2; idx2 = 0;
-            }
-            else if (is_behind[2] && is_behind[0])
+    }
+
+    // The first vertex of the polygon is the first one of all the triangles of its fan, so it has to carry the flat 
+    // varyings of the triangle's first vertex, even if that one got clipped away.
+    if (vars_count_flat > 0 && (m_clipVars[0] == vars1 || m_clipVars[0] == vars2))
+    {
+        f32* vars_first = &m_clipVaryings[count_new * ERS_RENDERER_MAX_VARYINGS];
+        memcpy(vars_first, m_clipVars[0], vars_count * sizeof(f32));
+        copyFlatVaryings(vars_first, vars0, vars_count, vars_count_flat);
+        m_clipVars[0] = vars_first;
+    }
+
+    for (s32 i = 0; i < count; ++i)
+        normalizeCoordinates(m_clipPositions[i]);
+
+    return count;
+}
+
+f32 Renderer::getClipDistance(const ers::vec4& p, s32 plane)
+{
+    // The guard band in clip space: (0.5 + 0.5 * x / w) * width <= GUARD_BAND <=> x <= (2 * GUARD_BAND / width - 1) * w, 
+    // which also keeps x >= width - GUARD_BAND >= -GUARD_BAND on the other side.
+    const f32 guard_band_x = 2.0f * (f32)ERS_RENDERER_GUARD_BAND / (f32)m_width - 1.0f;
+    const f32 guard_band_y = 2.0f * (f32)ERS_RENDERER_GUARD_BAND / (f32)m_height - 1.0f;
+    switch (plane)
+    {
+        case 0: return p.z() + p.w(); // near plane.
+        case 1: return guard_band_x * p.w() + p.x();
+        case 2: return guard_band_x * p.w() - p.x();
+        case 3: return guard_band_y * p.w() + p.y();
+        default: return guard_band_y * p.w() - p.y();
+    }
+}
+
+bool Renderer::setupTriangle(s32 idx0, s32 idx1, s32 idx2, NdcTriCoords& tri)
+{
+    tri = getNdcTriCoords(m_clipPositions[idx0], m_clipPositions[idx1], m_clipPositions[idx2]);
+    tri.id = ERS_RENDERER_VIS_EMPTY;
+
+    if (tri.surface == 0) return false; // degenerate triangle. Ignore.
+    if (IsEnabled(CULL_FACE) && tri.surface < 0) return false; // Backface culling.
+
+    // No pixel centers in the triangle's bounding box (or it's outside of the viewport).
+    const Bbox bbox = getTriangleBoundingBox(tri);
+    if (bbox.x_min > bbox.x_max || bbox.y_min > bbox.y_max) return false;
+
+    tri.vars[0] = m_clipVars[idx0];
+    tri.vars[1] = m_clipVars[idx1];
+    tri.vars[2] = m_clipVars[idx2];
+
+    return true;
+}
+
+void Renderer::setupRasterContext(RasterContext& ctx, const NdcTriCoords& tri, s32 x0, s32 y0, IShaderProgram* shader)
+{
+    ctx.tri = &tri;
+    ctx.shader = shader;
+    ctx.depth_only = (shader == nullptr);
+    ctx.vars_info = ctx.depth_only ? VaryingsInfo{ nullptr, nullptr, 0, 0 } : shader->GetVaryingsInfo();
+    ctx.packet = !ctx.depth_only && !IsEnabled(MSAA) && shader->HasPacketShader();
+    ctx.depth_written = false;
+    ctx.coarse_width = ctx.coarse_height = 1;
+    if (!ctx.depth_only && !IsEnabled(MSAA) && !IsEnabled(WIREFRAME))
+    {
+        static const s32 s_rateSizes[][2] = { { 1, 1 }, { 2, 1 }, { 2, 2 }, { 4, 4 } };
+        ctx.coarse_width = s_rateSizes[m_shadingRate][0];
+        ctx.coarse_height = s_rateSizes[m_shadingRate][1];
+    }
+
+    EdgeFunctions& edges = ctx.edges;
+    edges.x0 = x0;
+    edges.y0 = y0;
+
+    // Initialize the barycentric weights at the center of the pixel (x0, y0),...    
+    edges.weights0 = tri.a * x0 + tri.b * y0 + tri.c;
+
+    // ...and the step values, for rows and columns respectively.  
+    edges.wstepx = tri.a;
+    edges.wstepy = tri.b;
+ 
+    edges.weights_frac = tri.frac;
+    edges.tri_surface_inv = tri.surface_inv; 
+
+    // At a sample (sx, sy) subpixels off the pixel center, the edge function is STEPS * weight + r + a * sx + b * sy,
+    // with r in [0, STEPS) what the weight got rounded down by, fill rule bias included (see getNdcTriCoords).
+    // It's >= 0 exactly when weight + ((r + a * sx + b * sy) >> SUBPIXEL_BITS) is.
+    edges.sample_min = ers::ivec3(0, 0, 0);
+    edges.sample_max = ers::ivec3(0, 0, 0);
+    if (IsEnabled(MSAA))
+    {
+        for (s32 k = 0; k < 3; ++k)
+        {
+            const s32 bias = (tri.a.e[k] > 0 || (tri.a.e[k] == 0 && tri.b.e[k] > 0)) ? 0 : -1;
+            const s32 r = (s32)(tri.frac.e[k] * (f32)ERS_RENDERER_SUBPIXEL_STEPS) + bias;
+            for (s32 s = 0; s < ERS_RENDERER_MSAA_SAMPLES; ++s)
             {
-                idx0 = 2; idx1 = 0; idx2 = 1;
+                const s32 shift = (r + tri.a.e[k] * s_sampleOffsets[s][0] + tri.b.e[k] * s_sampleOffsets[s][1]) >> ERS_RENDERER_SUBPIXEL_BITS;
+                edges.sample_shifts[s].e[k] = shift;
+                edges.sample_min.e[k] = (s == 0) ? shift : ers::min(edges.sample_min.e[k], shift);
+                edges.sample_max.e[k] = (s == 0) ? shift : ers::max(edges.sample_max.e[k], shift);
             }
+        }
+    }
+
+    setupVaryingPlanes(ctx);
+    setupDepthPlane(ctx);
+}
+
+void Renderer::setupVaryingPlanes(RasterContext& ctx)
+{
+    const VaryingsInfo& vars_info = ctx.vars_info;
+    if (vars_info.data == nullptr) return;
+    ERS_ASSERT(vars_info.count <= ERS_RENDERER_MAX_VARYINGS);
+
+    // With bar_k = (weight_k + frac_k) * tri_surface_inv linear in screen space, so is sum_k(bar_k * var_k / w_k), 
+    // so its gradients follow from the steps of the weights.
+    const NdcTriCoords& tri = *ctx.tri;
+    const EdgeFunctions& edges = ctx.edges;
+    VaryingPlanes& planes = ctx.planes;
+    const ers::vec3 w0 = ers::vec3((f32)edges.weights0.x(), (f32)edges.weights0.y(), (f32)edges.weights0.z()) + edges.weights_frac;
+    const ers::vec3 sx((f32)edges.wstepx.x(), (f32)edges.wstepx.y(), (f32)edges.wstepx.z());
+    const ers::vec3 sy((f32)edges.wstepy.x(), (f32)edges.wstepy.y(), (f32)edges.wstepy.z());
+    const ers::vec3 inv_w = edges.tri_surface_inv * ers::vec3(tri.p0.w(), tri.p1.w(), tri.p2.w());
+    const s32 count_interpolated = vars_info.GetInterpolatedCount();
+    for (s32 i = 0; i < count_interpolated; ++i)
+    {
+        const ers::vec3 q(tri.vars[0][i] * inv_w.x(), tri.vars[1][i] * inv_w.y(), tri.vars[2][i] * inv_w.z());
+        planes.base[i] = ers::dot(w0, q);
+        planes.dx[i] = ers::dot(sx, q);
+        planes.dy[i] = ers::dot(sy, q);
+        planes.current[i] = planes.base[i];
+    }
+    planes.cur_x = edges.x0;
+    planes.cur_y = edges.y0;
+
+    // Flat varyings are the same for the whole triangle.
+    for (s32 i = count_interpolated; i < vars_info.count; ++i)
+        vars_info.data_interpolated[i] = tri.vars[0][i];
+}
+
+void Renderer::stepVaryingPlanes(RasterContext& ctx, s32 x, s32 y)
+{
+    VaryingPlanes& planes = ctx.planes;
+    const s32 count = ctx.vars_info.GetInterpolatedCount();
+    if (y == planes.cur_y && x == planes.cur_x + 1)
+    {
+        for (s32 i = 0; i < count; ++i) planes.current[i] += planes.dx[i];
+    }
+    else if (y == planes.cur_y)
+    {
+        const f32 n = (f32)(x - planes.cur_x);
+        for (s32 i = 0; i < count; ++i) planes.current[i] += n * planes.dx[i];
+    }
+    else
+    {
+        const f32 nx = (f32)(x - ctx.edges.x0);
+        const f32 ny = (f32)(y - ctx.edges.y0);
+        for (s32 i = 0; i < count; ++i) planes.current[i] = planes.base[i] + nx * planes.dx[i] + ny * planes.dy[i];
+    }
+    planes.cur_x = x;
+    planes.cur_y = y;
+}
+
+void Renderer::setupDepthPlane(RasterContext& ctx)
+{
+    // Same as the per-fragment z = 0.5 * dot(bar, (z0, z1, z2)) + 0.5, written as a function of the pixel position.
+    const NdcTriCoords& tri = *ctx.tri;
+    const EdgeFunctions& edges = ctx.edges;
+    DepthPlane& depth = ctx.depth;
+    const ers::vec3 z = 0.5f * edges.tri_surface_inv * ers::vec3(tri.p0.z(), tri.p1.z(), tri.p2.z());
+    depth.z0 = ers::dot(ers::vec3((f32)edges.weights0.x(), (f32)edges.weights0.y(), (f32)edges.weights0.z()) + edges.weights_frac, z) + 0.5f;
+    depth.dx = ers::dot(ers::vec3((f32)edges.wstepx.x(), (f32)edges.wstepx.y(), (f32)edges.wstepx.z()), z);
+    depth.dy = ers::dot(ers::vec3((f32)edges.wstepy.x(), (f32)edges.wstepy.y(), (f32)edges.wstepy.z()), z);
+    depth.z_min = 0.5f * ers::min(tri.p0.z(), ers::min(tri.p1.z(), tri.p2.z())) + 0.5f;
+    for (s32 s = 0; s < ERS_RENDERER_MSAA_SAMPLES; ++s)
+    {
+        const f32 ox = (f32)s_sampleOffsets[s][0] / (f32)ERS_RENDERER_SUBPIXEL_STEPS;
+        const f32 oy = (f32)s_sampleOffsets[s][1] / (f32)ERS_RENDERER_SUBPIXEL_STEPS;
+        depth.sample_dz[s] = depth.dx * ox + depth.dy * oy;
+    }
+}
+
+f32 Renderer::getBlockMinDepth(const RasterContext& ctx, const Bbox& block, f32 margin)
+{
+    // A plane's minimum over a rectangle is at one of its corners. The part of the triangle in the block
+    // can't be nearer than that, nor nearer than the triangle's nearest vertex.
+    // The epsilon covers the rounding differences to the per-fragment depth. 
+    // margin extends the block's pixel centers, e.g. to cover MSAA samples.
+    const DepthPlane& depth = ctx.depth;
+    const f32 dx0 = depth.dx * ((f32)(block.x_min - ctx.edges.x0) - margin);
+    const f32 dx1 = depth.dx * ((f32)(block.x_max - ctx.edges.x0) + margin);
+    const f32 dy0 = depth.dy * ((f32)(block.y_min - ctx.edges.y0) - margin);
+    const f32 dy1 = depth.dy * ((f32)(block.y_max - ctx.edges.y0) + margin);
+    const f32 z_min = depth.z0 + ers::min(dx0, dx1) + ers::min(dy0, dy1);
+    return ers::max(z_min, depth.z_min) - ERS_RENDERER_EPSILON;
+}
+
+bool Renderer::isOccluded(const NdcTriCoords& tri, const Bbox& bbox)
+{
+    f32 hi_z = 0.0f;
+    for (s32 by = bbox.y_min / ERS_RENDERER_BLOCK_SIZE; by <= bbox.y_max / ERS_RENDERER_BLOCK_SIZE; ++by)
+        for (s32 bx = bbox.x_min / ERS_RENDERER_BLOCK_SIZE; bx <= bbox.x_max / ERS_RENDERER_BLOCK_SIZE; ++bx)
+            hi_z = ers::max(hi_z, m_hiZBuffer[by * ERS_RENDERER_HIZ_MAX_X + bx]);
+
+    const f32 z_min = 0.5f * ers::min(tri.p0.z(), ers::min(tri.p1.z(), tri.p2.z())) + 0.5f;
+    return z_min - ERS_RENDERER_EPSILON > hi_z;
+}
+
+void Renderer::updateHiZ(s32 block_x, s32 block_y)
+{
+    const s32 x_min = block_x * ERS_RENDERER_BLOCK_SIZE;
+    const s32 y_min = block_y * ERS_RENDERER_BLOCK_SIZE;
+    const s32 tile_idx = (y_min / ERS_RENDERER_TILE_SIZE) * ERS_RENDERER_MAX_TILES_X + x_min / ERS_RENDERER_TILE_SIZE;
+    if ((m_tileClears[tile_idx] & CLEAR_DEPTH) != 0)
+    {
+        m_hiZBuffer[block_y * ERS_RENDERER_HIZ_MAX_X + block_x] = ERS_RENDERER_CLEAR_DEPTH;
+        return;
+    }
+
+    const s32 x_max = ers::min(x_min + ERS_RENDERER_BLOCK_SIZE, m_width);
+    const s32 y_max = ers::min(y_min + ERS_RENDERER_BLOCK_SIZE, m_height);
 
-            if (vars_info.data != nullptr)
+    f32 hi_z = 0.0f;
+    for (s32 y = y_min; y < y_max; ++y)
+    {
+        const f32* row = &m_zBuffer[y * m_width];
+        for (s32 x = x_min; x < x_max; ++x) 
+            hi_z = (row[x] > hi_z) ? row[x] : hi_z;
+    }
+    m_hiZBuffer[block_y * ERS_RENDERER_HIZ_MAX_X + block_x] = hi_z;
+}
+
+void Renderer::rebuildHiZ()
+{
+    const s32 count_blocks_x = (m_width + ERS_RENDERER_BLOCK_SIZE - 1) / ERS_RENDERER_BLOCK_SIZE;
+    const s32 count_blocks_y = (m_height + ERS_RENDERER_BLOCK_SIZE - 1) / ERS_RENDERER_BLOCK_SIZE;
+    for (s32 by = 0; by < count_blocks_y; ++by)
+        for (s32 bx = 0; bx < count_blocks_x; ++bx)
+            updateHiZ(bx, by);
+    m_hiZDirty = false;
+}
+
+void Renderer::clearTile(s32 tile_idx, u8 flags)
+{
+    const Bbox tile = getTileRect(tile_idx);
+    const s32 count = tile.x_max - tile.x_min + 1;
+    u32 depth;
+    const f32 clear_depth = ERS_RENDERER_CLEAR_DEPTH;
+    memcpy(&depth, &clear_depth, sizeof(depth));
+
+    flags &= m_tileClears[tile_idx];
+    for (s32 y = tile.y_min; y <= tile.y_max && count > 0; ++y)
+    {
+        const size_t position = y * m_width + tile.x_min;
+        if ((flags & CLEAR_COLOR) != 0) fillValues((u32*)m_colorBuffer + position, m_clearColor, count);
+        if ((flags & CLEAR_DEPTH) != 0) fillValues((u32*)m_zBuffer + position, depth, count);
+        if (IsEnabled(MSAA)) clearSamples(position, count, flags);
+    }
+    m_tileClears[tile_idx] &= ~flags;
+}
+
+void Renderer::prepareBuffers(u8 flags)
+{
+    const s32 count_tiles_x = (m_width + ERS_RENDERER_TILE_SIZE - 1) / ERS_RENDERER_TILE_SIZE;
+    const s32 count_tiles_y = (m_height + ERS_RENDERER_TILE_SIZE - 1) / ERS_RENDERER_TILE_SIZE;
+    u8 pending_all = flags;
+    u8 pending_any = CLEAR_NONE;
+    for (s32 ty = 0; ty < count_tiles_y; ++ty)
+    {
+        for (s32 tx = 0; tx < count_tiles_x; ++tx)
+        {
+            pending_all &= m_tileClears[ty * ERS_RENDERER_MAX_TILES_X + tx];
+            pending_any |= m_tileClears[ty * ERS_RENDERER_MAX_TILES_X + tx];
+        }
+    }
+    if ((pending_any & flags) == 0) return;
+
+    // Buffers nothing was drawn to since the clear are filled in one go instead of tile by tile.
+    if (pending_all != CLEAR_NONE)
+    {
+        u32 depth;
+        const f32 clear_depth = ERS_RENDERER_CLEAR_DEPTH;
+        memcpy(&depth, &clear_depth, sizeof(depth));
+        if ((pending_all & CLEAR_COLOR) != 0) fillValues((u32*)m_colorBuffer, m_clearColor, m_width * m_height);
+        if ((pending_all & CLEAR_DEPTH) != 0) fillValues((u32*)m_zBuffer, depth, m_width * m_height);
+        if (IsEnabled(MSAA)) clearSamples(0, m_width * m_height, pending_all);
+        for (s32 ty = 0; ty < count_tiles_y; ++ty)
+            for (s32 tx = 0; tx < count_tiles_x; ++tx)
+                m_tileClears[ty * ERS_RENDERER_MAX_TILES_X + tx] &= ~pending_all;
+    }
+
+    for (s32 ty = 0; ty < count_tiles_y; ++ty)
+        for (s32 tx = 0; tx < count_tiles_x; ++tx)
+            prepareTile(ty * ERS_RENDERER_MAX_TILES_X + tx, flags);
+}
+
+void Renderer::rasterizeDepthBlock(RasterContext& ctx, const Bbox& block, bool depth_test)
+{
+    const EdgeFunctions& edges = ctx.edges;
+    if (classifyBlock(edges, block) == BlockCoverage::OUTSIDE) return;
+
+    // Whole screen aligned rows of the block are loaded and stored, which only ever touches pixels 
+    // of the same tile. Lanes outside of block (i.e. the bounding box) are masked out.
+    const NdcTriCoords& tri = *ctx.tri;
+    const ers::vec3 pz(tri.p0.z(), tri.p1.z(), tri.p2.z());
+    const s32 x_start = block.x_min & ~(ERS_RENDERER_BLOCK_SIZE - 1);
+    for (s32 y = block.y_min; y <= block.y_max; ++y)
+    {
+        CoverageStepper coverage(edges.GetWeights(x_start, y), edges.wstepx);
+        for (s32 x = x_start; x < x_start + ERS_RENDERER_BLOCK_SIZE; x += ERS_RENDERER_LANES)
+        {
+            const s32 lane_min = ers::max(block.x_min - x, 0);
+            const s32 lane_max = ers::min(block.x_max - x, ERS_RENDERER_LANES - 1);
+            if (lane_min <= lane_max)
             {
-                f32 t0, t1;
-                clipGetOneTriangle(m_ndcTri[idx0], m_ndcTri[idx1], m_ndcTri[idx2], t0, t1);
-                f32* vars00 = vars_info.GetVars(0, idx0);
-                f32* vars01 = vars_info.GetVars(0, idx1);
-                f32* vars02 = vars_info.GetVars(0, idx2);
-                lerpVaryings(vars00, vars00, vars02, t0, vars_count);
-                lerpVaryings(vars01, vars01, vars02, t1, vars_count);
+                u32 mask = coverage.GetMask();
+                mask &= ((1u << (lane_max + 1)) - 1u) & ~((1u << lane_min) - 1u);
+                const size_t position = y * m_width + x;
+                u32* ids = (tri.id != ERS_RENDERER_VIS_EMPTY) ? &m_visBuffer[position] : nullptr;
+                if (coverage.WriteDepth(edges.tri_surface_inv, edges.weights_frac, pz, mask, depth_test, &m_zBuffer[position], ids, tri.id) != 0)
+                    ctx.depth_written = true;
             }
+            coverage.Step();
+        }
+    }
+}
+
+Renderer::BlockCoverage Renderer::classifyBlock(const EdgeFunctions& edges, const Bbox& block)
+{
+    // The weights are linear, so their extremes over the block are found at its corner pixels. 
+    // Testing these gives the same answer as testing every pixel (every sample, with the extremes of the sample shifts).
+    const ers::ivec3 w00 = edges.GetWeights(block.x_min, block.y_min);
+    const ers::ivec3 w10 = w00 + edges.wstepx * (block.x_max - block.x_min);
+    const ers::ivec3 w01 = w00 + edges.wstepy * (block.y_max - block.y_min);
+    const ers::ivec3 w11 = w10 + edges.wstepy * (block.y_max - block.y_min);
+
+    bool all_inside = true;
+    for (s32 k = 0; k < 3; ++k)
+    {
+        const s32 s_max = edges.sample_max.e[k];
+        const s32 s_min = edges.sample_min.e[k];
+        if (w00.e[k] + s_max < 0 && w10.e[k] + s_max < 0 && w01.e[k] + s_max < 0 && w11.e[k] + s_max < 0) return BlockCoverage::OUTSIDE;
+        if (w00.e[k] + s_min < 0 || w10.e[k] + s_min < 0 || w01.e[k] + s_min < 0 || w11.e[k] + s_min < 0) all_inside = false;
+    }
+    return all_inside ? BlockCoverage::INSIDE : BlockCoverage::PARTIAL;
+}
+
+f32 Renderer::getPerspectiveBarycentrics(const NdcTriCoords& tri, const ers::vec3& bar, ers::vec3& bar_correct)
+{
+    bar_correct.x() = bar.x() * tri.p0.w();
+    bar_correct.y() = bar.y() * tri.p1.w();
+    bar_correct.z() = bar.z() * tri.p2.w();
+    const f32 w = 1.0f / (bar_correct.x() + bar_correct.y() + bar_correct.z()); // the fragment's w.
+    bar_correct *= w;
+    return w;
+}
+
+bool Renderer::beginDeferredDraw()
+{
+    if (m_deferredDraw == -1)
+    {
+        // The first triangle of a draw: keep a copy of the shader with its current uniforms around for shading.
+        DeferredDraw draw;
+        draw.shader = m_shader->Clone(m_alloc);
+        draw.varyings_count = m_shader->GetVaryingsInfo().count;
+        if (draw.shader != nullptr)
+        {
+            m_deferredDraw = (s32)m_deferredDraws.GetSize();
+            m_deferredDraws.PushBack(draw);
         }
+        else
+        {
+            m_deferredDraw = -2;
+        }
+    }
+    return m_deferredDraw >= 0;
+}
 
-        count_tris = (how_many_behind == 2) ? 1 : 2;
+void Renderer::deferTriangle(NdcTriCoords& tri, const Bbox& bbox)
+{
+    // Only these tiles are resolved, the others keep their pending clears (see resolveVisibility).
+    for (s32 ty = bbox.y_min / ERS_RENDERER_TILE_SIZE; ty <= bbox.y_max / ERS_RENDERER_TILE_SIZE; ++ty)
+        for (s32 tx = bbox.x_min / ERS_RENDERER_TILE_SIZE; tx <= bbox.x_max / ERS_RENDERER_TILE_SIZE; ++tx)
+            m_tileDeferred[ty * ERS_RENDERER_MAX_TILES_X + tx] = 1;
+
+    DeferredTriangle deferred;
+    deferred.vars_offset = m_deferredVaryings.GetSize();
+    deferred.draw_idx = m_deferredDraw;
+    if (tri.vars[0] != nullptr)
+    {
+        const s32 count = m_deferredDraws[m_deferredDraw].varyings_count;
+        for (s32 k = 0; k < 3; ++k)
+            for (s32 i = 0; i < count; ++i)
+                m_deferredVaryings.PushBack(tri.vars[k][i]);
     }
+
+    tri.id = (u32)m_deferredTris.GetSize();
+    deferred.tri = tri;
+    m_deferredTris.PushBack(deferred);
 }
 
-void Renderer::rasterizeTriangle(s32 tri_idx)
-{   
-    s32 base = 3 * tri_idx;
-    ers::vec4& p0 = m_ndcTri[base];
-    ers::vec4& p1 = m_ndcTri[base + 1];
-    ers::vec4& p2 = m_ndcTri[base + 2];
-    normalizeCoordinates(p0);
-    normalizeCoordinates(p1);
-    normalizeCoordinates(p2);        
+void Renderer::clearVisibility()
+{
+    const s32 count = m_width * m_height;
+    if (m_visBuffer.GetSize() < (size_t)count) m_visBuffer.Resize(count);
+    fillValues(&m_visBuffer[0], ERS_RENDERER_VIS_EMPTY, count);
+}
+
+void Renderer::resolveVisibility()
+{
+    if (m_deferredTris.GetSize() == 0) 
+    {
+        discardVisibility();
+        return;
+    }
 
-    NdcTriCoords tri = getNdcTriCoords(p0, p1, p2);
+    // m_deferredVaryings won't grow anymore, so the offsets can be turned into pointers.
+    for (DeferredTriangle& deferred : m_deferredTris)
+    {
+        if (deferred.tri.vars[0] == nullptr) continue;
+        const s32 count = m_deferredDraws[deferred.draw_idx].varyings_count;
+        const f32* vars = &m_deferredVaryings[deferred.vars_offset];
+        deferred.tri.vars[0] = vars;
+        deferred.tri.vars[1] = vars + count;
+        deferred.tri.vars[2] = vars + 2 * count;
+    }
 
-    if (tri.surface == 0) return; // degenerate triangle. Ignore.
-    if (IsEnabled(CULL_FACE) && tri.surface < 0) return; // Backface culling.
-    
-    Bbox bbox = getTriangleBoundingBox(tri);
+    // The calling thread shades with the draws' shaders, every other thread with its own copies of them,
+    // made here since the allocator isn't necessarily thread-safe.
+    const s32 count_draws = (s32)m_deferredDraws.GetSize();
+    bool can_parallelize = m_threadPool.GetThreadCount() > 1;
+    for (s32 t = 1; t < m_threadPool.GetThreadCount() && can_parallelize; ++t)
+    {
+        for (s32 i = 0; i < count_draws && can_parallelize; ++i)
+        {
+            IShaderProgram* shader = m_deferredDraws[i].shader->Clone(m_alloc);
+            m_resolveShaders.PushBack(shader);
+            can_parallelize = (shader != nullptr);
+        }
+    }
 
-    // ******************************************************
-    // Rasterizing kernel. Should be easily(?) parallelizable.
-    // TODO: Parallelize it!
+    const s32 count_tiles_x = (m_width + ERS_RENDERER_TILE_SIZE - 1) / ERS_RENDERER_TILE_SIZE;
+    const s32 count_tiles_y = (m_height + ERS_RENDERER_TILE_SIZE - 1) / ERS_RENDERER_TILE_SIZE;
+    m_activeTiles.Clear();
+    for (s32 ty = 0; ty < count_tiles_y; ++ty)
+    {
+        for (s32 tx = 0; tx < count_tiles_x; ++tx)
+        {
+            if (m_tileDeferred[ty * ERS_RENDERER_MAX_TILES_X + tx] != 0)
+                m_activeTiles.PushBack(ty * ERS_RENDERER_MAX_TILES_X + tx);
+        }
+    }
+    if (can_parallelize)
+    {
+        m_threadPool.Run(resolveTileJob, this, (s32)m_activeTiles.GetSize());
+    }
+    else
+    {
+        for (s32 tile_idx : m_activeTiles)
+            resolveTile(tile_idx, 0);
+    }
+    m_activeTiles.Clear();
 
-    // Initialize barycentric coordinates at the center of the 1st position in the bounding box, 
-    // normalized to double the above calculated signed surface (4 times the triangle surface),...    
-    ers::ivec3 weights0 = getWeights0(tri, bbox.x_min, bbox.y_min);
+    discardVisibility();
+}
 
-    // ...and calculate step values, for rows and columns respectively.  
-    const ers::ivec3 wstepx(2 * tri.d12.y(), 2 * tri.d20.y(), 2 * tri.d01.y());
-    const ers::ivec3 wstepy(2 * tri.d12.x(), 2 * tri.d20.x(), 2 * tri.d01.x());
- 
-    const f32 tri_surface_inv = 1.0f / (f32)(2 * tri.surface); 
-    ers::ivec3 weights;
-    for (s32 y = bbox.y_min; y <= bbox.y_max; ++y)
+void Renderer::discardVisibility()
+{
+    for (IShaderProgram*& shader : m_resolveShaders)
     {
-        weights = weights0;       
-        for (s32 x = bbox.x_min; x <= bbox.x_max; ++x)
+        if (shader != nullptr)
         {
-            // Check if point is in triangle.
-            // Calculate normalized barycentric coordinates... 
-            ers::vec3 bar;
-            bar.x() = (f32)weights.x() * tri_surface_inv;
-            bar.y() = (f32)weights.y() * tri_surface_inv;
-            bar.z() = (f32)weights.z() * tri_surface_inv;
-            
-            // Increment the barycentric coordinates before possibly leaving the inner loop.
-            weights += wstepx;			      
-
-            // Negative barycentric coordinates <=> point is outside triangle.
-            if (bar.x() < -ERS_RENDERER_EPSILON || bar.y() < -ERS_RENDERER_EPSILON || bar.z() < -ERS_RENDERER_EPSILON) 
-                continue;
+            shader->~IShaderProgram();
+            m_alloc->Deallocate(shader);
+        }
+    }
+    for (DeferredDraw& draw : m_deferredDraws)
+    {
+        draw.shader->~IShaderProgram();
+        m_alloc->Deallocate(draw.shader);
+    }
+    m_resolveShaders.Clear();
+    m_deferredDraws.Clear();
+    m_deferredTris.Clear();
+    m_deferredVaryings.Clear();
+    m_deferredDraw = -1;
+    memset(m_tileDeferred, 0, sizeof(m_tileDeferred));
+}
 
-            ers::vec3 bar_correct; // ... also calculate the perspective correct barycentric coordinates.
-            bar_correct.x() = bar.x() * p0.w();
-            bar_correct.y() = bar.y() * p1.w();
-            bar_correct.z() = bar.z() * p2.w();
-            bar_correct /= (bar_correct.x() + bar_correct.y() + bar_correct.z());
-       
-            // Low effort wireframe.
-            if (IsEnabled(WIREFRAME) && bar_correct.y() > 0.01f && bar_correct.z() > 0.01f && bar_correct.x() > 0.01f) continue;
-          
-            // Interpolate the z coordinate (in ndc-space). 
-            f32 z_curr = bar.x() * p0.z() + bar.y() * p1.z() + bar.z() * p2.z();
-            z_curr = 0.5f * z_curr + 0.5f;
-
-            // Clip in the z-axis. We already clip against the near z-plane so we don't need z_curr < 0.0f, 
-            // but leaving it in in case I mess around with clipping again.
-            if (z_curr < 0.0f || z_curr > 1.0f) continue; 
-
-            f32 buf_z = GetZValue(x, y);
-            if (!IsEnabled(DEPTH_TEST) || (z_curr <= buf_z)) // early depth test. more negative z is "in front".
-            {              
-                ers::vec4 col;               
-                m_shader->InterpolateVaryings(bar, bar_correct, tri_idx);                     	
-                bool discard = m_shader->FragmentShader(col);           
-                if (!discard)
-                {                  
-                    SetPixel(x, y, col);                   
-                    SetZValue(x, y, z_curr);
-                }
-            }           
+void Renderer::resolveTileJob(void* data, s32 item, s32 thread_idx)
+{
+    Renderer* renderer = (Renderer*)data;
+    renderer->resolveTile(renderer->m_activeTiles[item], thread_idx);
+}
+
+void Renderer::resolveTile(s32 tile_idx, s32 thread_idx)
+{
+    Bbox tile = getTileRect(tile_idx);
+    tile.x_max = ers::min(tile.x_max, m_width - 1);
+    tile.y_max = ers::min(tile.y_max, m_height - 1);
+    prepareTile(tile_idx, CLEAR_COLOR); // deferred triangles only wrote depth so far.
+
+    const s32 count_draws = (s32)m_deferredDraws.GetSize();
+    RasterContext ctx;
+    u32 current_id = ERS_RENDERER_VIS_EMPTY;
+    for (s32 y = tile.y_min; y <= tile.y_max; ++y)
+    {
+        for (s32 x = tile.x_min; x <= tile.x_max; ++x)
+        {
+            const u32 id = m_visBuffer[y * m_width + x];
+            if (id == ERS_RENDERER_VIS_EMPTY) continue;
+            // Left empty, for a Clear that doesn't reach this pixel (see SetScissor and AddDirtyRect).
+            m_visBuffer[y * m_width + x] = ERS_RENDERER_VIS_EMPTY;
+
+            if (id != current_id)
+            {
+                const DeferredTriangle& deferred = m_deferredTris[id];
+                IShaderProgram* shader = (thread_idx == 0) ? 
+                    m_deferredDraws[deferred.draw_idx].shader : 
+                    m_resolveShaders[(thread_idx - 1) * count_draws + deferred.draw_idx];
+                const NdcTriCoords& tri = deferred.tri;
+                shader->SetupTriangle(tri.vars[0], tri.vars[1], tri.vars[2]);
+                const Bbox bbox = getTriangleBoundingBox(tri);
+                setupRasterContext(ctx, tri, bbox.x_min, bbox.y_min, shader);
+                current_id = id;
+            }
+
+            const ers::vec3 bar = ctx.edges.GetBarycentrics(ctx.edges.GetWeights(x, y));
+            ers::vec3 bar_correct;
+            const f32 w = getPerspectiveBarycentrics(*ctx.tri, bar, bar_correct);
+            ers::vec4 col;
+            if (!runFragmentShader<IShaderProgram>(ctx, x, y, bar, bar_correct, w, col))
+                setPixel(x, y, col);
         }
-        weights0 += wstepy;
     }
 }
 
-Renderer::NdcTriCoords Renderer::getNdcTriCoords(ers::vec4& p0, ers::vec4& p1, ers::vec4& p2)
+Renderer::NdcTriCoords Renderer::getNdcTriCoords(const ers::vec4& p0, const ers::vec4& p1, const ers::vec4& p2)
 {
     NdcTriCoords tri;
 
-    // Normalize to screen/image coordinates. [-1, 1] -> [0, 1] -> [0, width-1 or height-1]
-    const f32 w = (f32)m_width - 0.001f;
-    const f32 h = (f32)m_height - 0.001f;
+    // Normalize to fixed-point screen/image coordinates. [-1, 1] -> [0, 1] -> [0, width or height], rounded to the nearest subpixel.
+    // Pixel (x, y) covers [x, x + 1) x [y, y + 1), its center being at (x + 0.5, y + 0.5).
+    const f32 w = (f32)(m_width * ERS_RENDERER_SUBPIXEL_STEPS);
+    const f32 h = (f32)(m_height * ERS_RENDERER_SUBPIXEL_STEPS);
 
-    tri.x0 = (s32)((0.5f + 0.5f * p0.x()) * w);
-    tri.y0 = (s32)((0.5f + 0.5f * p0.y()) * h);
+    tri.x0 = (s32)floorf((0.5f + 0.5f * p0.x()) * w + 0.5f);
+    tri.y0 = (s32)floorf((0.5f + 0.5f * p0.y()) * h + 0.5f);
 
-    tri.x1 = (s32)((0.5f + 0.5f * p1.x()) * w);
-    tri.y1 = (s32)((0.5f + 0.5f * p1.y()) * h);
+    tri.x1 = (s32)floorf((0.5f + 0.5f * p1.x()) * w + 0.5f);
+    tri.y1 = (s32)floorf((0.5f + 0.5f * p1.y()) * h + 0.5f);
 
-    tri.x2 = (s32)((0.5f + 0.5f * p2.x()) * w);
-    tri.y2 = (s32)((0.5f + 0.5f * p2.y()) * h);
-
-    tri.d01 = ers::ivec2(tri.x1 - tri.x0, tri.y0 - tri.y1); // <- opposite sign for the y coordinates of the difference vectors to avoid minus-ing them later.
-    tri.d12 = ers::ivec2(tri.x2 - tri.x1, tri.y1 - tri.y2);
-    tri.d20 = ers::ivec2(tri.x0 - tri.x2, tri.y2 - tri.y0);
+    tri.x2 = (s32)floorf((0.5f + 0.5f * p2.x()) * w + 0.5f);
+    tri.y2 = (s32)floorf((0.5f + 0.5f * p2.y()) * h + 0.5f);
 
     // Calculate signed surface of triangle (actually two times that) for backface culling, barycentric coordinates and checking for degeneracy.
-    tri.surface = tri.d01.y() * tri.x2 + tri.d01.x() * tri.y2 + tri.x0 * tri.y1 - tri.y0 * tri.x1;
+    tri.surface = (s64)(tri.x1 - tri.x0) * (tri.y2 - tri.y0) - (s64)(tri.x2 - tri.x0) * (tri.y1 - tri.y0);
+
+    tri.p0 = p0;
+    tri.p1 = p1;
+    tri.p2 = p2;
+
+    if (tri.surface == 0) return tri;
+
+    // The edge functions, E_k(P) = A_k * P.x + B_k * P.y + C_k, in subpixels. E_k is the (doubled) signed surface 
+    // of the triangle made up of P and the edge opposite of vertex k, so it's equal to surface at vertex k.
+    // They're flipped for back faces, so that the inside of the triangle is always where they are positive.
+    const s64 sign = (tri.surface > 0) ? 1 : -1;
+    const s64 A[3] = { sign * (tri.y1 - tri.y2), sign * (tri.y2 - tri.y0), sign * (tri.y0 - tri.y1) };
+    const s64 B[3] = { sign * (tri.x2 - tri.x1), sign * (tri.x0 - tri.x2), sign * (tri.x1 - tri.x0) };
+    const s64 C[3] = { 
+        sign * ((s64)tri.x1 * tri.y2 - (s64)tri.x2 * tri.y1), 
+        sign * ((s64)tri.x2 * tri.y0 - (s64)tri.x0 * tri.y2), 
+        sign * ((s64)tri.x0 * tri.y1 - (s64)tri.x1 * tri.y0) 
+    };
+
+    for (s32 k = 0; k < 3; ++k)
+    {
+        // Fill rule: pixel centers exactly on an edge belong to the triangle on the edge's left or bottom 
+        // (the inside is towards +x, or +y for horizontal edges), so shared edges are rasterized exactly once.
+        const s64 bias = (A[k] > 0 || (A[k] == 0 && B[k] > 0)) ? 0 : -1;
+
+        // At the center of pixel (x, y): E_k = STEPS * (A_k * x + B_k * y) + (STEPS / 2) * (A_k + B_k) + C_k, 
+        // with the 1st term a multiple of STEPS. So rounding down E_k + bias (which is >= 0 <=> inside) 
+        // to a multiple of STEPS, is the same as rounding down the constant term. The shift rounds towards -infinity.
+        const s64 e0 = (ERS_RENDERER_SUBPIXEL_STEPS / 2) * (A[k] + B[k]) + C[k] + bias;
+        const s64 c = e0 >> ERS_RENDERER_SUBPIXEL_BITS;
+        ERS_ASSERT(c >= INT32_MIN && c <= INT32_MAX);
+        tri.a.e[k] = (s32)A[k];
+        tri.b.e[k] = (s32)B[k];
+        tri.c.e[k] = (s32)c;
+        tri.frac.e[k] = (f32)(e0 - c * ERS_RENDERER_SUBPIXEL_STEPS - bias) / (f32)ERS_RENDERER_SUBPIXEL_STEPS;
+    }
+    tri.surface_inv = (f32)ERS_RENDERER_SUBPIXEL_STEPS / (f32)(sign * tri.surface);
 
     return tri;
 }
@@ -370,28 +1517,53 @@ Renderer::Bbox Renderer::getTriangleBoundingBox(const NdcTriCoords& tri)
     if (tri.x2 < bbox.x_min) bbox.x_min = tri.x2;
     if (tri.y2 < bbox.y_min) bbox.y_min = tri.y2;
 
-    // Clip in the x- and y-axes.
-    bbox.x_min = ers::clamp(bbox.x_min, 0, m_width - 1);
-    bbox.x_max = ers::clamp(bbox.x_max, 0, m_width - 1);
+    // From subpixels to the pixels whose centers (or with MSAA, any of whose samples) are within the above. 
+    // The shifts round towards -infinity.
+    const s32 half_pixel = ERS_RENDERER_SUBPIXEL_STEPS / 2;
+    const s32 margin = IsEnabled(MSAA) ? ERS_RENDERER_MSAA_EXTENT : 0;
+    bbox.x_min = (bbox.x_min - half_pixel - margin + ERS_RENDERER_SUBPIXEL_STEPS - 1) >> ERS_RENDERER_SUBPIXEL_BITS;
+    bbox.y_min = (bbox.y_min - half_pixel - margin + ERS_RENDERER_SUBPIXEL_STEPS - 1) >> ERS_RENDERER_SUBPIXEL_BITS;
+    bbox.x_max = (bbox.x_max - half_pixel + margin) >> ERS_RENDERER_SUBPIXEL_BITS;
+    bbox.y_max = (bbox.y_max - half_pixel + margin) >> ERS_RENDERER_SUBPIXEL_BITS;
+
+    // Clip in the x- and y-axes. The result is empty (min > max) if the triangle misses all pixel centers 
+    // of the viewport, or of the part of it that's drawn to (see getDrawRegion).
+    if (!IsEnabled(SCISSOR_TEST) && !m_partialRedraw)
+    {
+        bbox.x_min = ers::max(bbox.x_min, 0);
+        bbox.x_max = ers::min(bbox.x_max, m_width - 1);
+
+        bbox.y_min = ers::max(bbox.y_min, 0);
+        bbox.y_max = ers::min(bbox.y_max, m_height - 1);
+        return bbox;
+    }
+
+    const Bbox region = getDrawRegion();
+    bbox.x_min = ers::max(bbox.x_min, region.x_min);
+    bbox.x_max = ers::min(bbox.x_max, region.x_max);
 
-    bbox.y_min = ers::clamp(bbox.y_min, 0, m_height - 1);
-    bbox.y_max = ers::clamp(bbox.y_max, 0, m_height - 1);
+    bbox.y_min = ers::max(bbox.y_min, region.y_min);
+    bbox.y_max = ers::min(bbox.y_max, region.y_max);
 
     return bbox;
 }
 
-ers::ivec3 Renderer::getWeights0(const NdcTriCoords& tri, s32 x0, s32 y0)
+Renderer::Bbox Renderer::getTileRect(s32 tile_idx)
 {
-    ers::ivec3 weights0(
-        2 * (tri.d12.y() * x0 + tri.d12.x() * y0 + tri.y2 * tri.x1 - tri.x2 * tri.y1) + tri.d12.x() + tri.d12.y(), 
-        2 * (tri.d20.y() * x0 + tri.d20.x() * y0 + tri.y0 * tri.x2 - tri.x0 * tri.y2) + tri.d20.x() + tri.d20.y(), 
-        2 * (tri.d01.y() * x0 + tri.d01.x() * y0 + tri.y1 * tri.x0 - tri.x1 * tri.y0) + tri.d01.x() + tri.d01.y() 
-    );
-    return weights0;
+    Bbox tile;
+    tile.x_min = (tile_idx % ERS_RENDERER_MAX_TILES_X) * ERS_RENDERER_TILE_SIZE;
+    tile.y_min = (tile_idx / ERS_RENDERER_MAX_TILES_X) * ERS_RENDERER_TILE_SIZE;
+    tile.x_max = ers::min(tile.x_min + ERS_RENDERER_TILE_SIZE - 1, m_width - 1);
+    tile.y_max = ers::min(tile.y_min + ERS_RENDERER_TILE_SIZE - 1, m_height - 1);
+    return tile;
 }
 
 void Renderer::WriteToFile(const char* filename, bool flip)
 {
+    Flush();
+    resolveBuffers();
+    prepareBuffers(CLEAR_COLOR);
+    ERS_ASSERT(m_colorBuffer != nullptr);
 	stbi_flip_vertically_on_write(flip);
 	s32 rc = stbi_write_png(
         filename, 
@@ -404,42 +1576,368 @@ void Renderer::WriteToFile(const char* filename, bool flip)
 	ERS_ASSERT(rc != 0);
 }
 
-void Renderer::lerpVaryings(f32* out, f32* in1, f32* in2, f32 t, s32 count)
+void Renderer::UpscaleColorBuffer(u8* dst, s32 width, s32 height)
+{
+    ERS_ASSERT(dst != nullptr && width > 0 && height > 0);
+    const u8* colors = GetColorBuffer(); // flushes and resolves.
+    ERS_ASSERT(colors != nullptr);
+    ERS_UNUSED(colors);
+    m_upscaleTarget.pixels = (u32*)dst;
+    m_upscaleTarget.width = width;
+    m_upscaleTarget.height = height;
+
+    const s32 count_bands = (height + ERS_RENDERER_UPSCALE_ROWS - 1) / ERS_RENDERER_UPSCALE_ROWS;
+    if (m_threadPool.GetThreadCount() > 1 && count_bands > 1)
+    {
+        m_threadPool.Run(upscaleRowsJob, this, count_bands);
+    }
+    else
+    {
+        for (s32 i = 0; i < count_bands; ++i)
+            upscaleRows(i);
+    }
+}
+
+// Lerps the 4 channels of two RGBA8 pixels at once, two per 32 bits, t in [0, 256].
+static u32 lerpPixels(u32 a, u32 b, u32 t)
+{
+    const u32 rb = ((((a & 0x00ff00ffu) * (256u - t) + (b & 0x00ff00ffu) * t)) >> 8) & 0x00ff00ffu;
+    const u32 ga = (((a >> 8) & 0x00ff00ffu) * (256u - t) + ((b >> 8) & 0x00ff00ffu) * t) & 0xff00ff00u;
+    return rb | ga;
+}
+
+void Renderer::upscaleRows(s32 band)
+{
+    // Destination pixel centers map to (x + 0.5) * m_width / width - 0.5 in the color buffer, clamped to its edges.
+    // In 16.16 fixed point, with the weights rounded to 8 bits.
+    const UpscaleTarget& target = m_upscaleTarget;
+    const u32* src = (const u32*)m_colorBuffer;
+    const s32 step_x = (s32)(((s64)m_width << 16) / target.width);
+    const s32 step_y = (s32)(((s64)m_height << 16) / target.height);
+    const s32 y_end = ers::min((band + 1) * ERS_RENDERER_UPSCALE_ROWS, target.height);
+    for (s32 y = band * ERS_RENDERER_UPSCALE_ROWS; y < y_end; ++y)
+    {
+        const s32 fy = ers::max(y * step_y + step_y / 2 - 0x8000, 0);
+        const s32 y0 = ers::min(fy >> 16, m_height - 1);
+        const s32 y1 = ers::min(y0 + 1, m_height - 1);
+        const u32 wy = (u32)(fy >> 8) & 0xffu;
+        const u32* row0 = src + (size_t)y0 * m_width;
+        const u32* row1 = src + (size_t)y1 * m_width;
+        u32* out = target.pixels + (size_t)y * target.width;
+
+        s32 fx = step_x / 2 - 0x8000;
+        for (s32 x = 0; x < target.width; ++x, fx += step_x)
+        {
+            const s32 fx_clamped = ers::max(fx, 0);
+            const s32 x0 = ers::min(fx_clamped >> 16, m_width - 1);
+            const s32 x1 = ers::min(x0 + 1, m_width - 1);
+            const u32 wx = (u32)(fx_clamped >> 8) & 0xffu;
+            out[x] = lerpPixels(lerpPixels(row0[x0], row0[x1], wx), lerpPixels(row1[x0], row1[x1], wx), wy);
+        }
+    }
+}
+
+void Renderer::upscaleRowsJob(void* data, s32 item, s32 thread_idx)
+{
+    ERS_UNUSED(thread_idx);
+    ((Renderer*)data)->upscaleRows(item);
+}
+
+void Renderer::lerpVaryings(f32* out, const f32* in1, const f32* in2, f32 t, s32 count)
 {
     const f32 tm = 1.0f - t;
     for (s32 i = 0; i < count; ++i)
         out[i] = tm * in1[i] + t * in2[i];
 }
 
-void Renderer::clipGetOneTriangle(
-    ers::vec4& p0, 
-    ers::vec4& p1, 
-    ers::vec4& p2, // <-- is inside
-    f32& t0,
-    f32& t1)
-{
-    t0 = (-p0.w() - p0.z()) / (p2.w() + p2.z() - p0.w() - p0.z());
-    t1 = (-p1.w() - p1.z()) / (p2.w() + p2.z() - p1.w() - p1.z());
-    p0 = (1.0f - t0) * p0 + t0 * p2;
-    p1 = (1.0f - t1) * p1 + t1 * p2;
-}
-
-void Renderer::clipGetTwoTriangles(
-    ers::vec4& p0, 
-    ers::vec4& p1, 
-    ers::vec4& p2,
-    ers::vec4& q0, 
-    ers::vec4& q1, 
-    ers::vec4& q2,
-    f32& t0,
-    f32& t1)
-{
-    t0 = (-p0.w() - p0.z()) / (p2.w() + p2.z() - p0.w() - p0.z());
-    t1 = (-p0.w() - p0.z()) / (p1.w() + p1.z() - p0.w() - p0.z());
-    q0 = (1.0f - t1) * p0 + t1 * p1;
-    p0 = (1.0f - t0) * p0 + t0 * p2;
-    q1 = p1;
-    q2 = p0;
+void Renderer::copyFlatVaryings(f32* out, const f32* in, s32 count, s32 count_flat)
+{
+    for (s32 i = count - count_flat; i < count; ++i)
+        out[i] = in[i];
+}
+
+u32 Renderer::packColor(const ers::vec4& color)
+{
+    const u8 rgba[4] = { 
+        (u8)(ers::clamp(color.x(), 0.0f, 1.0f) * 255.999f), 
+        (u8)(ers::clamp(color.y(), 0.0f, 1.0f) * 255.999f), 
+        (u8)(ers::clamp(color.z(), 0.0f, 1.0f) * 255.999f), 
+        (u8)(ers::clamp(color.w(), 0.0f, 1.0f) * 255.999f) 
+    };
+    u32 result;
+    memcpy(&result, rgba, sizeof(result));
+    return result;
+}
+
+u32 Renderer::getSampleMask(const EdgeFunctions& edges, const ers::ivec3& weights)
+{
+    u32 mask = 0;
+    for (s32 s = 0; s < ERS_RENDERER_MSAA_SAMPLES; ++s)
+    {
+        const ers::ivec3& shift = edges.sample_shifts[s];
+        if (((weights.x() + shift.x()) | (weights.y() + shift.y()) | (weights.z() + shift.z())) >= 0) 
+            mask |= 1u << s;
+    }
+    return mask;
+}
+
+void Renderer::setSamples(s32 x, s32 y, const ers::vec4& color, u32 sample_mask)
+{
+    const u32 rgba = packColor(color);
+    const size_t pixel = (size_t)y * m_width + x;
+    u32* samples = &m_sampleColors[pixel * ERS_RENDERER_MSAA_SAMPLES];
+    if (sample_mask == (1u << ERS_RENDERER_MSAA_SAMPLES) - 1u)
+    {
+        samples[0] = rgba;
+        m_sampleCompressed[pixel] = 1;
+        return;
+    }
+
+    // A partially covered pixel (i.e. on a triangle's edge) has to store every sample.
+    expandSamples(pixel);
+    for (s32 s = 0; s < ERS_RENDERER_MSAA_SAMPLES; ++s)
+        if ((sample_mask & (1u << s)) != 0) samples[s] = rgba;
+}
+
+void Renderer::expandSamples(size_t pixel)
+{
+    if (m_sampleCompressed[pixel] == 0) return;
+    u32* samples = &m_sampleColors[pixel * ERS_RENDERER_MSAA_SAMPLES];
+    for (s32 s = 1; s < ERS_RENDERER_MSAA_SAMPLES; ++s) samples[s] = samples[0];
+    m_sampleCompressed[pixel] = 0;
+}
+
+void Renderer::setSampleDepths(s32 x, s32 y, const f32* z, u32 sample_mask)
+{
+    f32* samples = &m_sampleDepths[((size_t)y * m_width + x) * ERS_RENDERER_MSAA_SAMPLES];
+    f32 z_max = 0.0f;
+    for (s32 s = 0; s < ERS_RENDERER_MSAA_SAMPLES; ++s)
+    {
+        if ((sample_mask & (1u << s)) != 0) samples[s] = z[s];
+        z_max = ers::max(z_max, samples[s]);
+    }
+    setZValue(x, y, z_max);
+}
+
+void Renderer::clearSamples(size_t position, s32 count, u8 flags)
+{
+    if ((flags & CLEAR_COLOR) != 0)
+    {
+        u32* samples = &m_sampleColors[position * ERS_RENDERER_MSAA_SAMPLES];
+        for (s32 i = 0; i < count; ++i) samples[i * ERS_RENDERER_MSAA_SAMPLES] = m_clearColor;
+        memset(&m_sampleCompressed[position], 1, count);
+    }
+    if ((flags & CLEAR_DEPTH) != 0)
+    {
+        u32 depth;
+        const f32 clear_depth = ERS_RENDERER_CLEAR_DEPTH;
+        memcpy(&depth, &clear_depth, sizeof(depth));
+        fillValues((u32*)&m_sampleDepths[position * ERS_RENDERER_MSAA_SAMPLES], depth, count * ERS_RENDERER_MSAA_SAMPLES);
+    }
+}
+
+void Renderer::loadSamples()
+{
+    // Every sample starts out as its pixel. Tiles with pending clears are cleared along with their samples later on.
+    const s32 count = m_width * m_height;
+    if (m_sampleColors.GetSize() < (size_t)count * ERS_RENDERER_MSAA_SAMPLES)
+    {
+        m_sampleColors.Resize(count * ERS_RENDERER_MSAA_SAMPLES);
+        m_sampleDepths.Resize(count * ERS_RENDERER_MSAA_SAMPLES);
+        m_sampleCompressed.Resize(count);
+    }
+
+    const u32* colors = (const u32*)m_colorBuffer;
+    for (s32 i = 0; i < count; ++i)
+    {
+        if (colors != nullptr) m_sampleColors[i * ERS_RENDERER_MSAA_SAMPLES] = colors[i];
+        m_sampleCompressed[i] = 1;
+        for (s32 s = 0; s < ERS_RENDERER_MSAA_SAMPLES; ++s) m_sampleDepths[i * ERS_RENDERER_MSAA_SAMPLES + s] = m_zBuffer[i];
+    }
+}
+
+void Renderer::resolveSamples()
+{
+    if (!IsEnabled(MSAA) || m_colorBuffer == nullptr) return;
+    prepareBuffers(CLEAR_COLOR);
+
+    // Compressed pixels are copied, the others get the (rounded) average of their samples.
+    const s32 count = m_width * m_height;
+    const u32* samples = &m_sampleColors[0];
+    const u8* compressed = &m_sampleCompressed[0];
+    u32* colors = (u32*)m_colorBuffer;
+#if defined(ERS_SIMD_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(ERS_RENDERER_MSAA_SAMPLES / 2);
+#endif
+    for (s32 i = 0; i < count; ++i)
+    {
+        const u32* pixel_samples = samples + i * ERS_RENDERER_MSAA_SAMPLES;
+        if (compressed[i] != 0)
+        {
+            colors[i] = pixel_samples[0];
+            continue;
+        }
+#if defined(ERS_SIMD_SSE2)
+        // The 4 RGBA8 samples widened to 16 bits, summed up per channel.
+        const __m128i s = _mm_loadu_si128((const __m128i*)pixel_samples);
+        __m128i sum = _mm_add_epi16(_mm_unpacklo_epi8(s, zero), _mm_unpackhi_epi8(s, zero));
+        sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+        sum = _mm_srli_epi16(_mm_add_epi16(sum, round), 2);
+        colors[i] = (u32)_mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+#else
+        u8 rgba[4];
+        for (s32 c = 0; c < 4; ++c)
+        {
+            u32 sum = ERS_RENDERER_MSAA_SAMPLES / 2;
+            for (s32 s = 0; s < ERS_RENDERER_MSAA_SAMPLES; ++s) sum += (pixel_samples[s] >> (8 * c)) & 0xffu;
+            rgba[c] = (u8)(sum / ERS_RENDERER_MSAA_SAMPLES);
+        }
+        memcpy(&colors[i], rgba, sizeof(rgba));
+#endif
+    }
+}
+
+ers::vec4 Renderer::unpackColor(u32 rgba)
+{
+    u8 c[4];
+    memcpy(c, &rgba, sizeof(c));
+    const f32 scale = 1.0f / 255.0f;
+    return ers::vec4((f32)c[0] * scale, (f32)c[1] * scale, (f32)c[2] * scale, (f32)c[3] * scale);
+}
+
+u32 Renderer::blendColor(u32 dst, const ers::vec4& color)
+{
+    // Source over: the fragment's alpha is how much of what's behind it it covers.
+    const ers::vec4 d = unpackColor(dst);
+    const f32 a = ers::clamp(color.w(), 0.0f, 1.0f);
+    const f32 t = 1.0f - a;
+    return packColor(ers::vec4(
+        color.x() * a + d.x() * t, 
+        color.y() * a + d.y() * t, 
+        color.z() * a + d.z() * t, 
+        a + d.w() * t
+    ));
+}
+
+void Renderer::blendPixel(s32 x, s32 y, const ers::vec4& color)
+{
+    u32* pixel = (u32*)m_colorBuffer + (size_t)y * m_width + x;
+    *pixel = blendColor(*pixel, color);
+}
+
+void Renderer::blendSamples(s32 x, s32 y, const ers::vec4& color, u32 sample_mask)
+{
+    const size_t pixel = (size_t)y * m_width + x;
+    u32* samples = &m_sampleColors[pixel * ERS_RENDERER_MSAA_SAMPLES];
+    if (m_sampleCompressed[pixel] != 0 && sample_mask == (1u << ERS_RENDERER_MSAA_SAMPLES) - 1u)
+    {
+        samples[0] = blendColor(samples[0], color);
+        return;
+    }
+    expandSamples(pixel);
+    for (s32 s = 0; s < ERS_RENDERER_MSAA_SAMPLES; ++s)
+        if ((sample_mask & (1u << s)) != 0) samples[s] = blendColor(samples[s], color);
+}
+
+void Renderer::accumulateFragment(s32 x, s32 y, const ers::vec4& color, f32 w, u32 sample_mask)
+{
+    const f32 a = ers::clamp(color.w(), 0.0f, 1.0f);
+    if (a <= 0.0f) return;
+
+    // Weight falling off with the view depth (McGuire and Bavoil, "Weighted Blended Order-Independent Transparency", 
+    // equation 9), so that nearer fragments dominate the average color.
+    const f32 d0 = w * (1.0f / 5.0f);
+    const f32 d1 = w * (1.0f / 200.0f);
+    const f32 d1_3 = d1 * d1 * d1;
+    f32 weight = a * a * ers::clamp(10.0f / (1.0e-5f + d0 * d0 + d1_3 * d1_3), 1.0e-2f, 3.0e3f);
+
+    // The color is averaged per pixel, with the fragment's share of the samples scaling its weight. The revealage is 
+    // kept per sample though, so that the fragments of two triangles sharing an edge reveal the pixel behind them only once.
+    weight *= (f32)ers_count_bits(sample_mask) / (f32)ERS_RENDERER_MSAA_SAMPLES;
+
+    const size_t pixel = (size_t)y * m_width + x;
+    ers::vec4& accum = m_oitAccumulation[pixel];
+    accum.x() += color.x() * weight;
+    accum.y() += color.y() * weight;
+    accum.z() += color.z() * weight;
+    accum.w() += weight;
+    f32* revealage = &m_oitRevealage[pixel * ERS_RENDERER_MSAA_SAMPLES];
+    for (s32 s = 0; s < ERS_RENDERER_MSAA_SAMPLES; ++s)
+        if ((sample_mask & (1u << s)) != 0) revealage[s] *= 1.0f - a;
+    m_tileAccumulated[(y / ERS_RENDERER_TILE_SIZE) * ERS_RENDERER_MAX_TILES_X + x / ERS_RENDERER_TILE_SIZE] = 1;
+}
+
+void Renderer::reserveTransparency()
+{
+    // Everything outside of the flagged tiles is reset already, whatever the viewport's layout.
+    const size_t count = (size_t)m_width * m_height;
+    if (m_oitAccumulation.GetSize() >= count) return;
+    m_oitAccumulation.Resize(count);
+    m_oitRevealage.Resize(count * ERS_RENDERER_MSAA_SAMPLES);
+    for (size_t i = 0; i < count; ++i) m_oitAccumulation[i] = ers::vec4(0.0f);
+    for (size_t i = 0; i < count * ERS_RENDERER_MSAA_SAMPLES; ++i) m_oitRevealage[i] = 1.0f;
+}
+
+void Renderer::clearTransparency(s32 tile_idx)
+{
+    const Bbox tile = getTileRect(tile_idx);
+    for (s32 y = tile.y_min; y <= tile.y_max; ++y)
+    {
+        for (s32 x = tile.x_min; x <= tile.x_max; ++x)
+        {
+            const size_t pixel = (size_t)y * m_width + x;
+            m_oitAccumulation[pixel] = ers::vec4(0.0f);
+            for (s32 s = 0; s < ERS_RENDERER_MSAA_SAMPLES; ++s) m_oitRevealage[pixel * ERS_RENDERER_MSAA_SAMPLES + s] = 1.0f;
+        }
+    }
+    m_tileAccumulated[tile_idx] = 0;
+}
+
+void Renderer::resolveTransparency()
+{
+    if (!IsEnabled(OIT)) return;
+
+    // The weighted average of the accumulated colors, covering what's behind them by 1 - revealage. With MSAA, it's 
+    // composited over every sample with its own revealage, otherwise over the pixel with the samples' average.
+    const bool msaa = IsEnabled(MSAA);
+    for (s32 tile_idx = 0; tile_idx < ERS_RENDERER_MAX_TILES_X * ERS_RENDERER_MAX_TILES_Y; ++tile_idx)
+    {
+        if (m_tileAccumulated[tile_idx] == 0) continue;
+        const Bbox tile = getTileRect(tile_idx);
+        for (s32 y = tile.y_min; y <= tile.y_max; ++y)
+        {
+            for (s32 x = tile.x_min; x <= tile.x_max; ++x)
+            {
+                const size_t pixel = (size_t)y * m_width + x;
+                const ers::vec4& accum = m_oitAccumulation[pixel];
+                if (accum.w() <= 0.0f) continue;
+                const f32 accum_w = ers::clamp(accum.w(), 1.0e-4f, 5.0e4f);
+                ers::vec4 color(accum.x() / accum_w, accum.y() / accum_w, accum.z() / accum_w, 0.0f);
+                const f32* revealage = &m_oitRevealage[pixel * ERS_RENDERER_MSAA_SAMPLES];
+                if (!msaa)
+                {
+                    f32 sum = 0.0f;
+                    for (s32 s = 0; s < ERS_RENDERER_MSAA_SAMPLES; ++s) sum += revealage[s];
+                    color.w() = 1.0f - sum / (f32)ERS_RENDERER_MSAA_SAMPLES;
+                    blendPixel(x, y, color);
+                    continue;
+                }
+
+                bool uniform = true;
+                for (s32 s = 1; s < ERS_RENDERER_MSAA_SAMPLES; ++s) uniform = uniform && (revealage[s] == revealage[0]);
+                if (!uniform) expandSamples(pixel);
+                u32* samples = &m_sampleColors[pixel * ERS_RENDERER_MSAA_SAMPLES];
+                const s32 count = (m_sampleCompressed[pixel] != 0) ? 1 : ERS_RENDERER_MSAA_SAMPLES;
+                for (s32 s = 0; s < count; ++s)
+                {
+                    color.w() = 1.0f - revealage[s];
+                    samples[s] = blendColor(samples[s], color);
+                }
+            }
+        }
+        clearTransparency(tile_idx);
+    }
 }
 
 void Renderer::normalizeCoordinates(ers::vec4& p)
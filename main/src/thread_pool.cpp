@@ -0,0 +1,123 @@
+#include "thread_pool.h"
+
+#ifndef __EMSCRIPTEN__
+
+ThreadPool::ThreadPool(s32 count_workers)
+	:
+	m_next(0),
+	m_generation(0),
+	m_busy(0),
+	m_quit(false),
+	m_job(nullptr),
+	m_data(nullptr),
+	m_count(0)
+{
+	if (count_workers < 0)
+	{
+		const s32 hw = (s32)std::thread::hardware_concurrency();
+		count_workers = (hw > 1) ? hw - 1 : 0;
+	}
+
+	m_workers.Reserve(count_workers);
+	for (s32 i = 0; i < count_workers; ++i)
+		m_workers.PushBack(std::thread(&ThreadPool::workerLoop, this, i + 1));
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_wake.notify_all();
+	for (std::thread& worker : m_workers)
+		worker.join();
+}
+
+void ThreadPool::Run(job_t job, void* data, s32 count)
+{
+	if (count <= 0) return;
+
+	// Not worth waking anybody up for a single item.
+	if (m_workers.GetSize() == 0 || count == 1)
+	{
+		for (s32 i = 0; i < count; ++i)
+			job(data, i, 0);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_job = job;
+		m_data = data;
+		m_count = count;
+		m_next.store(0);
+		m_busy = (s32)m_workers.GetSize();
+		++m_generation;
+	}
+	m_wake.notify_all();
+
+	consume(0);
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_done.wait(lock, [this] { return m_busy == 0; });
+}
+
+s32 ThreadPool::GetThreadCount() const
+{
+	return (s32)m_workers.GetSize() + 1;
+}
+
+void ThreadPool::workerLoop(s32 thread_idx)
+{
+	u64 seen_generation = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_wake.wait(lock, [&] { return m_quit || m_generation != seen_generation; });
+			if (m_quit) return;
+			seen_generation = m_generation;
+		}
+
+		consume(thread_idx);
+
+		bool last;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			last = (--m_busy == 0);
+		}
+		if (last) m_done.notify_one();
+	}
+}
+
+void ThreadPool::consume(s32 thread_idx)
+{
+	for (s32 i = m_next.fetch_add(1); i < m_count; i = m_next.fetch_add(1))
+		m_job(m_data, i, thread_idx);
+}
+
+#else
+
+ThreadPool::ThreadPool(s32 count_workers) : m_job(nullptr), m_data(nullptr), m_count(0)
+{
+	ERS_UNUSED(count_workers);
+}
+
+ThreadPool::~ThreadPool() { }
+
+void ThreadPool::Run(job_t job, void* data, s32 count)
+{
+	for (s32 i = 0; i < count; ++i)
+		job(data, i, 0);
+}
+
+s32 ThreadPool::GetThreadCount() const
+{
+	return 1;
+}
+
+void ThreadPool::workerLoop(s32 thread_idx) { ERS_UNUSED(thread_idx); }
+void ThreadPool::consume(s32 thread_idx) { ERS_UNUSED(thread_idx); }
+
+#endif
\ No newline at end of file